@@ -0,0 +1,187 @@
+/*
+ * Microbenchmark for the translation index.
+ *
+ * Compares the flat index in src/codeenv.c against the uthash index it
+ * replaced (the harness from test.c). A list of basic block addresses is
+ * built the way linkedlist.c builds its list, every block is inserted into
+ * both indexes, and then both replay the same lookup trace. The trace is
+ * skewed so that a few blocks are looked up most of the time, the way a
+ * loop-heavy guest exits to the same blocks over and over.
+ *
+ * Build and run from this directory:
+ *   gcc -O2 -msse2 -I../src indexbench.c ../src/codeenv.c -o indexbench
+ *   ./indexbench [numBlocks] [numLookups]
+ */
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "uthash.h"
+#include "codeenv.h"
+
+#define INIT_LIST(x) \
+	SLIST_HEAD(slisthead, entry) x = SLIST_HEAD_INITIALIZER(x); \
+	SLIST_INIT(&x)
+#define INSERT_ITEM(head, item) \
+	SLIST_INSERT_HEAD(&head, item, entries)
+#define LOOP_THRU_LIST(itrPtr, head) \
+	SLIST_FOREACH(itrPtr, &head, entries)
+
+#define TEXT_BASE	0x8000
+#define AVG_BLOCK_SIZE	5	/* ARM instructions per basic block */
+
+/* one basic block: ARM start address and translated address */
+struct entry
+{
+	uint32_t armAddr;
+	void *x86Addr;
+	SLIST_ENTRY(entry) entries;
+};
+
+/* the uthash index, as in test.c */
+struct hash_struct
+{
+	void *ptr;			/* key field */
+	void *value;			/* value */
+	UT_hash_handle hh;		/* makes this structure hashable */
+};
+
+struct hash_struct *translationCache = NULL;
+
+int UtInsertItem(void *address, void *startBlockAddress)
+{
+	struct hash_struct *s;
+
+	s = malloc(sizeof(struct hash_struct));
+	if(s == NULL)
+		return -1;
+
+	s->ptr = address;
+	s->value = startBlockAddress;
+	HASH_ADD(hh, translationCache, ptr, sizeof(void *), s);
+	return 0;
+}
+
+void* UtGetItem(void *address)
+{
+	struct hash_struct *s;
+
+	HASH_FIND(hh, translationCache, &address, sizeof(void *), s);
+	return (s == NULL)?NULL:s->value;
+}
+
+void UtFreeHashTableMemory(void)
+{
+	struct hash_struct *s, *next;
+
+	for(s = translationCache; s != NULL; s = next){
+		next = s->hh.next;
+		free(s);
+	}
+	translationCache = NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t numBlocks = (argc > 1)?atoi(argv[1]):20000;
+	uint32_t numLookups = (argc > 2)?atoi(argv[2]):20000000;
+	uint32_t textSize = numBlocks * AVG_BLOCK_SIZE * 4;
+	struct entry *blocks, *np;
+	void **trace;
+	uintptr_t sum;
+	double t0, t1;
+	uint32_t i, misses;
+
+	INIT_LIST(head);
+
+	blocks = malloc(numBlocks * sizeof(struct entry));
+	trace = malloc(numLookups * sizeof(void *));
+	if(blocks == NULL || trace == NULL){
+		printf("Out of memory\n");
+		return -1;
+	}
+
+	/* lay blocks out over the text segment, in translation order */
+	srand(1);
+	for(i = 0; i < numBlocks; i++){
+		blocks[i].armAddr = TEXT_BASE + 4 * (i * AVG_BLOCK_SIZE +
+			rand() % AVG_BLOCK_SIZE);
+		blocks[i].x86Addr = (void *)(uintptr_t)(0x90000000 + i * 64);
+		INSERT_ITEM(head, &blocks[i]);
+	}
+
+	/* 90% of exits go to 1% of the blocks */
+	for(i = 0; i < numLookups; i++){
+		uint32_t b = (rand() % 10 != 0)?
+			rand() % (numBlocks / 100 + 1):rand() % numBlocks;
+		trace[i] = (void *)(uintptr_t)blocks[b].armAddr;
+	}
+
+	if(initTranslationIndex(textSize) == -1)
+		return -1;
+
+	t0 = now();
+	LOOP_THRU_LIST(np, head)
+		UtInsertItem((void *)(uintptr_t)np->armAddr, np->x86Addr);
+	t1 = now();
+	printf("uthash insert: %8.2f ns/block\n", (t1 - t0) / numBlocks);
+
+	t0 = now();
+	LOOP_THRU_LIST(np, head)
+		InsertItem((void *)(uintptr_t)np->armAddr, np->x86Addr);
+	t1 = now();
+	printf("index  insert: %8.2f ns/block\n", (t1 - t0) / numBlocks);
+
+	/* both indexes must agree, including on misses */
+	misses = 0;
+	LOOP_THRU_LIST(np, head){
+		if(UtGetItem((void *)(uintptr_t)np->armAddr) != np->x86Addr ||
+		   GetItem((void *)(uintptr_t)np->armAddr) != np->x86Addr)
+			misses++;
+		if(GetItem((void *)(uintptr_t)(np->armAddr + textSize)) != NULL)
+			misses++;
+	}
+	if(misses != 0){
+		printf("Index mismatch on %u blocks\n", misses);
+		return -1;
+	}
+
+	sum = 0;
+	t0 = now();
+	for(i = 0; i < numLookups; i++)
+		sum += (uintptr_t)UtGetItem(trace[i]);
+	t1 = now();
+	printf("uthash lookup: %8.2f ns/lookup (%lx)\n",
+		(t1 - t0) / numLookups, (unsigned long)sum);
+
+	sum = 0;
+	t0 = now();
+	for(i = 0; i < numLookups; i++)
+		sum += (uintptr_t)GetItem(trace[i]);
+	t1 = now();
+	printf("index  lookup: %8.2f ns/lookup (%lx)\n",
+		(t1 - t0) / numLookups, (unsigned long)sum);
+
+	t0 = now();
+	UtFreeHashTableMemory();
+	t1 = now();
+	printf("uthash free:   %8.2f us\n", (t1 - t0) / 1e3);
+
+	t0 = now();
+	FreeHashTableMemory();
+	t1 = now();
+	printf("index  free:   %8.2f us\n", (t1 - t0) / 1e3);
+
+	free(trace);
+	free(blocks);
+	return 0;
+}
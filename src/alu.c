@@ -2,6 +2,9 @@
 #include "decodeprivate.h"
 #include "codegen.h"
 
+#define STRINGIFY_(x)           #x
+#define STRINGIFY(x)            STRINGIFY_(x)
+
 opcodeHandler_t opcodeHandler[NUM_OPCODES] = {
     andHandler, eorHandler, subHandler, rsbHandler,
     addHandler, adcHandler, sbcHandler, rscHandler,
@@ -9,73 +12,184 @@ opcodeHandler_t opcodeHandler[NUM_OPCODES] = {
     orrHandler, movHandler, bicHandler, mvnHandler
 };
 
+/*
+// The barrel shifter
+//
+// The second operand of a data processing instruction, and the offset of a
+// load or store, may be a register put through the barrel shifter.
+// emitShift() shifts host register reg by an immediate amount. An amount of
+// 0 stands for LSR #32 and ASR #32, which give 0 and the sign, and for
+// RRX, which is not supported. The carry out of the shifter is not
+// recorded, so neither are the flag setting logical instructions that
+// shift their operand.
+*/
+uint8_t emitShift(uint8_t *pX86Addr, uint8_t reg, shift_t type,
+                  uint8_t amount){
+  static const uint8_t shiftExt[] = { 4, 5, 7, 1 }; /* shl, shr, sar, ror */
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+
+  instInfo.pX86Addr = pX86Addr;
+  if(type == LSL && amount == 0){
+    return 0;
+  }
+  if(type == LSR && amount == 0){
+    ADD_REX(0,reg,reg);
+    ADD_BYTE(X86_OP_XOR_RM32_TO_REG);
+    ADD_BYTE(0xC0 | ((reg & 7) << 3) | (reg & 7)); /* xor reg, reg */
+    return count;
+  }
+  if(type == ROR && amount == 0){
+    UNSUPPORTED;
+  }
+  ADD_REX(0,0,reg);
+  ADD_BYTE(X86_OP_SHIFT_IMM8_RM32);
+  ADD_BYTE(0xC0 | (shiftExt[type] << 3) | (reg & 7));
+  ADD_BYTE((type == ASR && amount == 0)?31:amount);
+  return count;
+}
+
+/*
+// Emit lea reg, [base + index << scale + disp], a shift by up to 3 and two
+// additions in one instruction that leaves the flags alone. index may be
+// X86_NOREG. The sum is taken to 32 bits, as ARM addresses wrap.
+*/
+uint8_t emitLea(uint8_t *pX86Addr, uint8_t reg, uint8_t base, uint8_t index,
+                uint8_t scale, int32_t disp){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+  uint8_t rex = X86_PRE_REX;
+
+  instInfo.pX86Addr = pX86Addr;
+  if(reg >= X86_R8){
+    rex |= X86_REX_R;
+  }
+  if(index != X86_NOREG && index >= X86_R8){
+    rex |= X86_REX_X;
+  }
+  if(base >= X86_R8){
+    rex |= X86_REX_B;
+  }
+  if(rex != X86_PRE_REX){
+    ADD_BYTE(rex);
+  }
+  ADD_BYTE(X86_OP_LEA);
+  if(disp == 0 && (base & 7) != X86_EBP){
+    ADD_BYTE(0x04 | ((reg & 7) << 3)); /* SIB, no displacement */
+  }else if(disp >= -128 && disp <= 127){
+    ADD_BYTE(0x44 | ((reg & 7) << 3)); /* SIB + disp8 */
+  }else{
+    ADD_BYTE(0x84 | ((reg & 7) << 3)); /* SIB + disp32 */
+  }
+  ADD_BYTE((scale << 6) |
+    (((index == X86_NOREG)?X86_ESP:(index & 7)) << 3) | (base & 7));
+  if(disp != 0 || (base & 7) == X86_EBP){
+    if(disp >= -128 && disp <= 127){
+      ADD_BYTE(disp);
+    }else{
+      ADD_WORD(disp);
+    }
+  }
+  return count;
+}
+
+/*
+// Load the register second operand of a data processing instruction into
+// host register reg: Rm shifted by an immediate, or by the bottom byte of
+// Rs. x86 shifts by CL and takes the amount modulo 32, where ARM shifts
+// by up to 255, so LSL and LSR by 32 or more are made to give 0, and ASR
+// to give the sign. ROR comes out the same. ECX holds the amount, so these
+// are never branchless (see "Branchless conditions" in decode.c).
+*/
+static uint8_t loadOperand2(const struct decodeInfo_t *pInst,
+                            uint8_t *pX86Addr, uint8_t reg){
+  static const uint8_t shiftExt[] = { 4, 5, 7, 1 }; /* shl, shr, sar, ror */
+  struct decodeInfo_t instInfo = *pInst;
+  uint8_t count = 0;
+
+  instInfo.pX86Addr = pX86Addr;
+  LOAD_ARM_REG(reg,DPREG_INFO.Rm);
+  if(DPREG_INFO.shiftImm == TRUE){
+    return count + emitShift(pX86Addr + count, reg, DPREG_INFO.shiftType,
+      DPREG_INFO.shiftAmt);
+  }
+
+  LOAD_ARM_REG(X86_ECX,DPREG_INFO.Rs);
+  ADD_BYTE(X86_PRE_JCC);
+  ADD_BYTE(X86_OP_MOVZX_RM8);
+  ADD_BYTE(0xC9); /* MOD R/M - movzx ecx, cl */
+  if(DPREG_INFO.shiftType == ASR){
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xF9); /* MOD R/M - cmp ecx, imm8 */
+    ADD_BYTE(31);
+    ADD_BYTE(X86_OP_JBE_REL8);
+    ADD_BYTE(5);
+    ADD_BYTE(X86_OP_MOV_IMM_TO_EAX + X86_ECX);
+    ADD_WORD(31);
+  }
+  ADD_BYTE(X86_OP_SHIFT_CL_RM32);
+  ADD_BYTE(0xC0 | (shiftExt[DPREG_INFO.shiftType] << 3) | reg);
+  if(DPREG_INFO.shiftType == LSL || DPREG_INFO.shiftType == LSR){
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xF9); /* MOD R/M - cmp ecx, imm8 */
+    ADD_BYTE(32);
+    ADD_BYTE(X86_OP_SBB_RM32_TO_REG);
+    ADD_BYTE(0xC9); /* MOD R/M - sbb ecx, ecx: -1 below 32, else 0 */
+    ADD_BYTE(X86_OP_AND_REG_TO_RM32);
+    ADD_BYTE(0xC8 | reg); /* MOD R/M - and reg, ecx */
+  }
+  return count;
+}
+
+/*
+// Does the second operand go through the barrel shifter at all?
+*/
+#define SHIFTED(info)   ((info).shiftImm == FALSE || (info).shiftAmt != 0 ||\
+                         (info).shiftType != LSL)
+
+#define LOAD_OPERAND2(reg)                              \
+  count += loadOperand2(&instInfo, instInfo.pX86Addr + count, reg);
+
+#define REJECT_SHIFTER_CARRY                            \
+  if(DPREG_INFO.S == TRUE && SHIFTED(DPREG_INFO)){      \
+    UNSUPPORTED;                                        \
+  }
+
 OPCODE_HANDLER_RETURN
 andHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
   
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
+    REJECT_SHIFTER_CARRY;
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    LOAD_OPERAND2(X86_EAX);
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
     
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
+    if(DPIMM_INFO.rotate != 0 && DPIMM_INFO.S == TRUE){
+      UNSUPPORTED;
     }
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -93,7 +207,7 @@ eorHandler(void *pInst){
     DP("\tImmediate ");
   }
 
-  DP_ASSERT(0,"Eor not supported\n");
+  UNSUPPORTED;
   return count;
 }
 
@@ -102,67 +216,40 @@ subHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    LOAD_OPERAND2(X86_EDX);
 
-    ADD_BYTE(X86_OP_SUB_MEM32_FROM_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    LOAD_ARM_REG(X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
-    LOG_INSTR(instInfo.pX86Addr,count);
+    ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+    ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
 
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
+    LOG_INSTR(instInfo.pX86Addr,count);
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
 
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
-    }
-
     ADD_BYTE(X86_OP_MOV_TO_REG);
     ADD_BYTE(0xD0); /* MOD R/M EAX to EDX */
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rn]);
+    LOAD_ARM_REG(X86_EAX,DPIMM_INFO.Rn);
 
     ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
     ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_ARITH(FLAGS_SUB,instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -173,58 +260,37 @@ rsbHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    LOAD_ARM_REG(X86_EDX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_SUB_MEM32_FROM_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    LOAD_OPERAND2(X86_EAX);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
-    LOG_INSTR(instInfo.pX86Addr,count);
+    ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+    ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
 
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
+    LOG_INSTR(instInfo.pX86Addr,count);
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
 
+    LOAD_ARM_REG(X86_EDX,DPIMM_INFO.Rn);
+
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
 
-    ADD_BYTE(X86_OP_SUB_MEM32_FROM_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rn]);
+    ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+    ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPIMM_INFO.rotate != 0){ 
-      UNSUPPORTED;
-    }
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_ARITH(FLAGS_SUB,instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -235,81 +301,67 @@ addHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
-
-    if(DPREG_INFO.shiftAmt != 0){
-      /*
-      // The Rm operand needs to be shifted. The amount of shift may either
-      // be an immediate value or a value in a register. Further, the shift
-      // may be of one of 5 types. Handle all this here.
-      */
-      if(DPREG_INFO.shiftImm == TRUE){
-        if(DPREG_INFO.shiftType == LSL){
-          ADD_BYTE(X86_OP_SHL);
-          ADD_BYTE(0xE0); /* MOD R/M eax /4 */
-          ADD_BYTE(DPREG_INFO.shiftAmt);
-        }
-      }else{
-        UNSUPPORTED;
+    /*
+    // Rn + Rm << 1..3 is a single lea, which is also the shape of most
+    // array indexing.
+    */
+    if(DPREG_INFO.S == FALSE && DPREG_INFO.shiftImm == TRUE &&
+       DPREG_INFO.shiftType == LSL && DPREG_INFO.shiftAmt >= 1 &&
+       DPREG_INFO.shiftAmt <= 3){
+      uint8_t base = armHostReg[DPREG_INFO.Rn];
+      uint8_t index = armHostReg[DPREG_INFO.Rm];
+
+      if(base == X86_NOREG){
+        LOAD_ARM_REG(X86_EAX,DPREG_INFO.Rn);
+        base = X86_EAX;
       }
+      if(index == X86_NOREG){
+        LOAD_ARM_REG(X86_EDX,DPREG_INFO.Rm);
+        index = X86_EDX;
+      }
+      count += emitLea(instInfo.pX86Addr + count, X86_EAX, base, index,
+        DPREG_INFO.shiftAmt, 0);
+
+      STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
+      LOG_INSTR(instInfo.pX86Addr,count);
+      return count;
+    }
+
+    LOAD_OPERAND2(X86_EAX);
+
+    if(DPREG_INFO.S == TRUE){
+      ADD_BYTE(X86_OP_MOV_TO_REG);
+      ADD_BYTE(0xD0); /* MOD R/M EAX to EDX */
     }
 
-    ADD_BYTE(X86_OP_ADD_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_ADD_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
-    
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
+
+    if(DPREG_INFO.S == TRUE){
+      ADD_BYTE(X86_OP_MOV_TO_REG);
+      ADD_BYTE(0xD0); /* MOD R/M EAX to EDX */
     }
 
-    ADD_BYTE(X86_OP_ADD_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_ADD_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_ARITH(FLAGS_ADD,instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -326,7 +378,7 @@ adcHandler(void *pInst){
     DP("\tImmediate ");
   }
 
-  DP_ASSERT(0,"Adc not supported\n");
+  UNSUPPORTED;
   return count;
 }
 
@@ -341,7 +393,7 @@ sbcHandler(void *pInst){
     DP("\tImmediate ");
   }
 
-  DP_ASSERT(0,"Sbc not supported\n");
+  UNSUPPORTED;
   return count;
 }
 
@@ -356,7 +408,7 @@ rscHandler(void *pInst){
     DP("\tImmediate ");
   }
 
-  DP_ASSERT(0,"Rsc not supported\n");
+  UNSUPPORTED;
   return count;
 }
 
@@ -367,59 +419,27 @@ tstHandler(void *pInst){
 
   DP_HI;
 
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    REJECT_SHIFTER_CARRY;
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    LOAD_OPERAND2(X86_EAX);
 
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
-    
-    if(DPIMM_INFO.rotate != 0){
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
-    }
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   DP_BYE;
@@ -445,52 +465,52 @@ cmpHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
-
+  /*
+  // The comparison is carried out as a subtraction of EDX from EAX whose
+  // result is only kept for the flags.
+  */
   if(instInfo.immediate == FALSE){
     DP2("Register: Rn = %d, Rm = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rm);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    LOAD_OPERAND2(X86_EDX);
 
-    ADD_BYTE(X86_OP_CMP_MEM32_WITH_REG);
-    ADD_BYTE(0x05); /* MODR/M - EAX */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
-    LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
+    LOAD_ARM_REG(X86_EAX,DPREG_INFO.Rn);
   }else{
     DP2("Immediate: Rn = %d, Rm = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rm);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rn]);
-
-    ADD_BYTE(X86_OP_CMP32_WITH_EAX);
+    ADD_BYTE(X86_OP_MOV_IMM_TO_EDX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
 
-    LOG_INSTR(instInfo.pX86Addr,count);
+    LOAD_ARM_REG(X86_EAX,DPIMM_INFO.Rn);
+  }
 
-    if(DPIMM_INFO.rotate != 0){ 
-      UNSUPPORTED;
+  if(instInfo.fuse == TRUE){
+    /*
+    // The next instruction tests EFLAGS directly. Record the flags first
+    // and compare last, so that the cmp and the jcc that follows are
+    // adjacent and the CPU can fuse them.
+    */
+    if(instInfo.flagsLive != 0){
+      ADD_BYTE(X86_OP_MOV_TO_REG);
+      ADD_BYTE(0xC8); /* MOD R/M EAX to ECX */
+      ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+      ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
+      RECORD_FLAGS_ARITH(FLAGS_SUB,instInfo.flagsLive);
+      ADD_BYTE(X86_OP_MOV_TO_REG);
+      ADD_BYTE(0xC1); /* MOD R/M ECX to EAX */
     }
-  }
 
-  if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    ADD_BYTE(X86_OP_CMP_MEM32_WITH_REG);
+    ADD_BYTE(0xD0); /* MOD R/M - cmp eax, edx */
+    LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Fused with the next condition\n");
+  }else{
+    ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+    ADD_BYTE(0xC2); /* MOD RM EDX from EAX */
+
+    RECORD_FLAGS_ARITH(FLAGS_SUB,instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -501,61 +521,31 @@ cmnHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: Rn = %d, Rm = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rm);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
-
-    ADD_BYTE(X86_OP_NEG_RM32);
-    ADD_BYTE(0xD8); /* MOD R/M EAX /3 */
-
-    ADD_BYTE(X86_OP_CMP_MEM32_WITH_REG);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
-    LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
-    UNSUPPORTED;
+    LOAD_OPERAND2(X86_EAX);
   }else{
     DP2("Immediate: Rn = %d, Rm = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rm);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-    ADD_WORD((uint32_t)DPIMM_INFO.imm * -1);
-    
-    if(DPIMM_INFO.rotate != 0){
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
-    }
+    ADD_WORD((uint32_t)DPIMM_INFO.imm);
+  }
 
-    ADD_BYTE(X86_OP_CMP_MEM32_WITH_REG);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uint32_t)&regFile[DPREG_INFO.Rn]);
-    DP1("Comparing with 0x%x\n",((uint32_t)DPIMM_INFO.imm * -1));
+  /*
+  // Compare negative is an addition whose result is only kept for the
+  // flags.
+  */
+  ADD_BYTE(X86_OP_MOV_TO_REG);
+  ADD_BYTE(0xD0); /* MOD R/M EAX to EDX */
 
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
+  ARM_OPERAND(X86_OP_ADD_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
+  LOG_INSTR(instInfo.pX86Addr,count);
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_ARITH(FLAGS_ADD,instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -568,50 +558,16 @@ orrHandler(void *pInst){
 
   DP_HI;
 
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RN = %d\nRD = %d\n",DPREG_INFO.Rn, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
-
-    if(DPREG_INFO.shiftAmt != 0){
-      /*
-      // The Rm operand needs to be shifted. The amount of shift may either
-      // be an immediate value or a value in a register. Further, the shift
-      // may be of one of 5 types. Handle all this here.
-      */
-      if(DPREG_INFO.shiftImm == TRUE){
-        if(DPREG_INFO.shiftType == LSL){
-          ADD_BYTE(X86_OP_SHL);
-          ADD_BYTE(0xE0); /* MOD R/M eax /4 */
-          ADD_BYTE(DPREG_INFO.shiftAmt);
-        }
-      }else{
-        UNSUPPORTED;
-      }
-    }
+    REJECT_SHIFTER_CARRY;
+
+    LOAD_OPERAND2(X86_EAX);
 
-    ADD_BYTE(X86_OP_OR_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_OR_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }else{
     DP2("Immediate: RN = %d, RD = %d\n",DPIMM_INFO.Rn, DPIMM_INFO.Rd);
@@ -619,30 +575,20 @@ orrHandler(void *pInst){
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
     
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
+    if(DPIMM_INFO.rotate != 0 && DPIMM_INFO.S == TRUE){
+      UNSUPPORTED;
     }
 
-    ADD_BYTE(X86_OP_OR_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_OR_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   DP_BYE;
@@ -657,11 +603,11 @@ movHandler(void *pInst){
   if(instInfo.immediate == FALSE){
     DP2("Register: Rm = %d, Rd = %d\n",DPREG_INFO.Rm, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    REJECT_SHIFTER_CARRY;
+
+    LOAD_OPERAND2(X86_EAX);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
 
     /*
@@ -673,36 +619,9 @@ movHandler(void *pInst){
     */
     if(DPREG_INFO.Rd == 15){
       ((struct decodeInfo_t *)pInst)->endBB = TRUE;
-
-      /*
-      // FIXME: This can be optimized.
-      */
-      ADD_BYTE(X86_OP_PUSH_MEM32);
-      ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-      ADD_WORD((uintptr_t)&PC);
-      ADD_BYTE(X86_OP_POP_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for POP - 0x8F /0 */
-      ADD_WORD((uintptr_t)&nextBB);
-
-#ifndef NOCHAINING
-      /*
-      // Load from register cannot be chained.
-      */
-      ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-      ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
-      ADD_WORD(0x00000000);
-#endif /* NOCHAINING */
-
-      ADD_BYTE(X86_OP_CALL);
-      ADD_WORD((uintptr_t)(
-        (intptr_t)&callEndBBTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
-      ));
-      LOG_INSTR(instInfo.pX86Addr,count);
-    }
-
-    if(DPREG_INFO.shiftAmt != 0){
-      UNSUPPORTED;
+      ((struct decodeInfo_t *)pInst)->indirect = TRUE;
+      ((struct decodeInfo_t *)pInst)->ret = (DPREG_INFO.Rm == 14 &&
+                                             SHIFTED(DPREG_INFO) == FALSE);
     }
   }else{
     DP1("Immediate: Rd = %d\n", DPIMM_INFO.Rd);
@@ -710,16 +629,14 @@ movHandler(void *pInst){
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uint32_t)DPIMM_INFO.imm);
 
-    if(DPIMM_INFO.rotate != 0){
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
-    }
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
+    LOG_INSTR(instInfo.pX86Addr,count);
+  }
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+  if(DPREG_INFO.S == TRUE){
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -730,74 +647,40 @@ bicHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RM = %d\nRD = %d\n",DPREG_INFO.Rm, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    REJECT_SHIFTER_CARRY;
+
+    LOAD_OPERAND2(X86_EAX);
 
     ADD_BYTE(X86_OP_NOT_RM32);
     ADD_BYTE(0xD0); /* MOD R/M EAX /2 */
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
   }else{
     DP2("Immediate: Value = %d, RD = %d\n",DPIMM_INFO.imm, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-    ADD_WORD((uint32_t)DPIMM_INFO.imm);
+    ADD_WORD(~DPIMM_INFO.imm);
 
-    ADD_BYTE(X86_OP_NOT_RM32);
-    ADD_BYTE(0xD0); /* MOD R/M EAX /2 */
-    
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
+    if(DPIMM_INFO.rotate != 0 && DPIMM_INFO.S == TRUE){
+      UNSUPPORTED;
     }
 
-    ADD_BYTE(X86_OP_AND_MEM32_TO_EAX);
-    ADD_BYTE(0x05); /* MODR/M */
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rn]);
+    ARM_OPERAND(X86_OP_AND_MEM32_TO_EAX,X86_EAX,DPREG_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   return count;
@@ -808,26 +691,12 @@ mvnHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
 
-  /*
-  // FIXME: This check should be done differently depending on whether
-  // the instruction is a register instruction or an immediate instruction.
-  */
-  if(DPREG_INFO.S == TRUE){
-    DP("Updating flags\n");
-
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
-    ADD_BYTE(X86_OP_POPF);
-    LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Loading Flags\n");
-  }
-
   if(instInfo.immediate == FALSE){
     DP2("Register: RM = %d\nRD = %d\n",DPREG_INFO.Rm, DPREG_INFO.Rd);
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rm]);
+    REJECT_SHIFTER_CARRY;
+
+    LOAD_OPERAND2(X86_EAX);
 
     /*
     // FIXME:
@@ -838,50 +707,177 @@ mvnHandler(void *pInst){
     ADD_BYTE(X86_OP_XOR_IMM32_AND_EAX);
     ADD_WORD(0xFFFFFFFF);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
-
-    if(DPREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
-    }
   }else{
     DP2("Immediate: Value = %d, RD = %d\n",DPIMM_INFO.imm, DPIMM_INFO.Rd);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-    ADD_WORD((uint32_t)DPIMM_INFO.imm);
-    
-    if(DPIMM_INFO.rotate != 0){
-      DP_ASSERT(DPIMM_INFO.S == FALSE,"Rotate with carry not supported\n");
-      ADD_BYTE(X86_OP_ROR_RM32);
-      ADD_BYTE(0xC8); /* MOD R/M EAX, /1 */
-      ADD_BYTE(DPIMM_INFO.rotate * 2);
-      DP1("Rotating by %d\n",DPIMM_INFO.rotate * 2);
-    }
+    ADD_WORD(~DPIMM_INFO.imm);
 
-    /*
-    // FIXME:
-    // Complement with impact on FLAGS. Note that in the case of the x86
-    // the overflow flag gets cleared. In the ARM, the overflow flag
-    // remains unaffected.
-    */
-    ADD_BYTE(X86_OP_XOR_IMM32_AND_EAX);
-    ADD_WORD(0xFFFFFFFF);
+    if(DPIMM_INFO.rotate != 0 && DPIMM_INFO.S == TRUE){
+      UNSUPPORTED;
+    }
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[DPIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,DPIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   if(DPREG_INFO.S == TRUE){
-    ADD_BYTE(X86_OP_PUSHF);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&x86Flags);
+    RECORD_FLAGS_LOGIC(instInfo.flagsLive);
     LOG_INSTR(instInfo.pX86Addr,count);
-    DP("Storing Flags\n");
+    DP("Recording Flags\n");
   }
 
   return count;
 }
 
+
+/*
+// Condition flags
+//
+// The flag setting handlers above record their operation in the flagNZ,
+// flagOp, flagSrc and flagRes fields of armCpu (see codegen.h). The first
+// operand is not recorded; it follows from the result and the second
+// operand. The code below turns the record back into flags.
+//
+// materializeFlags is called from translated code, with RBP pointing at
+// armCpu, right before a conditional jump that needs C or V. It recomputes
+// the operation to get C and V, takes N and Z from flagNZ, and combines
+// them in EFLAGS with LAHF and SAHF. SAHF does not load OF, which is set
+// by adding 0x7F to V.
+*/
+asm(
+  ".text\n"
+  ".globl materializeFlags\n"
+  "materializeFlags:\n"
+  "  movl " STRINGIFY(CPU_FLAG_RES) "(%rbp), %eax\n"
+  "  movl " STRINGIFY(CPU_FLAG_SRC) "(%rbp), %edx\n"
+  "  cmpl $" STRINGIFY(FLAGS_SUB) ", " STRINGIFY(CPU_FLAG_OP) "(%rbp)\n"
+  "  jne 1f\n"
+  "  addl %edx, %eax\n"         /* First operand */
+  "  cmpl %edx, %eax\n"         /* CF is the borrow ... */
+  "  cmc\n"                     /* ... and the ARM carry its complement */
+  "  jmp 2f\n"
+  "1:\n"
+  "  subl %edx, %eax\n"         /* First operand */
+  "  addl %edx, %eax\n"
+  "2:\n"
+  "  setc %cl\n"
+  "  seto %ch\n"
+  "  movl " STRINGIFY(CPU_FLAG_NZ) "(%rbp), %eax\n"
+  "  testl %eax, %eax\n"        /* SF and ZF, CF clear */
+  "  lahf\n"
+  "  orb %cl, %ah\n"
+  "  movb %ch, %al\n"
+  "  addb $0x7F, %al\n"
+  "  sahf\n"
+  "  ret\n"
+);
+
+/*
+// Return the CPSR with the flags worked out from the record. Called from
+// translated code for MRS.
+*/
+uint32_t armX86ReadFlags(void){
+  uint32_t src1, c, v;
+
+  if(armCpu.flagOp == FLAGS_SUB){
+    src1 = armCpu.flagRes + armCpu.flagSrc;
+    c = (src1 >= armCpu.flagSrc);
+    v = ((src1 ^ armCpu.flagSrc) & (src1 ^ armCpu.flagRes)) >> 31;
+  }else{
+    src1 = armCpu.flagRes - armCpu.flagSrc;
+    c = (armCpu.flagRes < armCpu.flagSrc);
+    v = (~(src1 ^ armCpu.flagSrc) & (src1 ^ armCpu.flagRes)) >> 31;
+  }
+
+  armCpu.cpsr &= ~CPSR_FLAGS_MASK;
+  armCpu.cpsr |= ((armCpu.flagNZ >> 31) << CPSR_N_SHIFT) |
+                 ((armCpu.flagNZ == 0) << CPSR_Z_SHIFT) |
+                 (c << CPSR_C_SHIFT) | (v << CPSR_V_SHIFT);
+
+  return armCpu.cpsr;
+}
+
+/*
+// Replace the record with one that yields the flags in the CPSR. Called from
+// translated code for MSR, which has already written the CPSR. N and Z can
+// not both be set this way; N wins.
+*/
+void armX86WriteFlags(void){
+  static const uint32_t cvSrc1[4] = {0x00000000, 0x00000000,   /* C=0 */
+                                     0x00000000, 0x80000000};  /* C=1 */
+  static const uint32_t cvSrc2[4] = {0x00000001, 0x80000000,
+                                     0x00000000, 0x00000001};
+  uint32_t cv = (((armCpu.cpsr >> CPSR_C_SHIFT) & 1) << 1) |
+                ((armCpu.cpsr >> CPSR_V_SHIFT) & 1);
+
+  if(armCpu.cpsr & (1 << CPSR_N_SHIFT)){
+    armCpu.flagNZ = 0x80000000;
+  }else{
+    armCpu.flagNZ = (armCpu.cpsr & (1 << CPSR_Z_SHIFT))?0:1;
+  }
+
+  armCpu.flagOp = FLAGS_SUB;
+  armCpu.flagSrc = cvSrc2[cv];
+  armCpu.flagRes = cvSrc1[cv] - cvSrc2[cv];
+}
+
+OPCODE_HANDLER_RETURN
+mrsHandler(void *pInst){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
+  uint8_t count = 0;
+
+  DP1("MRS: Rd = %d\n", DPREG_INFO.Rd);
+
+  CALL_HELPER(&armX86ReadFlags);
+
+  STORE_ARM_REG(X86_EAX,DPREG_INFO.Rd);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+/*
+// Only the flags field of the CPSR can be written from user mode. The
+// field mask sits where Rn sits in data processing instructions.
+*/
+OPCODE_HANDLER_RETURN
+msrHandler(void *pInst){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
+  uint8_t count = 0;
+
+  if((DPREG_INFO.Rn & MSR_FIELD_F) == 0){
+    DP("MSR does not write the flags\n");
+    return count;
+  }
+
+  if(instInfo.immediate == FALSE){
+    DP1("MSR: Rm = %d\n", DPREG_INFO.Rm);
+
+    LOAD_ARM_REG(X86_EAX,DPREG_INFO.Rm);
+  }else{
+    DP1("MSR: imm = 0x%x\n", DPIMM_INFO.imm);
+
+    ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
+    ADD_WORD((uint32_t)DPIMM_INFO.imm);
+
+  }
+
+  ADD_BYTE(X86_OP_AND_IMM32_RM32);
+  ADD_BYTE(0xE0); /* MOD R/M for AND - 0x81 /4, eax */
+  ADD_WORD(CPSR_FLAGS_MASK);
+
+  ADD_BYTE(X86_OP_AND_IMM32_RM32);
+  CPU_OPERAND(4,CPU_CPSR); /* AND - 0x81 /4 */
+  ADD_WORD(~CPSR_FLAGS_MASK);
+
+  ADD_BYTE(X86_OP_OR_REG_TO_MEM32);
+  CPU_OPERAND(X86_EAX,CPU_CPSR); /* or cpsr, eax */
+
+  CALL_HELPER(&armX86WriteFlags);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "aot.h"
+
+#define AOT_PAGE_SIZE           0x1000
+#define AOT_COPY_SIZE           0x10000
+
+/*
+ * Look for the trailer of an executable made ahead of time at the end of
+ * exeFile.
+ *
+ * Return: 1 if exeFile is one, with the trailer read into trailer.
+ *         0 otherwise.
+ */
+int
+armX86AotFind(const char *exeFile, struct aotTrailer_t *trailer)
+{
+    struct stat st;
+    int fd, found = 0;
+
+    if ((fd = open(exeFile, O_RDONLY)) == -1) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*trailer) &&
+        pread(fd, trailer, sizeof(*trailer), st.st_size - sizeof(*trailer))
+        == sizeof(*trailer) && trailer->magic == AOT_MAGIC) {
+        found = (trailer->armOffset % AOT_PAGE_SIZE) == 0 &&
+                (trailer->cacheOffset % AOT_PAGE_SIZE) == 0;
+    }
+
+    close(fd);
+    return found;
+}
+
+/*
+ * Append the contents of inFile to out at offset, which is rounded up to a
+ * page. Runs of zeroes are skipped rather than written, so the holes of a
+ * sparse code cache stay holes.
+ *
+ * Return: Offset of the copy, or -1 on error.
+ */
+static off_t
+appendFile(int out, off_t offset, const char *inFile, off_t *end)
+{
+    static uint8_t buf[AOT_COPY_SIZE];
+    static const uint8_t zeroes[AOT_COPY_SIZE];
+    ssize_t numBytes;
+    off_t at;
+    int in;
+
+    if ((in = open(inFile, O_RDONLY)) == -1) {
+        sys_err(("Could not open %s", inFile));
+        return -1;
+    }
+
+    offset = (offset + AOT_PAGE_SIZE - 1) & ~(off_t)(AOT_PAGE_SIZE - 1);
+    for (at = offset; (numBytes = read(in, buf, sizeof(buf))) > 0;
+         at += numBytes) {
+        if (memcmp(buf, zeroes, numBytes) != 0 &&
+            pwrite(out, buf, numBytes, at) != numBytes) {
+            numBytes = -1;
+            break;
+        }
+    }
+
+    close(in);
+    if (numBytes == -1) {
+        sys_err(("Could not copy %s", inFile));
+        return -1;
+    }
+
+    *end = at;
+    return offset;
+}
+
+/*
+ * Make an executable out of the translator that runs, the ARM executable
+ * in armFile and the code cache that was translated from it into
+ * cacheFile for a cache of x86CodeSize bytes.
+ *
+ * Return: 0 if outFile was written, -1 otherwise.
+ */
+int
+armX86AotWrite(const char *outFile, const char *armFile,
+    const char *cacheFile, uint32_t x86CodeSize)
+{
+    struct aotTrailer_t trailer;
+    off_t armOffset, cacheOffset, end = 0;
+    int out;
+
+    if ((out = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0755)) == -1) {
+        sys_err(("Could not create %s", outFile));
+        return -1;
+    }
+
+    if (appendFile(out, 0, AOT_SELF, &end) == -1 ||
+        (armOffset = appendFile(out, end, armFile, &end)) == -1 ||
+        (cacheOffset = appendFile(out, end, cacheFile, &end)) == -1) {
+        close(out);
+        unlink(outFile);
+        return -1;
+    }
+
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.armOffset = armOffset;
+    trailer.cacheOffset = cacheOffset;
+    trailer.x86CodeSize = x86CodeSize;
+    trailer.magic = AOT_MAGIC;
+
+    if (pwrite(out, &trailer, sizeof(trailer), end) != sizeof(trailer)) {
+        sys_err(("Could not write %s", outFile));
+        close(out);
+        unlink(outFile);
+        return -1;
+    }
+
+    if (close(out) == -1) {
+        sys_err(("Could not write %s", outFile));
+        unlink(outFile);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _ARMX86_AOT_H
+#define _ARMX86_AOT_H
+
+#include <stdint.h>
+
+/*
+ * An executable made ahead of time is a copy of the translator with the
+ * ARM executable and the code cache translated from it appended, each
+ * starting on a page, and this trailer at the very end.
+ */
+#define AOT_MAGIC               0x544F4158  /* "XAOT" */
+#define AOT_SELF                "/proc/self/exe"
+
+struct aotTrailer_t {
+    uint64_t armOffset;             /* Offset of the ARM executable */
+    uint64_t cacheOffset;           /* Offset of the code cache */
+    uint32_t x86CodeSize;           /* Size of the cache it was made for */
+    uint32_t magic;
+};
+
+int armX86AotFind(const char *exeFile, struct aotTrailer_t *trailer);
+int armX86AotWrite(const char *outFile, const char *armFile,
+    const char *cacheFile, uint32_t x86CodeSize);
+
+#endif /* _ARMX86_AOT_H */
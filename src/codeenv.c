@@ -1,67 +1,417 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#include "debug.h"
+#include "types.h"
 #include "codeenv.h"
 
-struct hash_struct *translationCache = NULL;
+#define ARM_MEM_SIZE            0x100000000ULL
 
-#define X86_CODE_SIZE           0x2000000
+uint8_t *armMemBase;
 
-void* initX86Code(void *stat){
+/*
+// Reserve the address space of the ARM program. Nothing is committed here;
+// the ELF loader and initArmStack() map what is used inside the
+// reservation, so the program can be laid out at the addresses it was
+// linked for wherever the host puts the reservation.
+*/
+void* initArmMemory(void *stat){
+  uint8_t *reservation;
+  uintptr_t base, end;
+
+  /*
+  // Reserve twice the size and trim it down to an aligned 4GB.
+  */
+  reservation = mmap(NULL, 2 * ARM_MEM_SIZE, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(reservation == MAP_FAILED){
+    sys_err(("mmap: ARM address space"));
+    return NULL;
+  }
+
+  base = ((uintptr_t)reservation + ARM_MEM_SIZE - 1) & ~(ARM_MEM_SIZE - 1);
+  end = (uintptr_t)reservation + 2 * ARM_MEM_SIZE;
+  if(base != (uintptr_t)reservation){
+    munmap(reservation, base - (uintptr_t)reservation);
+  }
+  if(end != base + ARM_MEM_SIZE){
+    munmap((void *)(base + ARM_MEM_SIZE), end - (base + ARM_MEM_SIZE));
+  }
+
+  armMemBase = (uint8_t *)base;
+  return armMemBase;
+}
+
+/*
+// Map size bytes at addr if that range is free, and anywhere below 2GB if
+// it is not. Returns NULL if neither can be had.
+*/
+static void *mapLow(void *addr, size_t size, int prot, int flags){
+  void *p;
+
+  p = mmap(addr, size, prot,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | flags, -1, 0);
+  if(p != MAP_FAILED && p != addr){
+    /* a kernel that does not know the flag takes addr as a hint */
+    munmap(p, size);
+    p = MAP_FAILED;
+  }
+  if(p == MAP_FAILED){
+    p = mmap(NULL, size, prot,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | flags, -1, 0);
+  }
+
+  return (p == MAP_FAILED)?NULL:p;
+}
+
+void* initX86Code(uint32_t size){
+  //
+  // Allocate space for x86 instructions. The cache is managed by the
+  // translator (see "Code cache" in decode.c), which flushes the oldest
+  // translations when it runs out of space.
   //
-  // Allocate space for x86 instructions.
-  // FIXME: Allocate space for x86 code based on an educated guess that
-  // maps ARM code size to average x86 code size (include some give)
+  // Translated code reaches the translator with rel32 calls and jumps and
+  // its data with 32-bit absolute addresses, so it is placed below 2GB
+  // along with the translator.
   //
-  return malloc((size_t)X86_CODE_SIZE * sizeof(uint8_t));
+  return mapLow((void *)X86_CODE_BASE, (size_t)size * sizeof(uint8_t),
+    PROT_READ | PROT_WRITE | PROT_EXEC, 0);
 }
 
-#define ARM_STACK_SIZE          0x8000000
+void* initX86Records(void){
+  //
+  // Reserve the space for the records of the code cache. Translated code
+  // refers to them by 32-bit absolute addresses too. Pages are only
+  // committed as the translator uses them.
+  //
+  return mapLow((void *)X86_RECORDS_BASE, X86_RECORDS_SIZE,
+    PROT_READ | PROT_WRITE, MAP_NORESERVE);
+}
+
+/*
+// The program finds at the top of its stack what the kernel leaves there
+// for a new process: argc, the NULL terminated argv and envp arrays and
+// the auxiliary vector. There are no arguments, no environment and an
+// empty auxiliary vector, so all of it is zero.
+*/
+#define ARM_STACK_FRAME_SIZE    (8 * sizeof(uint32_t))
+
 void* initArmStack(void *stat){
   uint8_t* armStackPtr;
-  armStackPtr = (uint8_t *)malloc((size_t)ARM_STACK_SIZE * sizeof(uint8_t));
-  return (void *)((armStackPtr == NULL)?NULL:(armStackPtr + ARM_STACK_SIZE));
+  armStackPtr = mmap(ARM_HOST_ADDR(ARM_STACK_TOP - ARM_STACK_SIZE),
+    (size_t)ARM_STACK_SIZE * sizeof(uint8_t), PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if(armStackPtr == MAP_FAILED){
+    return NULL;
+  }
+  armStackPtr += ARM_STACK_SIZE - ARM_STACK_FRAME_SIZE;
+  memset(armStackPtr, 0, ARM_STACK_FRAME_SIZE);
+  return (void *)armStackPtr;
 }
 
-int InsertItem(void *blockAddress, void *translatedAddress)
+/*
+// Translation index
+//
+// The index maps the address of an ARM basic block to the address of its
+// translation in the x86 code cache. It is looked up on every block exit
+// that is not chained, so it is kept as a flat open-addressing table rather
+// than a chained hash:
+//
+//   - ARM instructions are word aligned, so the key is the ARM address
+//     shifted right by two.
+//   - Slots are arranged in groups of INDEX_GROUP_SIZE. Every slot has a
+//     control byte holding 7 bits of the hash (the tag) with the top bit set,
+//     or 0 if the slot is empty. A probe compares the tag against all control
+//     bytes of a group at once (SSE2 where available) and only touches the
+//     slots whose tag matches.
+//   - Groups are probed in triangular order, which visits every group when
+//     the number of groups is a power of two.
+//
+// A basic block starts at an ARM instruction, so there can never be more
+// blocks than there are words in the text segment. The table is sized for
+// that bound once, up front, out of a single anonymous mapping. A block
+// whose translation is flushed from the code cache keeps its slot with no
+// translation (see EvictItem()), so slots are never freed and the bound
+// holds however often blocks are translated again. Nothing is
+// allocated per block and the whole index is released in one go. Since the
+// mapping is zero filled, every slot starts out empty without touching the
+// pages, and only the parts of the table that are used get committed.
+*/
+#define INDEX_GROUP_SIZE        16
+#define INDEX_CTRL_EMPTY        0x00
+#define INDEX_CTRL_FULL         0x80
+#define INDEX_HASH_MULT         0x9E3779B1
+#define INDEX_MIN_GROUPS        64
+
+#define INDEX_KEY(address)      ((uint32_t)(uintptr_t)(address) >> 2)
+#define INDEX_TAG(hash)         (INDEX_CTRL_FULL | ((hash) >> 25))
+
+struct indexSlot_t{
+  uint32_t key;                 /* ARM block address >> 2 */
+  void *value;                  /* Translated block */
+};
+
+static uint8_t *indexArena = NULL;
+static size_t indexArenaSize;
+static uint8_t *indexCtrl;
+static struct indexSlot_t *indexSlots;
+static uint32_t indexGroupMask;
+static uint32_t indexCapacity;
+static uint32_t indexCount;
+
+struct lookasideEntry_t indexLookaside[INDEX_LOOKASIDE_SIZE];
+
+/*
+// Compare a control byte against every control byte of a group. Returns a
+// bit mask with bit i set if control byte i matched.
+*/
+static inline uint32_t indexMatchGroup(const uint8_t *ctrl, uint8_t ctrlByte){
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+  return (uint32_t)_mm_movemask_epi8(
+    _mm_cmpeq_epi8(group, _mm_set1_epi8((char)ctrlByte)));
+#else /* __SSE2__ */
+  uint32_t i, match = 0;
+
+  for(i = 0; i < INDEX_GROUP_SIZE; i++){
+    if(ctrl[i] == ctrlByte)
+      match |= (1 << i);
+  }
+  return match;
+#endif /* __SSE2__ */
+}
+
+/*
+// Size and map the translation index. The size of the text segment bounds
+// the number of basic blocks; a size of 0 picks a small default. Returns -1
+// if the index could not be mapped.
+*/
+int initTranslationIndex(uint32_t armTextSize)
 {
-  struct hash_struct *s;
+  uint32_t numGroups = INDEX_MIN_GROUPS;
+  uint32_t maxBlocks = armTextSize / sizeof(uint32_t);
+  void *arena;
 
-  /* allocate memory for hash table */
-  s = malloc(sizeof(struct hash_struct));  
+  DP_ASSERT(indexArena == NULL, "Translation index already initialized\n");
 
-  /* memory allocation did not succeed */
-  if(s == NULL)
+  /*
+  // Keep the load factor at or below 7/8 so that a probe always finds an
+  // empty slot within a few groups.
+  */
+  while((uint64_t)numGroups * INDEX_GROUP_SIZE * 7 < (uint64_t)maxBlocks * 8)
+    numGroups <<= 1;
+
+  indexCapacity = numGroups * INDEX_GROUP_SIZE;
+  indexGroupMask = numGroups - 1;
+  indexCount = 0;
+  indexArenaSize = indexCapacity +
+    (size_t)indexCapacity * sizeof(struct indexSlot_t);
+
+  arena = mmap(NULL, indexArenaSize, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(arena == MAP_FAILED){
+    sys_err(("mmap: translation index"));
     return -1;
+  }
 
-  /* set the key and value pairs */
-  s->key = blockAddress;
-  s->value = translatedAddress;
+  indexArena = arena;
+  indexCtrl = indexArena;
+  indexSlots = (struct indexSlot_t *)(indexArena + indexCapacity);
 
-  /* insert into hash table */
-  HASH_ADD(hh, translationCache, key, sizeof(void *), s);
+  memset(indexLookaside, 0xFF, sizeof(indexLookaside));
 
+  DP2("Translation index: %u slots for 0x%x bytes of text\n",
+    indexCapacity, armTextSize);
   return 0;
 }
 
+/*
+// Find the slot of a key, or the empty slot that ends its probe sequence.
+// Returns the slot, with *found telling which of the two it is.
+*/
+static uint32_t indexFindSlot(uint32_t key, bool *found)
+{
+  uint32_t hash = key * INDEX_HASH_MULT;
+  uint32_t group = hash & indexGroupMask;
+  uint32_t step = 0;
+  uint32_t match, slot;
+  const uint8_t *ctrl;
+
+  for(;;){
+    ctrl = indexCtrl + group * INDEX_GROUP_SIZE;
+
+    /* check every slot in the group carrying the same tag */
+    match = indexMatchGroup(ctrl, INDEX_TAG(hash));
+    while(match != 0){
+      slot = group * INDEX_GROUP_SIZE + __builtin_ctz(match);
+      if(indexSlots[slot].key == key){
+        *found = TRUE;
+        return slot;
+      }
+      match &= match - 1;
+    }
+
+    /* an empty slot ends the probe sequence: the key is not present */
+    match = indexMatchGroup(ctrl, INDEX_CTRL_EMPTY);
+    if(match != 0){
+      *found = FALSE;
+      return group * INDEX_GROUP_SIZE + __builtin_ctz(match);
+    }
+
+    step++;
+    group = (group + step) & indexGroupMask;
+  }
+}
+
+/*
+// Add the translation of a block. Returns 1 if the block had been
+// translated before and flushed, 0 if it is new and -1 if the index is full.
+*/
+int InsertItem(void *blockAddress, void *translatedAddress)
+{
+  uint32_t key = INDEX_KEY(blockAddress);
+  uint32_t slot;
+  bool found;
+  int ret = 0;
+
+  /* never set up */
+  if(indexCapacity == 0)
+    return -1;
+
+  slot = indexFindSlot(key, &found);
+  if(found == TRUE){
+    ret = 1;
+  }else{
+    /* index full */
+    if(indexCount >= indexCapacity - indexCapacity / 8)
+      return -1;
+
+    indexSlots[slot].key = key;
+    indexCtrl[slot] = INDEX_TAG(key * INDEX_HASH_MULT);
+    indexCount++;
+  }
+
+  /* set the value */
+  indexSlots[slot].value = translatedAddress;
+
+  slot = INDEX_LOOKASIDE_SLOT(blockAddress);
+  indexLookaside[slot].armAddr = (uint32_t)(uintptr_t)blockAddress;
+  indexLookaside[slot].x86Addr = translatedAddress;
+
+  return ret;
+}
+
+/*
+// Forget the translation of a block that is flushed from the code cache.
+// Nothing happens unless the index holds that very translation.
+*/
+void EvictItem(void *blockAddress, void *translatedAddress)
+{
+  uint32_t slot;
+  bool found;
+
+  if(indexCapacity == 0)
+    return;
+
+  slot = indexFindSlot(INDEX_KEY(blockAddress), &found);
+  if(found == FALSE || indexSlots[slot].value != translatedAddress)
+    return;
+
+  indexSlots[slot].value = NULL;
+
+  slot = INDEX_LOOKASIDE_SLOT(blockAddress);
+  if(indexLookaside[slot].x86Addr == translatedAddress){
+    indexLookaside[slot].armAddr = INDEX_LOOKASIDE_INVALID;
+    indexLookaside[slot].x86Addr = NULL;
+  }
+}
+
+/*
+// Is there room in the index for the translation of the block at
+// blockAddress? The keys of evicted blocks stay in the index, so there
+// always is for a block that was translated before, but blocks outside the
+// text the index was sized for may fill it up.
+*/
+int IndexHasRoom(void *blockAddress)
+{
+  bool found;
+
+  if(indexCapacity == 0)
+    return 0;
+
+  indexFindSlot(INDEX_KEY(blockAddress), &found);
+  return found == TRUE || indexCount < indexCapacity - indexCapacity / 8;
+}
+
+/*
+// Forget every block, evicted or not. The whole code cache has to be
+// flushed along with it.
+*/
+void ClearIndex(void)
+{
+  if(indexCapacity == 0)
+    return;
+
+  memset(indexCtrl, INDEX_CTRL_EMPTY, indexCapacity);
+  memset(indexLookaside, 0xFF, sizeof(indexLookaside));
+  indexCount = 0;
+}
+
 void FreeHashTableMemory(void)
 {
-  struct hash_struct *s;
+  if(indexArena == NULL)
+    return;
 
-  for(s = translationCache; s != NULL; s = s->hh.next)
-    free(s);
+  munmap(indexArena, indexArenaSize);
+  memset(indexLookaside, 0xFF, sizeof(indexLookaside));
+  indexArena = NULL;
+  indexCapacity = 0;
+  indexCount = 0;
 }
 
 void* GetItem(void *address)
 {
-  struct hash_struct *s;
+  uint32_t slot, lookaside;
+  bool found;
+
+  if(indexCapacity == 0)
+    return NULL;
 
-  /* find key in hash */
-  HASH_FIND(hh, translationCache, &address, sizeof(void *), s);
+  slot = indexFindSlot(INDEX_KEY(address), &found);
 
-  /* return NULL if not exists or value if exists */
-  if(s == NULL)
+  /* not present, or flushed from the code cache */
+  if(found == FALSE || indexSlots[slot].value == NULL)
     return NULL;
-  else
-    return s->value;
+
+  lookaside = INDEX_LOOKASIDE_SLOT(address);
+  indexLookaside[lookaside].armAddr = (uint32_t)(uintptr_t)address;
+  indexLookaside[lookaside].x86Addr = indexSlots[slot].value;
+  return indexSlots[slot].value;
 }
 
+/*
+// FNV-1a over size bytes, going on from hash, taken a word at a time to
+// keep startup cheap. Used to tell whether a saved code cache was made for
+// the same program by the same translator.
+*/
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+  uint64_t word;
+
+  for(; size >= sizeof(word); size -= sizeof(word), p += sizeof(word)){
+    memcpy(&word, p, sizeof(word));
+    hash ^= word;
+    hash *= 0x100000001B3ULL;
+  }
+  while(size-- > 0){
+    hash ^= *p++;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
@@ -1,22 +1,89 @@
 #ifndef _ARMX86_CODEGEN_H
 #define _ARMX86_CODEGEN_H
 
-#include "uthash.h"
+#include <stddef.h>
+#include <stdint.h>
 
-void *initX86Code(void *stat);
+/*
+ * The ARM program sees a 32-bit address space of its own, reserved in one
+ * piece at armMemBase. The reservation is aligned to 4GB, so the low 32
+ * bits of a host pointer into it are the ARM address.
+ */
+extern uint8_t *armMemBase;
+
+#define ARM_HOST_ADDR(address)  ((void *)(armMemBase + (uint32_t)(address)))
+
+/*
+ * The stack of the ARM program takes the ARM_STACK_SIZE bytes below
+ * ARM_STACK_TOP. When the program's allocator is run natively, the ELF
+ * loader reserves a heap for it of up to ARM_HEAP_SIZE bytes right after
+ * the last segment it maps, short of the stack. It is committed as it is
+ * used.
+ */
+#define ARM_STACK_SIZE          0x8000000
+#define ARM_STACK_TOP           0xC0000000
+#define ARM_HEAP_SIZE           0x40000000
+
+/*
+ * The x86 code cache. X86_CODE_SIZE is its default size; the environment
+ * variable ARMX86_CODE_SIZE overrides it. The cache is split into
+ * X86_CODE_REGIONS regions that are flushed one at a time (see "Code
+ * cache" in decode.c). X86_CODE_BLOCK_MAX bounds the code of one block,
+ * and a region has room for at least two such blocks. The cache has to
+ * stay below 2GB with the translator, and starts at X86_CODE_BASE, which
+ * bounds its size.
+ */
+#define X86_CODE_SIZE           0x2000000
+#define X86_CODE_REGIONS        8
+#define X86_CODE_BLOCK_MAX      0x10000
+#define X86_CODE_MIN_SIZE       (X86_CODE_REGIONS * 2 * X86_CODE_BLOCK_MAX)
+#define X86_CODE_MAX_SIZE       0x30000000
+
+/*
+ * The code cache is mapped at X86_CODE_BASE, and the records that go with
+ * its translations are carved out of a reservation of X86_RECORDS_SIZE at
+ * X86_RECORDS_BASE. Translations saved by one run can then be mapped back
+ * by the next at the addresses they were made for (see "Persistent code
+ * cache" in decode.c). If an address is taken, the mapping goes anywhere
+ * below 2GB instead. Both are placed above the 1GB over which the kernel
+ * spreads the start of the heap of a program linked at a fixed address.
+ */
+#define X86_RECORDS_BASE        0x48000000
+#define X86_RECORDS_SIZE        0x08000000
+#define X86_CODE_BASE           0x50000000
+
+void *initArmMemory(void *stat);
+void *initX86Code(uint32_t size);
+void *initX86Records(void);
 void *initArmStack(void *stat);
+int initTranslationIndex(uint32_t armTextSize);
+
+/*
+ * Direct-mapped lookaside in front of the translation index. Translated code
+ * probes it inline at indirect branches. The index fills it with every block
+ * it inserts or finds, so it holds the most recently used translations.
+ */
+#define INDEX_LOOKASIDE_SIZE    1024
+#define INDEX_LOOKASIDE_INVALID 0xFFFFFFFF
+#define INDEX_LOOKASIDE_SLOT(address) \
+  (((uint32_t)(uintptr_t)(address) >> 2) & (INDEX_LOOKASIDE_SIZE - 1))
 
-struct hash_struct
-{
-  void *key;			/* key field */
-  void *value;			/* value */
-  UT_hash_handle hh;		/* makes this structure hashable */
+struct lookasideEntry_t{
+  uint32_t armAddr;
+  void *x86Addr;
 };
 
-extern struct hash_struct *translationCache;
+extern struct lookasideEntry_t indexLookaside[INDEX_LOOKASIDE_SIZE];
 
 int InsertItem(void *address, void *startBlockAddress);
+void EvictItem(void *address, void *startBlockAddress);
+int IndexHasRoom(void *address);
+void ClearIndex(void);
 void FreeHashTableMemory(void);
 void* GetItem(void *address);
 
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size);
+
+#define HASH_SEED               0xCBF29CE484222325ULL
+
 #endif /* _ARMX86_CODEGEN_H */
@@ -4,27 +4,122 @@
 typedef OPCODE_HANDLER_RETURN (*opcodeHandler_t)(void *inst);
 extern opcodeHandler_t opcodeHandler[NUM_OPCODES];
 
-extern void *nextBB;
+/*
+ * ARM condition flags are evaluated lazily. An instruction that sets the
+ * flags only records what it computed: its result, from which N and Z
+ * follow, and for arithmetic, the kind of operation, its second operand
+ * and its result, from which C and V follow. Logical operations leave C
+ * and V alone, so they only record flagNZ. The flags are worked out when
+ * a condition or an MRS needs them.
+ */
+#define FLAGS_ADD               0
+#define FLAGS_SUB               1
+
+/*
+ * The state of the ARM program that translated code reads and writes. It
+ * is kept together in armCpu, which translated code reaches through RBP,
+ * so that every field is a disp8 operand off RBP rather than a disp32
+ * absolute one. The CPU_* offsets are used by the code generators and by
+ * the hand written assembly; decode.c checks that they match the struct.
+ * The whole struct fits in the 128 bytes a disp8 can reach.
+ */
+#define CPU_REGFILE             0
+#define CPU_CPSR                64
+#define CPU_FLAG_NZ             68
+#define CPU_FLAG_OP             72
+#define CPU_FLAG_SRC            76
+#define CPU_FLAG_RES            80
+#define CPU_NEXT_BB             84
+#define CPU_TAKEN_SOURCE        88
+#define CPU_UNTAKEN_SOURCE      96
+#define CPU_INDIRECT_SITE       104
+#define CPU_RETURN_SITE         112
+#define CPU_RETURN_TOP          120
+
+struct armCpu_t {
+  int32_t regFile[NUM_ARM_REGISTERS];
+  uint32_t cpsr;      /* ARM Program Status Register for user mode */
+  uint32_t flagNZ;    /* Result of the last flag setting instruction */
+  uint32_t flagOp;    /* FLAGS_ADD or FLAGS_SUB for C and V */
+  uint32_t flagSrc;   /* Second operand of that operation */
+  uint32_t flagRes;   /* Result of that operation */
+  uint32_t nextBB;    /* ARM address of the block to run next */
+
+  /*
+   * These are a couple of variables used for chaining. When, at the end of
+   * a basic block the taken or untaken exit is taken, one of these
+   * variables is populated with the location of the jump to the dispatcher
+   * to indicate to the handler where the exit has come from. This allows
+   * the handler to patch the jump to chain the next basic block to it.
+   */
+  void *pTakenCalloutSourceLoc;
+  void *pUntakenCalloutSourceLoc;
+
+  /*
+   * An indirect branch that misses its site hands the site to
+   * dispatchIndirect, and a mispredicted return hands its return site to
+   * dispatchReturn. returnStackTop is the byte offset of the top entry of
+   * the shadow return stack.
+   */
+  struct indirectSite_t *pIndirectSite;
+  struct returnSite_t *pReturnSite;
+  uint32_t returnStackTop;
+} __attribute__((aligned(64)));
+
+extern struct armCpu_t armCpu;
+
+/*
+ * Establish the flags in EFLAGS so that SF, ZF and OF hold N, Z and V and
+ * CF holds the ARM carry (not the x86 borrow). Clobbers EAX, ECX and EDX.
+ */
+extern void materializeFlags(void);
+extern uint32_t armX86ReadFlags(void);
+extern void armX86WriteFlags(void);
 
-extern uint32_t cpsr;     /* ARM Program Status Register for user mode */
-extern uint32_t x86Flags; /* x86 Flag Register */
+/*
+ * Translated code runs with two host registers pinned: RBP points at
+ * armCpu and RSI holds armMemBase, the host address of ARM address 0. The
+ * ARM registers used most, r0-r4, fp, sp and lr, live in r8-r15 for as
+ * long as translated code runs (see the dispatcher in decode.c). Other ARM
+ * registers that are used often in a block are kept in a host register
+ * for the length of the block (see "Register allocation" in decode.c).
+ * armHostReg gives the host register of each ARM register, or X86_NOREG if
+ * it lives in armCpu.regFile. armHostDirty has a bit set for every ARM
+ * register that translated code has written so far in the block.
+ */
+#define X86_EAX                 0
+#define X86_ECX                 1
+#define X86_EDX                 2
+#define X86_EBX                 3
+#define X86_ESP                 4
+#define X86_EBP                 5
+#define X86_ESI                 6
+#define X86_EDI                 7
+#define X86_R8                  8
+#define X86_R15                 15
+#define X86_NOREG               0xFF
 
-extern int32_t regFile[NUM_ARM_REGISTERS];
+#define X86_STATE_BASE          X86_EBP
+#define X86_MEM_BASE            X86_ESI
 
-extern void callEndBBTaken();
+extern uint8_t armHostReg[NUM_ARM_REGISTERS];
+extern uint16_t armHostDirty;
+extern const uint8_t armPinnedReg[NUM_ARM_REGISTERS];
 
-#ifndef NOCHAINING
+/*
+ * Entry points of the dispatcher. Translated code leaves a basic block by
+ * jumping (never calling) to one of these.
+ */
+extern void dispatchTaken(void);
+extern void dispatchNotTaken(void);
+extern void dispatchIndirect(void);
+extern void dispatchReturn(void);
 
 /*
- * These are a couple of variables used for chaining. When, at the end of a
- * basic block the taken or untaken callout is invoked, one of these variables
- * is populated at the call location to indicate to the handler where the call
- * has come from. This allows the handler to patch the call location to chain
- * the next basic block to it.
+ * A block that has become hot leaves through dispatchHot to be translated
+ * again, optimized (see "Optimizing retranslation" in decode.c).
  */
-void* pTakenCalloutSourceLoc;
-void* pUntakenCalloutSourceLoc;
-#endif /* NOCHAINING */
+extern void dispatchHot(void);
 
 #ifdef DEBUG
 
@@ -52,6 +147,142 @@ void* pUntakenCalloutSourceLoc;
   *(uint32_t *)(instInfo.pX86Addr + count) = (x);       \
   count+=4;
 
+/*
+// Operands in 64-bit mode. A REX prefix extends the reg and r/m fields of
+// the ModR/M byte to reach r8-r15, and must come before the opcode. Data
+// of the translator, such as the return stack, is addressed through a
+// SIB byte with no base or index, as mod 00 r/m 101 is RIP relative in
+// 64-bit mode. ADD_ABSOLUTE takes the ModR/M byte of the 32-bit disp32
+// form and emits that. The translator is linked below 2GB so that its
+// data fits a sign extended disp32.
+*/
+#define ADD_REX(w,reg,rm)                               \
+  if((w) || (reg) >= X86_R8 || (rm) >= X86_R8){        \
+    ADD_BYTE(X86_PRE_REX | ((w)?X86_REX_W:0) |          \
+      (((reg) >= X86_R8)?X86_REX_R:0) |                 \
+      (((rm) >= X86_R8)?X86_REX_B:0));                  \
+  }
+
+#define ADD_ABSOLUTE(modrm,addr)                        \
+  ADD_BYTE(((modrm) & 0xF8) | 0x04); /* SIB follows */  \
+  ADD_BYTE(0x25); /* SIB - disp32, no base, no index */ \
+  ADD_WORD((uint32_t)(uintptr_t)(addr));
+
+/*
+// Guest memory is addressed as [RSI + RDX + disp32], where RDX holds the
+// ARM address, zero extended by the 32-bit operation that computed it.
+// GUEST_OPERAND is the ModR/M and SIB of such an operand whose reg field
+// is reg; the disp32 follows.
+*/
+#define GUEST_OPERAND(reg)                              \
+  ADD_BYTE(0x84 | ((reg) << 3)); /* SIB + disp32 */     \
+  ADD_BYTE(0x16); /* SIB - rsi + rdx */
+
+/*
+// Operand of a field of armCpu, at disp8 off RBP, for an instruction whose
+// reg field is reg (or an opcode extension). disp is one of the CPU_*
+// offsets.
+*/
+#define CPU_OPERAND(reg,disp)                           \
+  ADD_BYTE(0x45 | (((reg) & 7) << 3)); /* rbp+disp8 */  \
+  ADD_BYTE(disp);
+
+/*
+// Access an ARM register from translated code. ARM_OPERAND emits the
+// instruction op whose reg field is host register reg and whose r/m
+// operand is ARM register arm. LOAD_ARM_REG and STORE_ARM_REG move an ARM
+// register to or from a host register. All of them use the host register
+// the ARM register is kept in, if any, and its slot off RBP otherwise.
+*/
+#define REGFILE_DISP(arm)       (CPU_REGFILE + (arm) * sizeof(int32_t))
+
+#define ARM_OPERAND(op,reg,arm)                         \
+  if(armHostReg[arm] != X86_NOREG){                     \
+    ADD_REX(0,reg,armHostReg[arm]);                     \
+    ADD_BYTE(op);                                       \
+    ADD_BYTE(0xC0 | (((reg) & 7) << 3) |                \
+      (armHostReg[arm] & 7));                           \
+  }else{                                                \
+    ADD_REX(0,reg,0);                                   \
+    ADD_BYTE(op);                                       \
+    ADD_BYTE(0x45 | (((reg) & 7) << 3)); /* rbp+disp8 */\
+    ADD_BYTE(REGFILE_DISP(arm));                        \
+  }
+
+#define LOAD_ARM_REG(reg,arm)                           \
+  ARM_OPERAND(X86_OP_MOV_TO_REG,reg,arm);
+
+#define STORE_ARM_REG(reg,arm)                          \
+  ARM_OPERAND(X86_OP_MOV_FROM_REG,reg,arm);             \
+  armHostDirty |= (1 << (arm));
+
+/*
+// Write the ARM registers that the block has cached and modified back to
+// armCpu.regFile. Emitted before every exit from a block. The pinned registers
+// are left to the dispatcher.
+*/
+#define WRITEBACK_ARM_REGS {                            \
+  int wbReg;                                            \
+  for(wbReg = 0; wbReg < NUM_ARM_REGISTERS; wbReg++){   \
+    if(armHostReg[wbReg] != X86_NOREG &&                \
+       armPinnedReg[wbReg] == X86_NOREG &&              \
+       (armHostDirty & (1 << wbReg))){                  \
+      ADD_REX(0,armHostReg[wbReg],0);                   \
+      ADD_BYTE(X86_OP_MOV_FROM_REG);                    \
+      ADD_BYTE(0x45 | ((armHostReg[wbReg] & 7) << 3));  \
+      ADD_BYTE(REGFILE_DISP(wbReg));                    \
+    }                                                   \
+  }                                                     \
+}
+
+/*
+// Call a C helper from translated code. The helper may clobber every
+// register the ABI leaves to the caller, so the pinned and cached ones
+// among them (RSI, RDI and r8-r11) are saved around the call. RSP is 16
+// byte aligned in translated code, and six pushes keep it that way.
+*/
+#define CALL_HELPER(helper) {                           \
+  int chReg;                                            \
+  ADD_BYTE(X86_OP_PUSH_REG + X86_ESI);                  \
+  ADD_BYTE(X86_OP_PUSH_REG + X86_EDI);                  \
+  for(chReg = 0; chReg < 4; chReg++){                   \
+    ADD_BYTE(X86_PRE_REX | X86_REX_B);                  \
+    ADD_BYTE(X86_OP_PUSH_REG + chReg);                  \
+  }                                                     \
+  ADD_BYTE(X86_OP_CALL);                                \
+  ADD_WORD((uintptr_t)(                                 \
+    (intptr_t)(helper) - (intptr_t)(instInfo.pX86Addr + count + 4)));\
+  for(chReg = 3; chReg >= 0; chReg--){                  \
+    ADD_BYTE(X86_PRE_REX | X86_REX_B);                  \
+    ADD_BYTE(X86_OP_POP_REG + chReg);                   \
+  }                                                     \
+  ADD_BYTE(X86_OP_POP_REG + X86_EDI);                   \
+  ADD_BYTE(X86_OP_POP_REG + X86_ESI);                   \
+}
+
+/*
+// Record the flags of the operation that left its result in EAX. For
+// arithmetic, EDX holds the second operand, the one subtracted for SUB.
+// Only the flag groups in live are stored; the others are dead.
+*/
+#define RECORD_FLAGS_LOGIC(live)                        \
+  if((live) & FLAGS_NZ){                                \
+    ADD_BYTE(X86_OP_MOV_FROM_REG);                      \
+    CPU_OPERAND(X86_EAX,CPU_FLAG_NZ);                   \
+  }
+
+#define RECORD_FLAGS_ARITH(op,live)                     \
+  RECORD_FLAGS_LOGIC(live);                             \
+  if((live) & FLAGS_CV){                                \
+    ADD_BYTE(X86_OP_MOV_FROM_REG);                      \
+    CPU_OPERAND(X86_EAX,CPU_FLAG_RES);                  \
+    ADD_BYTE(X86_OP_MOV_FROM_REG);                      \
+    CPU_OPERAND(X86_EDX,CPU_FLAG_SRC);                  \
+    ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);                  \
+    CPU_OPERAND(0,CPU_FLAG_OP); /* mov imm32 to rm32 */ \
+    ADD_WORD(op);                                       \
+  }
+
 #define DPREG_INFO              instInfo.armInstInfo.dpreg
 #define DPIMM_INFO              instInfo.armInstInfo.dpimm
 #define LSMULT_INFO             instInfo.armInstInfo.lsmult
@@ -1,18 +1,57 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "debug.h"
 #include "decode.h"
 #include "types.h"
 #include "decodeprivate.h"
 #include "codeenv.h"
 #include "codegen.h"
+#include "elfload.h"
+#include "native.h"
 
-void *nextBB;
+/* Without the index, an optimized translation could not be found */
+#ifdef NOINDEX
+#define NOOPTIMIZE
+#endif /* NOINDEX */
+
+/* Traces are recorded by the interpreter when blocks are optimized */
+#if (defined(NOOPTIMIZE) || defined(NOINTERP)) && !defined(NOTRACE)
+#define NOTRACE
+#endif /* NOOPTIMIZE || NOINTERP */
 
-uint32_t cpsr;     /* ARM Program Status Register for user mode */
-uint32_t x86Flags; /* x86 Flag Register */
+/*
+// Flags are clear at the start: an addition of 0 to 0 leaves C and V clear,
+// and a positive non-zero result leaves N and Z clear.
+*/
+struct armCpu_t armCpu = {
+  .flagNZ = 1,
+  .flagOp = FLAGS_ADD,
+};
+
+_Static_assert(offsetof(struct armCpu_t, regFile) == CPU_REGFILE &&
+  offsetof(struct armCpu_t, cpsr) == CPU_CPSR &&
+  offsetof(struct armCpu_t, flagNZ) == CPU_FLAG_NZ &&
+  offsetof(struct armCpu_t, flagOp) == CPU_FLAG_OP &&
+  offsetof(struct armCpu_t, flagSrc) == CPU_FLAG_SRC &&
+  offsetof(struct armCpu_t, flagRes) == CPU_FLAG_RES &&
+  offsetof(struct armCpu_t, nextBB) == CPU_NEXT_BB &&
+  offsetof(struct armCpu_t, pTakenCalloutSourceLoc) == CPU_TAKEN_SOURCE &&
+  offsetof(struct armCpu_t, pUntakenCalloutSourceLoc) == CPU_UNTAKEN_SOURCE &&
+  offsetof(struct armCpu_t, pIndirectSite) == CPU_INDIRECT_SITE &&
+  offsetof(struct armCpu_t, pReturnSite) == CPU_RETURN_SITE &&
+  offsetof(struct armCpu_t, returnStackTop) == CPU_RETURN_TOP,
+  "CPU_* offsets do not match struct armCpu_t");
+_Static_assert(sizeof(struct armCpu_t) <= 128,
+  "struct armCpu_t is out of reach of a disp8");
 
-int32_t regFile[NUM_ARM_REGISTERS];
 typedef void (*translator)(void);
 
 #ifdef DEBUG
@@ -23,10 +62,10 @@ typedef void (*translator)(void);
     if(i>0 && ((i%4) == 0)){                     \
       printf("\n");                              \
     }                                            \
-    printf("R[%2d] = 0x%08X ",i, regFile[i]);    \
+    printf("R[%2d] = 0x%08X ",i, armCpu.regFile[i]);    \
   }                                              \
   printf("\n");                                  \
-  printf("Flags = 0x%x\n",x86Flags);             \
+  printf("CPSR = 0x%08X\n",armX86ReadFlags());     \
   printf("=========\n");                         \
 }
 
@@ -46,161 +85,2442 @@ typedef void (*translator)(void);
 uint32_t *pArmPC;
 uint8_t *pX86PC;
 
-void callEndBBTaken(){
+/*
+// Dispatcher
+//
+// Translated code never calls back into the translator. A block exit that is
+// not chained jumps to one of the trampolines below. The trampoline drops the
+// host stack back to where it was when translated code was first entered,
+// calls the matching callEndBB*() to chain, look up or translate the next
+// block, and jumps to the x86 address it returns. The host stack depth is the
+// same at the start of every block, however many blocks have run, and no
+// return address is ever left behind to confuse the return predictor.
+//
+// The exit sequence is a 5-byte 'jmp rel32' to the trampoline whose address
+// is handed over in p(Un)takenCalloutSourceLoc, so chaining only has to
+// retarget the jump.
+//
+// Translated code keeps the ARM registers in armPinnedReg in r8-r15 all the
+// time, so the trampolines store them to armCpu.regFile before the
+// translator runs, and load them again, along with the state and guest
+// memory base registers, before jumping back into translated code. Nothing else
+// crosses from one block to the next in host registers. The table below
+// and the PINNED_REGS macro of the trampolines must agree.
+*/
+const uint8_t armPinnedReg[NUM_ARM_REGISTERS] = {
+  X86_R8, X86_R8 + 1, X86_R8 + 2, X86_R8 + 3,   /* r0-r3 */
+  X86_R8 + 4, X86_NOREG, X86_NOREG, X86_NOREG,  /* r4 */
+  X86_NOREG, X86_NOREG, X86_NOREG, X86_R8 + 5,  /* fp */
+  X86_NOREG, X86_R8 + 6, X86_R8 + 7, X86_NOREG  /* sp, lr */
+};
+
+void *dispatchStack;
+
+void dispatchEnter(void *x86Block);
+
+asm(
+  ".macro PINNED_REGS op\n"
+  "  \\op 0, %r8d\n"
+  "  \\op 4, %r9d\n"
+  "  \\op 8, %r10d\n"
+  "  \\op 12, %r11d\n"
+  "  \\op 16, %r12d\n"
+  "  \\op 44, %r13d\n"
+  "  \\op 52, %r14d\n"
+  "  \\op 56, %r15d\n"
+  ".endm\n"
+  ".macro SAVE_PINNED slot, reg\n"
+  "  movl \\reg, \\slot(%rbp)\n"
+  ".endm\n"
+  ".macro LOAD_PINNED slot, reg\n"
+  "  movl \\slot(%rbp), \\reg\n"
+  ".endm\n"
+  ".macro ENTER_TRANSLATED\n"
+  "  leaq armCpu(%rip), %rbp\n"
+  "  movq armMemBase(%rip), %rsi\n"
+  "  PINNED_REGS LOAD_PINNED\n"
+  "  jmp *%rax\n"
+  ".endm\n"
+  ".macro DISPATCH handler\n"
+  "  movq dispatchStack(%rip), %rsp\n"
+  "  PINNED_REGS SAVE_PINNED\n"
+  "  call \\handler\n"
+  "  ENTER_TRANSLATED\n"
+  ".endm\n"
+  ".text\n"
+  ".globl dispatchEnter\n"
+  "dispatchEnter:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  andq $-16, %rsp\n"
+  "  movq %rsp, dispatchStack(%rip)\n"
+  "  movq %rdi, %rax\n"
+  "  ENTER_TRANSLATED\n"
+  ".globl dispatchTaken\n"
+  "dispatchTaken:\n"
+  "  DISPATCH callEndBBTaken\n"
+  ".globl dispatchNotTaken\n"
+  "dispatchNotTaken:\n"
+  "  DISPATCH callEndBBNotTaken\n"
+  ".globl dispatchIndirect\n"
+  "dispatchIndirect:\n"
+  "  DISPATCH callEndBBIndirect\n"
+  ".globl dispatchReturn\n"
+  "dispatchReturn:\n"
+  "  DISPATCH callEndBBReturn\n"
+#ifndef NOOPTIMIZE
+  ".globl dispatchHot\n"
+  "dispatchHot:\n"
+  "  DISPATCH callEndBBHot\n"
+#endif /* NOOPTIMIZE */
+);
+
+/*
+// Indirect branch sites
+//
+// A block that ends by writing the PC from a register or from memory
+// (mov pc, lr; ldr pc, [..]; ldm {.., pc}) cannot be chained, because the
+// target changes from one execution to the next. Instead, every such exit
+// carries an inline lookup, emitted by indirectExitHandler():
+//
+//   1. The target is compared against the last target seen at this site.
+//      On a match, the code jumps straight to the cached translation.
+//   2. Otherwise the target is looked up in the index lookaside, a direct
+//      mapped table that the translation index keeps filled.
+//   3. Otherwise the exit goes through dispatchIndirect, which looks up or
+//      translates the target and makes it the cached target of the site.
+//
+// The per-site record lives outside the code cache (see "Code cache"
+// below).
+*/
+struct indirectSite_t{
+  uint32_t armTarget;       /* Last ARM target seen at this site */
+  void *x86Target;          /* Its translation */
+  uint32_t *pArmAddr;       /* ARM instruction that branches */
+  uint32_t hits;            /* Target matched the cached target */
+  uint32_t sharedHits;      /* Target found in the index lookaside */
+  uint32_t misses;          /* Target had to be looked up in the index */
+  uint32_t retargets;       /* Misses that replaced the cached target */
+  struct indirectSite_t *next;
+};
+
+
+/*
+// Return address prediction
+//
+// Every translated BL pushes a pointer to its return site onto a shadow
+// return stack, a ring of RAS_SIZE entries. A return (mov pc, lr;
+// ldm {.., pc}; ldr pc, [sp], #..) pops the top entry and compares the PC
+// with the guest address the entry predicts. On a match it jumps to the
+// translation of that address without any lookup.
+//
+// A return site only predicts once its continuation has been translated.
+// Until then, a return to the link address of the site goes through
+// dispatchReturn, which translates the continuation and fills in the site.
+//
+// A prediction is only ever taken when the PC equals the guest address of
+// the entry, and the entry always holds the translation of that address.
+// So if the guest has changed LR or the stack, or the ring has wrapped, the
+// return simply misses and falls back to the indirect branch lookup.
+*/
+#define RAS_SIZE                32
+#define RAS_TOP_MASK            ((RAS_SIZE - 1) * sizeof(void *))
+
+struct returnSite_t{
+  uint32_t armTarget;       /* Predicted return address, once translated */
+  void *x86Target;          /* Its translation */
+  uint32_t armLink;         /* Link address written by the BL */
+  uint32_t *pArmAddr;       /* The BL */
+  struct returnSite_t *next;
+};
+
+static struct returnSite_t noReturnSite = {
+  INDEX_LOOKASIDE_INVALID, NULL, INDEX_LOOKASIDE_INVALID, NULL, NULL
+};
+
+struct returnSite_t *returnStack[RAS_SIZE];
+
+#ifdef PROFILE
+uint32_t returnHits;        /* Returns that took the prediction */
+uint32_t returnMisses;      /* Returns that were mispredicted */
+uint32_t returnFills;       /* Return sites filled in by dispatchReturn */
+#endif /* PROFILE */
+
+/*
+// Code cache
+//
+// Translations go into a code cache of a fixed size, split into
+// X86_CODE_REGIONS regions that are filled one after the other. A block is
+// only started in a region that still has room for X86_CODE_BLOCK_MAX
+// bytes. That is more than any block can take: a block is cut after
+// BLOCK_MAX_INSTS ARM instructions, and none of them is translated to
+// anywhere near 1KB of x86 code.
+// When the current region is full, the translator moves on to the next
+// one, wrapping around, and flushes whatever that region held. So the
+// oldest translations are the ones that go, a region at a time.
+//
+// Whatever refers to a block of a region that is flushed must forget it:
+//
+//   - The index entry and the lookaside slot of the block (EvictItem()).
+//   - Jumps chained to the block from the other regions. Every block keeps
+//     a list of the jumps chained to it, and each is pointed back at the
+//     dispatcher entry it jumped to before it was chained. A jump that sits
+//     in a region that has itself been flushed since is left alone; the
+//     region generation tells.
+//   - Indirect branch and return sites of the other regions that cached
+//     the block as their target.
+//   - Entries of the shadow return stack that point at return sites of the
+//     region.
+//
+// Each block is preceded in the cache by a pointer to its descriptor.
+// Descriptors, chain links and branch site records are carved out of
+// chunks that belong to a region, and are reused once it is flushed.
+// Chunks are handed out in turn from the records reservation below 2GB,
+// since translated code refers to site records by 32-bit absolute
+// addresses. They are kept apart from the code, so that the counters that
+// profiling builds bump on every execution do not share cache lines with
+// code.
+//
+// Handling a block exit may flush regions when the next block is
+// translated. The exit then leaves the jump or the site it came from as it
+// is, since it may have gone with a region.
+*/
+#define REGION_CHUNK_SIZE       0x4000
+
+struct blockLink_t{
+  uint8_t *pJump;           /* Chained 'jmp rel32' */
+  void (*dispatcher)(void); /* Where it jumped before it was chained */
+  uint32_t sourceGen;       /* Generation of the region of the jump */
+  struct blockLink_t *next;
+};
+
+/* Tiers of execution; see "Tiered execution" and "Optimizing retranslation" */
+#define TIER_INTERP             0
+#define TIER_BASE               1
+#define TIER_OPTIMIZED          2
+#define OPTIMIZE_THRESHOLD      256
+
+struct codeBlock_t{
+  uint32_t armAddr;         /* ARM address of the block */
+  uint8_t *x86Addr;         /* Its translation */
+  struct blockLink_t *links;/* Jumps chained to it */
+  struct codeBlock_t *next;
+  int32_t hotCount;         /* Entries left before it is optimized */
+  uint8_t tier;             /* TIER_BASE or TIER_OPTIMIZED */
+  bool replaced;            /* Its entry jumps to an optimized translation */
+};
+
+struct codeRegion_t{
+  uint8_t *start;
+  uint8_t *end;
+  uint8_t *top;             /* End of the code translated into it */
+  uint32_t gen;             /* Number of times the region was flushed */
+  struct codeBlock_t *blocks;
+  uint8_t *chunks;          /* First chunk; each starts with the next */
+  uint8_t *chunk;           /* Chunk being carved */
+  uint32_t chunkUsed;
+#ifndef NOCHAINING
+  struct indirectSite_t *indirectSites;
+  struct returnSite_t *returnSites;
+#endif /* NOCHAINING */
+};
+
+static struct codeRegion_t codeRegions[X86_CODE_REGIONS];
+static struct codeRegion_t *codeRegion;  /* Region being filled */
+static uint8_t *codeStart;
+static uint32_t codeRegionSize;
+static uint8_t *codeRecords;
+static uint32_t codeRecordsUsed;
+static bool codeRecordsSpilled; /* Ran out of the records reservation */
+
+uint32_t codeFlushes;           /* Regions flushed */
+uint32_t codeBlocksEvicted;     /* Blocks flushed with them */
+uint32_t codeLinksUndone;       /* Chained jumps put back to the dispatcher */
+uint32_t codeRetranslations;    /* Blocks translated again after a flush */
+uint32_t codeIndexFlushes;      /* Whole cache flushes for a full index */
+uint32_t codeUnindexed;         /* Optimized blocks the index had no room for */
+uint32_t codeBlocksLoaded;      /* Blocks mapped from the persistent cache */
+uint32_t codeBlocksNew;         /* Blocks translated by this run */
+
+static bool optimizing;         /* Translating at TIER_OPTIMIZED */
+
+#define REGION_OF(x86Addr)      \
+  (&codeRegions[((uint8_t *)(x86Addr) - codeStart) / codeRegionSize])
+#define BLOCK_OF(x86Block)      (((struct codeBlock_t **)(x86Block))[-1])
+
+/*
+// Split the code cache into regions. Any remainder of the size that does
+// not make up a whole region is left unused.
+*/
+static void initCodeCache(uint8_t *pX86Code, uint32_t size,
+                          uint8_t *pRecords){
+  uint32_t i;
+
+  codeStart = pX86Code;
+  codeRecords = pRecords;
+  codeRegionSize = size / X86_CODE_REGIONS;
+  DP_ASSERT(codeRegionSize >= 2 * X86_CODE_BLOCK_MAX,
+    "Code cache too small\n");
+
+  for(i = 0; i < X86_CODE_REGIONS; i++){
+    codeRegions[i].start = codeStart + i * codeRegionSize;
+    codeRegions[i].end = codeRegions[i].start + codeRegionSize;
+    codeRegions[i].top = codeRegions[i].start;
+    codeRegions[i].chunkUsed = REGION_CHUNK_SIZE;
+  }
+
+  codeRegion = &codeRegions[0];
+}
+
+/*
+// Take a new chunk from the records reservation. Should it run out, the
+// chunk is mapped anywhere below 2GB, and the cache can no longer be
+// saved (see "Persistent code cache").
+*/
+static uint8_t *newChunk(void){
+  uint8_t *chunk;
+
+  if(codeRecordsUsed + REGION_CHUNK_SIZE <= X86_RECORDS_SIZE){
+    chunk = codeRecords + codeRecordsUsed;
+    codeRecordsUsed += REGION_CHUNK_SIZE;
+  }else{
+    chunk = mmap(NULL, REGION_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    DP_ASSERT(chunk != MAP_FAILED, "No memory for code cache records\n");
+    codeRecordsSpilled = TRUE;
+  }
+
+  return chunk;
+}
+
+static void *regionAlloc(struct codeRegion_t *region, uint32_t size){
+  uint8_t *next;
+  void *p;
+
+  if(region->chunkUsed + size > REGION_CHUNK_SIZE){
+    next = (region->chunk == NULL)?region->chunks:*(uint8_t **)region->chunk;
+    if(next == NULL){
+      next = newChunk();
+      *(uint8_t **)next = NULL;
+      if(region->chunk == NULL){
+        region->chunks = next;
+      }else{
+        *(uint8_t **)region->chunk = next;
+      }
+    }
+    region->chunk = next;
+    region->chunkUsed = sizeof(uint8_t *);
+  }
+
+  p = region->chunk + region->chunkUsed;
+  region->chunkUsed += (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  return p;
+}
+
+#ifndef NOCHAINING
+static bool regionOwns(const struct codeRegion_t *region, const void *p){
+  const uint8_t *chunk;
+
+  for(chunk = region->chunks; chunk != NULL; chunk = *(uint8_t **)chunk){
+    if((const uint8_t *)p >= chunk &&
+       (const uint8_t *)p < chunk + REGION_CHUNK_SIZE){
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static bool inRegion(const struct codeRegion_t *region, const void *x86Addr){
+  return ((const uint8_t *)x86Addr >= region->start &&
+          (const uint8_t *)x86Addr < region->end);
+}
+
+/*
+// Point a chained jump back at the dispatcher.
+*/
+static void unchainJump(const struct blockLink_t *link){
+  *(uint32_t *)(link->pJump + 1) = (uint32_t)(
+    (intptr_t)link->dispatcher - (intptr_t)(link->pJump + 5));
+}
+
+/*
+// Chain the exit jump at pJump, which went to dispatcher, to the block
+// translated at x86Block, and remember it with the block.
+*/
+static void chainJump(uint8_t *pJump, void (*dispatcher)(void),
+                      uint8_t *x86Block){
+  struct codeBlock_t *block = BLOCK_OF(x86Block);
+  struct blockLink_t *link;
+
+  link = regionAlloc(REGION_OF(x86Block), sizeof(struct blockLink_t));
+  link->pJump = pJump;
+  link->dispatcher = dispatcher;
+  link->sourceGen = REGION_OF(pJump)->gen;
+  link->next = block->links;
+  block->links = link;
+
+  DP1("Chaining BB to %p\n",x86Block);
+  *pJump = X86_OP_JMP;
+  *(uint32_t *)(pJump + 1) = (uint32_t)(
+    (intptr_t)x86Block - (intptr_t)(pJump + 5));
+}
+#endif /* NOCHAINING */
+
+/*
+// Flush a region: forget every block translated into it, and whatever
+// refers to those blocks from elsewhere.
+*/
+static void flushRegion(struct codeRegion_t *region){
+  struct codeBlock_t *block;
+#ifndef NOCHAINING
+  struct blockLink_t *link;
+  struct codeRegion_t *other;
+  struct indirectSite_t *indirect;
+  struct returnSite_t *ret;
+  uint32_t i;
+#endif /* NOCHAINING */
+
+  DP1("Flushing code region at %p\n",region->start);
+
+  for(block = region->blocks; block != NULL; block = block->next){
+    EvictItem(ARM_HOST_ADDR(block->armAddr), block->x86Addr);
+    codeBlocksEvicted++;
+
+#ifndef NOCHAINING
+    for(link = block->links; link != NULL; link = link->next){
+      other = REGION_OF(link->pJump);
+      if(other != region && other->gen == link->sourceGen){
+        unchainJump(link);
+        codeLinksUndone++;
+      }
+    }
+#endif /* NOCHAINING */
+  }
+
+#ifndef NOCHAINING
+  for(other = codeRegions; other < codeRegions + X86_CODE_REGIONS; other++){
+    if(other == region){
+      continue;
+    }
+    for(indirect = other->indirectSites; indirect != NULL;
+        indirect = indirect->next){
+      if(inRegion(region, indirect->x86Target)){
+        indirect->armTarget = INDEX_LOOKASIDE_INVALID;
+        indirect->x86Target = NULL;
+      }
+    }
+    for(ret = other->returnSites; ret != NULL; ret = ret->next){
+      if(inRegion(region, ret->x86Target)){
+        ret->armTarget = INDEX_LOOKASIDE_INVALID;
+        ret->x86Target = NULL;
+      }
+    }
+  }
+
+  for(i = 0; i < RAS_SIZE; i++){
+    if(regionOwns(region, returnStack[i])){
+      returnStack[i] = &noReturnSite;
+    }
+  }
+
+  region->indirectSites = NULL;
+  region->returnSites = NULL;
+#endif /* NOCHAINING */
+
+  region->blocks = NULL;
+  region->top = region->start;
+  region->chunk = NULL;
+  region->chunkUsed = REGION_CHUNK_SIZE;
+  region->gen++;
+  codeFlushes++;
+}
+
+/*
+// Make room for a block about to be translated at pX86PC for the ARM block
+// at pArmAddr. Moves on to the next region, flushing it, if the current
+// one is too full, and lays down the descriptor of the block. Returns
+// where the block's code goes.
+*/
+static uint8_t *startBlock(uint8_t *pX86Addr, const uint32_t *pArmAddr){
+  struct codeBlock_t *block;
+
+  if(pX86Addr + sizeof(struct codeBlock_t *) + X86_CODE_BLOCK_MAX >
+     codeRegion->end){
+    codeRegion->top = pX86Addr;
+    codeRegion++;
+    if(codeRegion == codeRegions + X86_CODE_REGIONS){
+      codeRegion = codeRegions;
+    }
+    if(codeRegion->gen != 0 || codeRegion->blocks != NULL){
+      flushRegion(codeRegion);
+    }
+    pX86Addr = codeRegion->start;
+  }
+
+  block = regionAlloc(codeRegion, sizeof(struct codeBlock_t));
+  block->armAddr = (uint32_t)(uintptr_t)pArmAddr;
+  block->x86Addr = pX86Addr + sizeof(struct codeBlock_t *);
+  block->links = NULL;
+  block->hotCount = OPTIMIZE_THRESHOLD;
+  block->tier = (optimizing == TRUE)?TIER_OPTIMIZED:TIER_BASE;
+  block->replaced = FALSE;
+  block->next = codeRegion->blocks;
+  codeRegion->blocks = block;
+  codeBlocksNew++;
+
+  *(struct codeBlock_t **)pX86Addr = block;
+  return block->x86Addr;
+}
+
+#ifndef NOINDEX
+/*
+// Flush the whole code cache and start the translation index over. The
+// index keeps the ARM address of every block ever translated, and is only
+// sized for the blocks of the text. A program that runs code from elsewhere,
+// such as trampolines on the stack, may fill it up. Nothing refers to a
+// block that is not in the cache, so the index can then be emptied along
+// with the cache. Translation goes on at the start of the first region.
+*/
+static void flushCodeCache(void){
+  struct codeRegion_t *region;
+
+  DP("Translation index full, flushing the code cache\n");
+  for(region = codeRegions; region < codeRegions + X86_CODE_REGIONS;
+      region++){
+    if(region->gen != 0 || region->blocks != NULL){
+      flushRegion(region);
+    }
+  }
+  ClearIndex();
+  codeIndexFlushes++;
+
+  codeRegion = codeRegions;
+  pX86PC = codeRegion->start;
+}
+#endif /* NOINDEX */
+
+#ifndef NOCHAINING
+static struct indirectSite_t *newIndirectSite(uint32_t *pArmAddr){
+  struct indirectSite_t *site =
+    regionAlloc(codeRegion, sizeof(struct indirectSite_t));
+
+  site->armTarget = INDEX_LOOKASIDE_INVALID;
+  site->x86Target = NULL;
+  site->pArmAddr = pArmAddr;
+  site->hits = 0;
+  site->sharedHits = 0;
+  site->misses = 0;
+  site->retargets = 0;
+  site->next = codeRegion->indirectSites;
+  codeRegion->indirectSites = site;
+
+  return site;
+}
+
+#ifndef NORAS
+static struct returnSite_t *newReturnSite(uint32_t *pArmAddr){
+  struct returnSite_t *site =
+    regionAlloc(codeRegion, sizeof(struct returnSite_t));
+
+  site->armTarget = INDEX_LOOKASIDE_INVALID;
+  site->x86Target = NULL;
+  site->armLink = (uint32_t)(uintptr_t)(pArmAddr + 1);
+  site->pArmAddr = pArmAddr;
+  site->next = codeRegion->returnSites;
+  codeRegion->returnSites = site;
+
+  return site;
+}
+#endif /* NORAS */
+
+#ifdef PROFILE
+/*
+ * Print how often each indirect branch site found its target in the
+ * site cache, in the shared lookaside and in the index. A site that keeps
+ * being retargeted jumps to many different places. Returns that were
+ * predicted by the shadow return stack do not show up in the sites, and
+ * neither do sites that were flushed from the code cache.
+ *
+ * Return: None
+ */
+static void
+reportIndirectSites(void)
+{
+    struct codeRegion_t *region;
+    struct indirectSite_t *site;
+    uint32_t execs;
+
+    printf("Indirect branch sites:\n");
+    printf("  %-10s %10s %8s %8s %10s\n",
+        "ARM site", "execs", "site%", "shared%", "retargets");
+
+    for (region = codeRegions; region < codeRegions + X86_CODE_REGIONS;
+         region++) {
+        for (site = region->indirectSites; site != NULL; site = site->next) {
+            execs = site->hits + site->sharedHits + site->misses;
+            if (execs == 0) {
+                continue;
+            }
+            printf("  0x%08x %10u %8.2f %8.2f %10u\n",
+                (uint32_t)(uintptr_t)site->pArmAddr, execs,
+                (100.0 * site->hits) / execs,
+                (100.0 * site->sharedHits) / execs,
+                site->retargets);
+        }
+    }
+
+    printf("Return stack: %u predicted, %u mispredicted, %u filled\n",
+        returnHits, returnMisses, returnFills);
+}
+#endif /* PROFILE */
+#endif /* NOCHAINING */
+
+/*
+// Persistent code cache
+//
+// With ARMX86_CODE_CACHE set, the code cache is saved to that file when the
+// program ends, and mapped back in when the same program is run again. A
+// run then only translates the blocks that no earlier run got to.
+//
+// The file holds a header page, the image of the code cache and the image
+// of its records. The images are mapped, copy on write, at the addresses
+// they were saved from, so the code, the descriptors, the chain links and
+// the branch sites refer to each other, to the translator and to armCpu
+// just as they did, and nothing has to be relocated. That only holds for
+// the translator that made the file, since the translator is linked at a
+// fixed address but its layout changes with every build: the key in the
+// header is a hash of the loaded ARM image and of the translator's text.
+// The ARM image moves with armMemBase, but translated code only holds ARM
+// addresses. The host pointers to ARM instructions that site records keep
+// for reporting are the only ones to rebase.
+//
+// A file that does not fit (another program, translator or cache geometry,
+// or a cache that could not be mapped at X86_CODE_BASE) is ignored, and
+// replaced when the program ends. A run that translated nothing new leaves
+// the file alone. The file is written under another name and renamed over
+// the old one, which a run that is still using it keeps seeing whole.
+//
+// An executable made ahead of time carries its cache at cacheOffset within
+// itself (see "Ahead-of-time translation"). That cache is only ever read.
+*/
+#ifndef NOINDEX
+#define CACHE_MAGIC             0x43363858  /* "X86C" */
+#define CACHE_VERSION           2
+#define CACHE_HEADER_SIZE       0x1000
+#define CACHE_CODE_OFFSET       CACHE_HEADER_SIZE
+
+struct cacheHeader_t{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint8_t *codeStart;
+  uint32_t codeRegionSize;
+  uint32_t current;         /* Region being filled */
+  uint8_t *pX86PC;          /* Where the next block goes */
+  uint8_t *recordsStart;
+  uint32_t recordsUsed;
+  struct codeRegion_t regions[X86_CODE_REGIONS];
+};
+
+_Static_assert(sizeof(struct cacheHeader_t) <= CACHE_HEADER_SIZE,
+  "Code cache header does not fit its page");
+
+/* Bounds of the translator's text, from the linker */
+extern const uint8_t __executable_start[], etext[];
+
+static const char *cachePath;
+static off_t cacheOffset;
+static uint64_t cacheKey;
+
+static off_t cacheRecordsOffset(void){
+  return CACHE_CODE_OFFSET + (((off_t)codeRegionSize * X86_CODE_REGIONS +
+    CACHE_HEADER_SIZE - 1) & ~(off_t)(CACHE_HEADER_SIZE - 1));
+}
+
+/*
+// Map the code cache saved in cachePath, if it was saved for this program
+// by this translator, and index its blocks. Returns TRUE if it was taken.
+*/
+static bool loadCodeCache(void){
+  struct cacheHeader_t header;
+  struct codeRegion_t *region;
+  struct codeBlock_t *block;
+#ifndef NOCHAINING
+  struct indirectSite_t *indirect;
+  struct returnSite_t *ret;
+#endif /* NOCHAINING */
+  size_t codeSize = (size_t)codeRegionSize * X86_CODE_REGIONS;
+  off_t recordsOffset = cacheRecordsOffset();
+  struct stat st;
+  int fd;
+
+  if((fd = open(cachePath, O_RDONLY)) == -1){
+    return FALSE;
+  }
+
+  if(pread(fd, &header, sizeof(header), cacheOffset) != sizeof(header) ||
+     fstat(fd, &st) == -1 ||
+     header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+     header.key != cacheKey || header.codeStart != codeStart ||
+     header.codeRegionSize != codeRegionSize ||
+     header.current >= X86_CODE_REGIONS ||
+     header.recordsStart != codeRecords ||
+     header.recordsUsed > X86_RECORDS_SIZE ||
+     st.st_size < cacheOffset + recordsOffset + header.recordsUsed){
+    DP1("Code cache %s does not fit this run\n", cachePath);
+    close(fd);
+    return FALSE;
+  }
+
+  if(mmap(codeStart, codeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+       MAP_PRIVATE | MAP_FIXED, fd, cacheOffset + CACHE_CODE_OFFSET) ==
+       MAP_FAILED ||
+     (header.recordsUsed != 0 &&
+      mmap(codeRecords, header.recordsUsed, PROT_READ | PROT_WRITE,
+       MAP_PRIVATE | MAP_FIXED, fd, cacheOffset + recordsOffset) ==
+       MAP_FAILED)){
+    sys_err(("mmap: %s", cachePath));
+    close(fd);
+
+    /* go on with an empty cache */
+    DP_ASSERT(mmap(codeStart, codeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED &&
+      mmap(codeRecords, X86_RECORDS_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) !=
+      MAP_FAILED, "Unable to map the code cache again\n");
+    return FALSE;
+  }
+  close(fd);
+
+  memcpy(codeRegions, header.regions, sizeof(codeRegions));
+  codeRegion = &codeRegions[header.current];
+  pX86PC = header.pX86PC;
+  codeRecordsUsed = header.recordsUsed;
+
+  for(region = codeRegions; region < codeRegions + X86_CODE_REGIONS;
+      region++){
+    for(block = region->blocks; block != NULL; block = block->next){
+      if(block->replaced == FALSE){
+        INDEX_BLOCK(ARM_HOST_ADDR(block->armAddr), block->x86Addr);
+        codeBlocksLoaded++;
+      }
+    }
+
+#ifndef NOCHAINING
+    for(indirect = region->indirectSites; indirect != NULL;
+        indirect = indirect->next){
+      indirect->pArmAddr =
+        ARM_HOST_ADDR((uint32_t)(uintptr_t)indirect->pArmAddr);
+      indirect->hits = 0;
+      indirect->sharedHits = 0;
+      indirect->misses = 0;
+      indirect->retargets = 0;
+    }
+    for(ret = region->returnSites; ret != NULL; ret = ret->next){
+      ret->pArmAddr = ARM_HOST_ADDR((uint32_t)(uintptr_t)ret->pArmAddr);
+    }
+#endif /* NOCHAINING */
+  }
+
+  DP2("Code cache %s: %u blocks\n", cachePath, codeBlocksLoaded);
+  return TRUE;
+}
+
+/*
+// Save the code cache to cachePath, unless this run added nothing to it.
+// A failure to save is reported and otherwise ignored.
+*/
+static void saveCodeCache(void){
+  struct cacheHeader_t header;
+  struct codeRegion_t *region;
+  char tmpPath[PATH_MAX];
+  off_t recordsOffset = cacheRecordsOffset();
+  size_t size;
+  bool ok;
+  int fd;
+
+  if(codeBlocksNew == 0 || codeRecordsSpilled || cacheOffset != 0){
+    return;
+  }
+
+  codeRegion->top = pX86PC;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.key = cacheKey;
+  header.codeStart = codeStart;
+  header.codeRegionSize = codeRegionSize;
+  header.current = codeRegion - codeRegions;
+  header.pX86PC = pX86PC;
+  header.recordsStart = codeRecords;
+  header.recordsUsed = codeRecordsUsed;
+  memcpy(header.regions, codeRegions, sizeof(codeRegions));
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", cachePath, (int)getpid());
+  if((fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1){
+    sys_err(("open: %s", tmpPath));
+    return;
+  }
+
+  ok = (pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+  for(region = codeRegions; ok && region < codeRegions + X86_CODE_REGIONS;
+      region++){
+    size = region->top - region->start;
+    ok = (pwrite(fd, region->start, size,
+      CACHE_CODE_OFFSET + (region->start - codeStart)) == (ssize_t)size);
+  }
+  ok = ok && pwrite(fd, codeRecords, codeRecordsUsed, recordsOffset) ==
+    (ssize_t)codeRecordsUsed;
+  ok = ok && ftruncate(fd, recordsOffset + codeRecordsUsed) == 0;
+  ok = (close(fd) == 0) && ok;
+
+  if(!ok || rename(tmpPath, cachePath) == -1){
+    sys_err(("Unable to save the code cache to %s", cachePath));
+    unlink(tmpPath);
+  }
+}
+#endif /* NOINDEX */
+
+#ifdef PROFILE
+uint32_t flagBlocks;            /* Blocks analysed for flag liveness */
+uint32_t flagRecords;           /* Flag groups written by S instructions */
+uint32_t flagRecordsDropped;    /* ...of which nobody reads the record */
+uint32_t flagReloads;           /* Conditional instructions */
+uint32_t flagReloadsDropped;    /* ...that test EFLAGS left by the last */
+uint32_t condGrouped;           /* ...that join the run of the last */
+uint32_t condBranchless;        /* ...that select their result by cmov */
+uint32_t codeArmInsts;          /* ARM instructions translated */
+uint32_t codeX86Bytes;          /* Bytes of x86 code emitted for them */
+
+/*
+ * Print how much of the lazy flag record the flag liveness analysis
+ * found dead, how many conditions were tested on the flags left in
+ * EFLAGS instead of on the record, how many needed no check of their own
+ * because they were part of a predicated run, and how many conditional
+ * instructions were translated without a branch.
+ */
+static void reportFlags(void)
+{
+    printf("Flags: %u blocks, %u of %u records dropped, "
+        "%u of %u reloads dropped, %u grouped, %u branchless\n", flagBlocks,
+        flagRecordsDropped, flagRecords, flagReloadsDropped, flagReloads,
+        condGrouped, condBranchless);
+}
+
+/*
+ * Print how much x86 code the translator emitted per ARM instruction. The
+ * figure covers the whole block, exits and register loads included.
+ */
+static void reportCode(void)
+{
+    printf("Code: %u ARM instructions, %u x86 bytes, %.2f bytes each\n",
+        codeArmInsts, codeX86Bytes,
+        codeArmInsts ? (double)codeX86Bytes / codeArmInsts : 0.0);
+}
+
+/*
+ * Print how the code cache coped: how often a region was flushed to make
+ * room, how many blocks went with those regions, how many chained jumps
+ * had to be pointed back at the dispatcher, how many blocks had to be
+ * translated again after being flushed, and how many were found in the
+ * persistent cache rather than translated.
+ */
+static void reportCodeCache(void)
+{
+    printf("Code cache: %u bytes in %u regions, %u flushes, "
+        "%u blocks evicted, %u links undone, %u retranslations, "
+        "%u blocks loaded\n",
+        codeRegionSize * X86_CODE_REGIONS, X86_CODE_REGIONS, codeFlushes,
+        codeBlocksEvicted, codeLinksUndone, codeRetranslations,
+        codeBlocksLoaded);
+    printf("Translation index: %u flushes when full, %u optimized blocks "
+        "left out\n", codeIndexFlushes, codeUnindexed);
+}
+
+uint64_t tierNanos[TIER_OPTIMIZED + 1]; /* Time spent in each tier */
+
+static uint64_t profileClock(void){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifndef NOOPTIMIZE
+/*
+ * Print the time spent interpreting cold blocks and translating blocks at
+ * each tier, how many blocks in the code cache are at each tier, and how
+ * often blocks at TIER_BASE were entered. Time spent running translated
+ * code is not measured, since it is not spent in the translator.
+ */
+static void reportTiers(void)
+{
+    struct codeRegion_t *region;
+    struct codeBlock_t *block;
+    uint32_t blocks[TIER_OPTIMIZED + 1] = { 0 };
+    uint64_t baseEntries = 0;
+
+    for (region = codeRegions; region < codeRegions + X86_CODE_REGIONS;
+         region++) {
+        for (block = region->blocks; block != NULL; block = block->next) {
+            blocks[block->tier]++;
+            if (block->tier == TIER_BASE) {
+                baseEntries += OPTIMIZE_THRESHOLD - block->hotCount;
+            }
+        }
+    }
+
+    printf("Tiers: interpreter %.0f us; base %u blocks, %.0f us, "
+        "%llu entries; optimized %u blocks, %.0f us, after %u entries\n",
+        tierNanos[TIER_INTERP] / 1000.0, blocks[TIER_BASE],
+        tierNanos[TIER_BASE] / 1000.0, (unsigned long long)baseEntries,
+        blocks[TIER_OPTIMIZED], tierNanos[TIER_OPTIMIZED] / 1000.0,
+        OPTIMIZE_THRESHOLD);
+}
+#endif /* NOOPTIMIZE */
+
+#ifndef NOINTERP
+extern uint32_t interpInsts;    /* ARM instructions interpreted */
+uint32_t interpBlocks;          /* Blocks interpreted */
+uint32_t hotBlocks;             /* Blocks translated once hot */
+uint32_t rejectedBlocks;        /* Hot blocks the translator gave up on */
+
+/*
+ * Print how much ran in the interpreter, and how many blocks turned hot
+ * and were translated or, failing that, left to the interpreter.
+ */
+static void reportInterp(void)
+{
+    printf("Interpreter: %u blocks, %u ARM instructions, %u blocks hot, "
+        "%u rejected\n", interpBlocks, interpInsts, hotBlocks,
+        rejectedBlocks);
+}
+#endif /* NOINTERP */
+
+#ifndef NOTRACE
+uint32_t traceCount;            /* Optimized blocks that follow a trace */
+uint32_t traceLoops;            /* Traces that loop back to their start */
+uint32_t traceSideExits;        /* Side exits they leave through */
+
+/*
+ * Print how many hot blocks became traces, and how many of those loop.
+ */
+static void reportTraces(void)
+{
+    printf("Traces: %u, %u loops, %u side exits\n", traceCount, traceLoops,
+        traceSideExits);
+}
+#endif /* NOTRACE */
+
+#ifndef NOIR
+extern uint32_t irInsts;        /* ARM instructions built into the IR */
+extern uint32_t irRegions;      /* Regions lowered */
+extern uint32_t irGets;         /* Register reads built */
+extern uint32_t irGetsDropped;  /* ...replaced by a value in the region */
+extern uint32_t irPuts;         /* Register writes built */
+extern uint32_t irPutsDropped;  /* ...overwritten later in the region */
+extern uint32_t irSpills;       /* Values spilled in lowering */
+extern uint32_t irFolds;        /* Reads and operations folded */
+
+/*
+ * Print how much went through the IR, how many of the register reads
+ * and writes of its instructions the passes removed, and how many reads
+ * and operations were folded to constants.
+ */
+static void reportIR(void)
+{
+    printf("IR: %u ARM instructions in %u regions, %u of %u gets dropped, "
+        "%u of %u puts dropped, %u spills, %u folds\n", irInsts, irRegions,
+        irGetsDropped, irGets, irPutsDropped, irPuts, irSpills, irFolds);
+}
+#endif /* NOIR */
+
+#ifndef NOIDIOM
+uint32_t idiomCopies;           /* Blocks translated as a copy loop */
+uint32_t idiomFills;            /* ...and as a fill loop */
+
+/*
+ * Print how many blocks were copy or fill loops, translated to run the
+ * whole loop at once.
+ */
+static void reportIdioms(void)
+{
+    printf("Idioms: %u copy loops, %u fill loops\n", idiomCopies,
+        idiomFills);
+}
+#endif /* NOIDIOM */
+#endif /* PROFILE */
+
+/*
+// FIXME: How should a program end?
+*/
+static void endProgram(void){
+  printf("%d\n",armCpu.regFile[0]);
+
+#if defined(PROFILE) && !defined(NOCHAINING)
+  reportIndirectSites();
+#endif /* PROFILE && !NOCHAINING */
+#ifdef PROFILE
+  reportFlags();
+  reportCode();
+  reportCodeCache();
+#ifndef NOINTERP
+  reportInterp();
+#endif /* NOINTERP */
+#ifndef NOOPTIMIZE
+  reportTiers();
+#endif /* NOOPTIMIZE */
+#ifndef NOTRACE
+  reportTraces();
+#endif /* NOTRACE */
+#ifndef NOIR
+  reportIR();
+#endif /* NOIR */
+#ifndef NOIDIOM
+  reportIdioms();
+#endif /* NOIDIOM */
+#ifndef NONATIVE
+  armX86NativeReport();
+#endif /* NONATIVE */
+#endif /* PROFILE */
+#ifndef NOINDEX
+  if(cachePath != NULL){
+    saveCodeCache();
+  }
+#endif /* NOINDEX */
+
+  exit(0);
+}
+
+static void *enterBlock(uint32_t armAddr);
+
+void *callEndBBTaken(){
+#ifndef NOCHAINING
+  uint32_t flushes = codeFlushes;
+  uint32_t target = armCpu.nextBB;
+#endif /* NOCHAINING */
+  uint8_t *nextX86BB;
+
   DP_HI;
 
   DISPLAY_REGS;
-  /*
-  // FIXME: How should a program end?
-  */
-  if(nextBB == NULL){
-    printf("%d\n",regFile[0]);
-    exit(0);
+  if(armCpu.nextBB == 0){
+    endProgram();
   }
-  DP1("Next BB Address = %p\n",nextBB);
+  DP1("Next BB Address = 0x%x\n",armCpu.nextBB);
+
+  nextX86BB = enterBlock(armCpu.nextBB);
 
 #ifndef NOCHAINING
-  DP1("I am %p\n",&callEndBBTaken);
-  DP1("Got here from address %p\n",pTakenCalloutSourceLoc);
-  DP1("Offset from call location = 0x%x\n",
-    (intptr_t)&callEndBBTaken - (intptr_t)pTakenCalloutSourceLoc);
+  DP1("I am %p\n",&dispatchTaken);
+  DP1("Got here from address %p\n",armCpu.pTakenCalloutSourceLoc);
 
-  uint8_t *nextX86BB;
-  if(pTakenCalloutSourceLoc != 0x00000000){
+  if(armCpu.pTakenCalloutSourceLoc != 0x00000000 && flushes == codeFlushes &&
+     armCpu.nextBB == target){
     DP2("Caller Dump: 0x%x 0x%x\n",
-      *(uint8_t *)pTakenCalloutSourceLoc,
-      *(uint32_t *)((uint8_t *)pTakenCalloutSourceLoc + 1)
+      *(uint8_t *)armCpu.pTakenCalloutSourceLoc,
+      *(uint32_t *)((uint8_t *)armCpu.pTakenCalloutSourceLoc + 1)
     );
 
-    if((nextX86BB = (uint8_t *)INDEXED_BLOCK((void *)nextBB)) == NULL){
-      nextX86BB = pX86PC;
-    }
-    DP1("Chaining BB to %p\n",nextX86BB);
-    *(uint8_t *)pTakenCalloutSourceLoc = X86_OP_JMP;
-    *(uint32_t *)((uint8_t *)pTakenCalloutSourceLoc + 1) = 
-      (uintptr_t)nextX86BB - 
-        ((uintptr_t)((uint8_t *)pTakenCalloutSourceLoc + 5)
-      );
+    chainJump(armCpu.pTakenCalloutSourceLoc, &dispatchTaken, nextX86BB);
   }
 #endif /* NOCHAINING */
 
-  pArmPC = nextBB;
-  decodeBasicBlock();
-
   DP_BYE;
+  return nextX86BB;
 }
 
-void callEndBBNotTaken(){
-  DP_HI;
-
+void *callEndBBNotTaken(){
 #ifndef NOCHAINING
+  uint32_t flushes = codeFlushes;
+  uint32_t target = armCpu.nextBB;
+#endif /* NOCHAINING */
   uint8_t *nextX86BB;
-  DP1("I am %p\n",&callEndBBNotTaken);
-  DP1("Got here from address %p\n",pUntakenCalloutSourceLoc);
-  DP1("Offset from call location = 0x%x\n",
-    (intptr_t)&callEndBBNotTaken - (intptr_t)pUntakenCalloutSourceLoc);
-  DP2("Caller Dump: 0x%x 0x%x\n",
-    *(uint8_t *)pUntakenCalloutSourceLoc,
-    *(uint32_t *)((uint8_t *)pUntakenCalloutSourceLoc + 1)
-  );
-  DP1("Next BB Address = %p\n",nextBB);
 
-  if((nextX86BB = (uint8_t *)INDEXED_BLOCK((void *)nextBB)) == NULL){
-    nextX86BB = pX86PC;
+  DP_HI;
+
+  DISPLAY_REGS;
+  if(armCpu.nextBB == 0){
+    endProgram();
+  }
+  DP1("Next BB Address = 0x%x\n",armCpu.nextBB);
+
+  nextX86BB = enterBlock(armCpu.nextBB);
+
+#ifndef NOCHAINING
+  DP1("I am %p\n",&dispatchNotTaken);
+  DP1("Got here from address %p\n",armCpu.pUntakenCalloutSourceLoc);
+
+  if(flushes == codeFlushes && armCpu.nextBB == target){
+    DP2("Caller Dump: 0x%x 0x%x\n",
+      *(uint8_t *)armCpu.pUntakenCalloutSourceLoc,
+      *(uint32_t *)((uint8_t *)armCpu.pUntakenCalloutSourceLoc + 1)
+    );
+
+    chainJump(armCpu.pUntakenCalloutSourceLoc, &dispatchNotTaken, nextX86BB);
+  }
+#endif /* NOCHAINING */
+
+  DP_BYE;
+  return nextX86BB;
+}
+
+void *callEndBBIndirect(){
+  struct indirectSite_t *site = armCpu.pIndirectSite;
+  uint32_t flushes = codeFlushes;
+  uint32_t target = armCpu.nextBB;
+  void *nextX86BB;
+
+  DP_HI;
+
+  DISPLAY_REGS;
+  if(armCpu.nextBB == 0){
+    endProgram();
+  }
+  DP2("Indirect branch from %p to 0x%x\n",site->pArmAddr,armCpu.nextBB);
+
+  site->misses++;
+  nextX86BB = enterBlock(armCpu.nextBB);
+
+  if(flushes == codeFlushes && armCpu.nextBB == target){
+    if(site->armTarget != INDEX_LOOKASIDE_INVALID){
+      site->retargets++;
+    }
+    site->armTarget = armCpu.nextBB;
+    site->x86Target = nextX86BB;
+  }
+
+  DP_BYE;
+  return nextX86BB;
+}
+
+void *callEndBBReturn(){
+  struct returnSite_t *site = armCpu.pReturnSite;
+  uint32_t flushes = codeFlushes;
+  uint32_t target = armCpu.nextBB;
+  void *nextX86BB;
+
+  DP_HI;
+
+  DISPLAY_REGS;
+  DP2("Return from %p to 0x%x\n",site->pArmAddr,armCpu.nextBB);
+
+  nextX86BB = enterBlock(armCpu.nextBB);
+
+  if(flushes == codeFlushes && armCpu.nextBB == target){
+#ifdef PROFILE
+    returnFills++;
+#endif /* PROFILE */
+    site->x86Target = nextX86BB;
+    site->armTarget = site->armLink;
+  }
+
+  DP_BYE;
+  return nextX86BB;
+}
+
+/*
+// Traces
+//
+// Blocks end at every branch, so a hot loop runs as a few blocks chained
+// together, each of which leaves through an exit that stores nextBB and
+// its source before the chained jmp. When a block turns hot (see
+// "Optimizing retranslation" below), recordTrace() first runs the program
+// on from it in the interpreter, an instruction at a time, and notes which
+// way each direct branch goes: the next executing tail. Recording stops
+// when the path gets back to the block, which makes it a loop, or to any
+// other point on it, at a branch with link or any other write to the PC,
+// or after TRACE_MAX_INSTS instructions.
+//
+// The optimized translation then follows the recorded path instead of
+// ending at those branches. An unconditional branch emits nothing, and a
+// conditional one only a jcc to a side exit for the direction that was
+// not taken; the side exits are placed after the rest of the block. A
+// branch back to the start closes the loop with a jmp past the loads of
+// the cached registers, so a loop such as
+//
+//   8028: ldr r2, [..]; ldr r3, [..]; cmp r2, r3; bge 8054
+//   8038: ldr ..; add ..; str ..; ldr ..; add ..; str ..; b 8028
+//
+// runs as straight-line host code, with the cmp and bge fused into a cmp
+// and jge. The flag analysis and the register allocation look at the
+// instructions along the same path. Without the interpreter, hot blocks
+// are optimized on their own.
+*/
+#define TRACE_MAX_BRANCHES      16
+#define TRACE_MAX_INSTS         64      /* As many as a block can have */
+
+static const uint32_t *traceHead;       /* Where the trace starts */
+static uint32_t traceLength;            /* Branches it follows, if any */
+static const uint32_t *traceBranch[TRACE_MAX_BRANCHES];
+static const uint32_t *traceNext[TRACE_MAX_BRANCHES];
+
+/*
+// Where the trace goes on after the branch at pArmAddr, or NULL if it does
+// not follow it.
+*/
+static const uint32_t *traceFollow(const uint32_t *pArmAddr){
+  uint32_t i;
+
+  for(i = 0; i < traceLength; i++){
+    if(traceBranch[i] == pArmAddr){
+      return traceNext[i];
+    }
+  }
+  return NULL;
+}
+
+#ifndef NOTRACE
+/*
+// Is pArmAddr on the path recorded so far? The path runs from segment[i]
+// to traceBranch[i] for each branch followed, and then from the last
+// segment to pLast.
+*/
+static bool onTrace(const uint32_t *pArmAddr, const uint32_t **segment,
+                    const uint32_t *pLast){
+  uint32_t i;
+
+  for(i = 0; i <= traceLength; i++){
+    if(pArmAddr >= segment[i] &&
+       pArmAddr <= ((i < traceLength)?traceBranch[i]:pLast)){
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+// Record the trace from the block at armAddr, running the program on in
+// the interpreter. Returns the ARM address it has got to.
+*/
+static uint32_t recordTrace(uint32_t armAddr){
+  const uint32_t *segment[TRACE_MAX_BRANCHES + 1];
+  const uint32_t *pArmAddr = ARM_HOST_ADDR(armAddr), *pNext;
+  uint32_t armInst, i;
+
+  traceHead = pArmAddr;
+  traceLength = 0;
+  segment[0] = pArmAddr;
+  armX86ReadFlags();
+
+  for(i = 0; i < TRACE_MAX_INSTS; i++){
+    armInst = *pArmAddr;
+    armAddr = armX86Interpret((uint32_t)(uintptr_t)pArmAddr, 1);
+    if(armAddr == 0){
+      endProgram();
+    }
+    pNext = ARM_HOST_ADDR(armAddr);
+
+    if((armInst & (INST_TYPE_MASK | BIT24_MASK)) != INST_TYPE_BRCH ||
+       (armInst >> COND_SHIFT) == COND_UNDEF){
+      if(pNext != pArmAddr + 1){
+        break;
+      }
+    }else if(traceLength == TRACE_MAX_BRANCHES){
+      break;
+    }else if(pNext == traceHead){
+      traceBranch[traceLength] = pArmAddr;
+      traceNext[traceLength++] = pNext;
+      break;
+    }else if(onTrace(pNext, segment, pArmAddr) == TRUE){
+      break;
+    }else{
+      traceBranch[traceLength] = pArmAddr;
+      traceNext[traceLength++] = pNext;
+      segment[traceLength] = pNext;
+    }
+    pArmAddr = pNext;
+  }
+
+  armX86WriteFlags();
+  DP2("Trace from %p follows %u branches\n",(void *)traceHead,traceLength);
+  return armAddr;
+}
+#endif /* NOTRACE */
+
+/*
+// Optimizing retranslation
+//
+// A block is first translated at TIER_BASE, with flag liveness and register
+// allocation that see no further than the block, and with an entry counter
+// in front of everything else:
+//
+//   dec dword [hotCount]       ; in the descriptor of the block
+//   jz  <hot exit>             ; mov nextBB, armAddr; jmp dispatchHot
+//
+// After OPTIMIZE_THRESHOLD entries, the hot exit has callEndBBHot()
+// translate the block again at TIER_OPTIMIZED. That translation has no
+// counter, and
+//
+//   - takes the flags live out of a block that ends in a direct branch, or
+//     is cut, to be those its successors may read before writing them, so
+//     that records nobody reads are dropped at the end of the block too,
+//   - gives EBX to an ARM register as well as EDI, unless the block has
+//     conditions that want it for a cmov,
+//   - follows the trace recorded from the block, if any (see "Traces"
+//     above).
+//
+// The optimized translation then takes the place of the first: the index
+// is pointed at it, the jumps chained to the first are chained to it, and
+// the first now starts with a jmp to it, for the indirect branch and
+// return sites that still have the first as their target. Blocks loaded
+// from a persistent cache, or translated ahead of time, are optimized the
+// same way once they are hot.
+*/
+#ifndef NOOPTIMIZE
+#define ENTRY_COUNTER_SIZE      13
+
+/*
+// Emit the entry counter at the start of the translation of block. Returns
+// its size. The jz is filled in by hotExitHandler().
+*/
+static uint8_t countEntries(struct codeBlock_t *block){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+
+  block->hotCount = OPTIMIZE_THRESHOLD;
+
+  instInfo.pX86Addr = block->x86Addr;
+  ADD_BYTE(X86_OP_DEC_RM32);
+  ADD_ABSOLUTE(0x0D,&block->hotCount); /* MOD R/M for DEC - 0xFF /1 */
+  ADD_BYTE(X86_PRE_JCC);
+  ADD_BYTE(X86_OP_JE);
+  ADD_WORD(0);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+/*
+// Emit, at pX86Addr, the exit the entry counter of block takes once it
+// runs out. Nothing has been loaded into the cached registers yet there.
+*/
+static uint8_t hotExitHandler(struct codeBlock_t *block, uint8_t *pX86Addr){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+
+  *(uint32_t *)(block->x86Addr + ENTRY_COUNTER_SIZE - 4) =
+    (uint32_t)(pX86Addr - (block->x86Addr + ENTRY_COUNTER_SIZE));
+
+  instInfo.pX86Addr = pX86Addr;
+  ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+  CPU_OPERAND(0,CPU_NEXT_BB); /* mov imm32 to rm32 0xC7 /0 */
+  ADD_WORD(block->armAddr);
+  ADD_BYTE(X86_OP_JMP);
+  ADD_WORD((uintptr_t)(
+    (intptr_t)&dispatchHot - (intptr_t)(instInfo.pX86Addr + count + 4)
+  ));
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+/*
+// Put the optimized translation at x86Block in the place of the one at
+// oldX86Block.
+*/
+static void replaceBlock(uint8_t *oldX86Block, uint8_t *x86Block){
+  struct codeBlock_t *old = BLOCK_OF(oldX86Block);
+#ifndef NOCHAINING
+  struct blockLink_t *link;
+#endif /* NOCHAINING */
+
+  /*
+  // The first translation stays reachable through its entry, which is
+  // about to jump to the second, should the index have no room for it.
+  */
+  if(INDEX_BLOCK(ARM_HOST_ADDR(old->armAddr), x86Block) == -1){
+    DP1("No room in the index for the block at 0x%x\n",old->armAddr);
+    codeUnindexed++;
+  }
+
+#ifndef NOCHAINING
+  for(link = old->links; link != NULL; link = link->next){
+    if(REGION_OF(link->pJump)->gen == link->sourceGen){
+      chainJump(link->pJump, link->dispatcher, x86Block);
+    }
+  }
+  old->links = NULL;
+#endif /* NOCHAINING */
+
+  *oldX86Block = X86_OP_JMP;
+  *(uint32_t *)(oldX86Block + 1) = (uint32_t)(
+    (intptr_t)x86Block - (intptr_t)(oldX86Block + 5));
+  old->replaced = TRUE;
+}
+
+void *callEndBBHot(){
+  uint32_t armAddr = armCpu.nextBB;
+  uint8_t *oldX86BB, *nextX86BB;
+  uint32_t gen = 0;
+#ifndef NOTRACE
+  uint32_t next;
+#endif /* NOTRACE */
+
+  DP_HI;
+
+  oldX86BB = INDEXED_BLOCK(ARM_HOST_ADDR(armAddr));
+  if(oldX86BB != NULL){
+    gen = REGION_OF(oldX86BB)->gen;
+  }
+  DP2("Optimizing block at 0x%x (%p)\n",armAddr,oldX86BB);
+
+#ifndef NOTRACE
+  next = recordTrace(armAddr);
+#ifdef PROFILE
+  if(traceLength > 0){
+    traceCount++;
+    traceLoops += (traceNext[traceLength - 1] == traceHead);
+  }
+#endif /* PROFILE */
+#endif /* NOTRACE */
+
+  pArmPC = ARM_HOST_ADDR(armAddr);
+  optimizing = TRUE;
+  nextX86BB = decodeBasicBlock();
+  optimizing = FALSE;
+  traceLength = 0;
+
+  /*
+  // The region of the first translation may have been flushed to make room
+  // for the second, in which case there is nothing left to replace. If the
+  // translator gave up on the second, say on an instruction the trace took
+  // from an interpreted block, the first one stays.
+  */
+  if(nextX86BB == NULL){
+    DP1("Block at 0x%x left unoptimized\n",armAddr);
+  }else if(oldX86BB != NULL && REGION_OF(oldX86BB)->gen == gen &&
+     BLOCK_OF(oldX86BB)->tier == TIER_BASE){
+    replaceBlock(oldX86BB, nextX86BB);
+  }else if(INDEX_BLOCK(ARM_HOST_ADDR(armAddr), nextX86BB) == -1){
+    DP1("No room in the index for the block at 0x%x\n",armAddr);
+    codeUnindexed++;
+  }
+
+#ifndef NOTRACE
+  /* Recording has run the program on, possibly to somewhere else */
+  nextX86BB = enterBlock(next);
+#else /* NOTRACE */
+  if(nextX86BB == NULL){
+    nextX86BB = enterBlock(armAddr);
+  }
+#endif /* NOTRACE */
+
+  DP_BYE;
+  return nextX86BB;
+}
+#endif /* NOOPTIMIZE */
+
+/*
+// Flag liveness
+//
+// Before a block is translated, analyzeFlags() looks ahead over its ARM
+// instructions and works out, for every flag setting instruction, which
+// parts of the lazy flag record a later reader can still see. Stores to
+// the other parts are dropped. A flag setting instruction that is directly
+// followed by a conditional one leaves its flags in EFLAGS, so the
+// condition is tested on those without reloading the record. A compare
+// followed by a condition is emitted as a cmp and jcc pair.
+//
+// The analysis only sees the block. Flags are taken to be live where it
+// ends, and where it cannot tell what an instruction does. An optimized
+// translation (see "Optimizing retranslation") looks past a direct branch
+// or a cut at the end of the block, into the blocks that follow.
+*/
+#define FLAGS_LOOKAHEAD         64
+#define BLOCK_MAX_INSTS         FLAGS_LOOKAHEAD
+#define FLAGS_GROUPS(flags)     (((flags) & FLAGS_NZ) + ((flags) >> 1))
+
+static const uint32_t *blockInsts[FLAGS_LOOKAHEAD + 1]; /* In path order */
+static uint8_t blockFlagsLive[FLAGS_LOOKAHEAD + 1];
+static uint8_t blockHostFlags[FLAGS_LOOKAHEAD + 1];
+static bool blockFuse[FLAGS_LOOKAHEAD + 1];
+
+static uint32_t blockRecords;
+static uint32_t blockRecordsDropped;
+static uint32_t blockReloads;
+static uint32_t blockReloadsDropped;
+static uint32_t blockCondGrouped;
+static uint32_t blockCondBranchless;
+
+/* Flag groups a condition reads */
+static const uint8_t condFlags[16] = {
+  FLAGS_NZ, FLAGS_NZ, FLAGS_CV, FLAGS_CV,       /* EQ NE CS CC */
+  FLAGS_NZ, FLAGS_NZ, FLAGS_CV, FLAGS_CV,       /* MI PL VS VC */
+  FLAGS_ALL, FLAGS_ALL, FLAGS_ALL, FLAGS_ALL,   /* HI LS GE LT */
+  FLAGS_ALL, FLAGS_ALL, 0, FLAGS_ALL            /* GT LE AL NV */
+};
+
+/*
+// Does a condition tested on EFLAGS of the given kind give the ARM answer?
+// The logical operations leave C and V alone on the ARM, so only the N and
+// Z conditions can be tested after them.
+*/
+static bool hostFlagsUsable(uint8_t hostFlags, uint8_t cond){
+  if(hostFlags == HOST_FLAGS_NONE || cond == AL || cond == COND_UNDEF){
+    return FALSE;
+  }
+  return (hostFlags != HOST_FLAGS_LOGIC || (condFlags[cond] & FLAGS_CV) == 0);
+}
+
+/*
+// Classify one ARM instruction: the flag groups it reads other than through
+// its condition, the groups it writes when executed, and what EFLAGS hold
+// after it. Returns FALSE if the instruction may end the block, or is not
+// understood, in which case the analysis stops there.
+*/
+static bool classifyFlags(uint32_t armInst, uint8_t *reads, uint8_t *writes,
+                          uint8_t *hostFlags){
+  uint32_t opcode = armInst & OPCODE_MASK;
+
+  *reads = 0;
+  *writes = 0;
+  *hostFlags = HOST_FLAGS_NONE;
+
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+      if((armInst & 0x00000090) == 0x00000090){
+        /* Multiplies and extra loads and stores; a MULS is not followed */
+        return !((armInst & 0x0F0000F0) == 0x00000090 &&
+                 (armInst & BIT20_MASK));
+      }
+      if((armInst & 0x01900000) == 0x01000000){
+        if((armInst & MRS_MASK) == MRS_CPSR){
+          *reads = FLAGS_ALL;
+          return TRUE;
+        }
+        /* The record is rebuilt from scratch by an MSR */
+        return ((armInst & MSR_REG_MASK) == MSR_REG_CPSR);
+      }
+    break;
+    case INST_TYPE_IMM_UNDEF:
+      if((armInst & 0x01900000) == 0x01000000){
+        return ((armInst & MSR_IMM_MASK) == MSR_IMM_CPSR);
+      }
+    break;
+    case INST_TYPE_LSIMM:
+    case INST_TYPE_LSR_UNDEF:
+      return !((armInst & BIT20_MASK) && RD(armInst) == 15);
+    case INST_TYPE_LSMULT:
+      return !((armInst & BIT20_MASK) && (armInst & (1 << 15)));
+    case INST_TYPE_COP_SWI:
+      return ((armInst & 0x0F000000) == 0x0F000000);
+    default:
+      return FALSE;
+  }
+
+  /* Data processing */
+  if(RD(armInst) == 15 && (opcode < OPCODE_TST || opcode > OPCODE_CMN)){
+    return FALSE;
+  }
+  if(opcode == OPCODE_ADC || opcode == OPCODE_SBC || opcode == OPCODE_RSC){
+    *reads = FLAGS_CV;
+  }
+  if((armInst & BIT20_MASK) == 0){
+    return TRUE;
+  }
+
+  switch(opcode){
+    case OPCODE_SUB:
+    case OPCODE_RSB:
+    case OPCODE_CMP:
+      *writes = FLAGS_ALL;
+      *hostFlags = HOST_FLAGS_SUB;
+    break;
+    case OPCODE_ADD:
+    case OPCODE_CMN:
+      *writes = FLAGS_ALL;
+      *hostFlags = HOST_FLAGS_ADD;
+    break;
+    case OPCODE_AND:
+    case OPCODE_TST:
+    case OPCODE_ORR:
+    case OPCODE_BIC:
+    case OPCODE_MVN:
+      *writes = FLAGS_NZ;
+      *hostFlags = HOST_FLAGS_LOGIC;
+    break;
+    case OPCODE_MOV:
+      /* Nothing is computed, so EFLAGS do not follow the result */
+      *writes = FLAGS_NZ;
+    break;
+    default:
+      /* The remaining handlers do not record flags */
+    break;
+  }
+
+  return TRUE;
+}
+
+/*
+// The target of the direct branch at pArmAddr.
+*/
+static const uint32_t *branchTarget(const uint32_t *pArmAddr){
+  uint32_t offset = *pArmAddr & OFFSET_MASK;
+
+  offset |= ((offset & 0x00800000) > 0)?0xFF000000:0x00000000;
+  return ARM_HOST_ADDR((uint32_t)(uintptr_t)pArmAddr + 8 + (offset << 2));
+}
+
+/*
+// Does the instruction return from a subroutine (mov pc, lr; ldr pc, [sp];
+// ldm {.., pc})? The procedure call standard leaves the flags undefined on
+// return, so no caller reads the flags a subroutine returns with.
+*/
+static bool isReturn(uint32_t armInst){
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+      return ((armInst & ~COND_MASK) == 0x01A0F00E);
+    case INST_TYPE_LSIMM:
+      return ((armInst & BIT20_MASK) && RD(armInst) == 15 &&
+              RN(armInst) == 13);
+    case INST_TYPE_LSMULT:
+      return ((armInst & BIT20_MASK) && (armInst & (1 << 15)));
+    default:
+      return FALSE;
+  }
+}
+
+/*
+// The flag groups that code starting at pArmAddr may read before writing
+// them. The scan follows unconditional branches, ends at an unconditional
+// return, and stops at the first other instruction that may end a block,
+// or where it leaves the text, as it may after running into a literal
+// pool; whatever has not been written by then is taken to be read.
+*/
+static uint8_t flagsReadAt(const uint32_t *pArmAddr){
+  uint8_t reads, writes, hostFlags, cond;
+  uint8_t read = 0, written = 0;
+  int32_t i;
+
+  for(i = 0; i < FLAGS_LOOKAHEAD && written != FLAGS_ALL; i++, pArmAddr++){
+    if(!armX86ElfIsText((uint32_t)(uintptr_t)pArmAddr)){
+      break;
+    }
+    cond = (*pArmAddr & COND_MASK) >> COND_SHIFT;
+    if(classifyFlags(*pArmAddr, &reads, &writes, &hostFlags) == FALSE){
+      if(cond == AL && (*pArmAddr & (INST_TYPE_MASK | BIT24_MASK)) ==
+         INST_TYPE_BRCH){
+        pArmAddr = branchTarget(pArmAddr) - 1;
+        continue;
+      }
+      if(cond == AL && isReturn(*pArmAddr) == TRUE){
+        return read;
+      }
+      break;
+    }
+    read |= (reads | condFlags[cond]) & ~written;
+    if(cond == AL){
+      written |= writes;
+    }
+  }
+
+  return read | (FLAGS_ALL & ~written);
+}
+
+/*
+// The flag groups live past the instruction blockInsts[n] that ended the
+// scan of a block, other than those its own condition reads. Only a direct
+// branch, a return and a cut after FLAGS_LOOKAHEAD instructions have
+// successors that can be told.
+*/
+static uint8_t flagsLiveOut(int32_t n){
+  const uint32_t *pArmAddr = blockInsts[n];
+  uint32_t armInst;
+  uint8_t live, cond;
+
+  if(n == FLAGS_LOOKAHEAD){
+    return flagsReadAt(pArmAddr);
+  }
+
+  armInst = *pArmAddr;
+  cond = (armInst & COND_MASK) >> COND_SHIFT;
+  if(cond == COND_UNDEF){
+    return FLAGS_ALL;
+  }else if(isReturn(armInst) == TRUE){
+    live = 0;
+  }else if((armInst & INST_TYPE_MASK) == INST_TYPE_BRCH){
+    live = flagsReadAt(branchTarget(pArmAddr));
+  }else{
+    return FLAGS_ALL;
+  }
+
+  if(cond != AL){
+    live |= flagsReadAt(pArmAddr + 1);
+  }
+
+  return live;
+}
+
+/*
+// The instruction after the one at pArmAddr on the path being translated:
+// the next one, or where a branch the trace follows goes. The branch that
+// closes a loop ends the path like any other.
+*/
+static const uint32_t *nextOnPath(const uint32_t *pArmAddr){
+  const uint32_t *pNext = traceFollow(pArmAddr);
+
+  return (pNext != NULL && pNext != traceHead)?pNext:(pArmAddr + 1);
+}
+
+/*
+// classifyFlags() for the instruction at pArmAddr on the path. A branch
+// the trace follows does not end the block; when conditional, it reads
+// what the side exit in the other direction may read.
+*/
+static bool classifyOnPath(const uint32_t *pArmAddr, uint8_t *reads,
+                           uint8_t *writes, uint8_t *hostFlags){
+  const uint32_t *pNext = traceFollow(pArmAddr);
+
+  if(pNext == NULL || pNext == traceHead){
+    return classifyFlags(*pArmAddr, reads, writes, hostFlags);
+  }
+
+  *reads = 0;
+  *writes = 0;
+  *hostFlags = HOST_FLAGS_NONE;
+  if((*pArmAddr & COND_MASK) != COND_AL){
+    *reads = flagsReadAt((pNext == pArmAddr + 1)?branchTarget(pArmAddr):
+      (pArmAddr + 1));
+  }
+  return TRUE;
+}
+
+/*
+// Run the analysis for the block starting at pArmAddr, along the path it
+// is translated in. The results are picked up, instruction by instruction,
+// by decodeBasicBlock().
+*/
+void analyzeFlags(const uint32_t *pArmAddr){
+  uint8_t reads[FLAGS_LOOKAHEAD], writes[FLAGS_LOOKAHEAD];
+  uint8_t hostFlags[FLAGS_LOOKAHEAD], liveOut[FLAGS_LOOKAHEAD];
+  uint8_t live, exitLive, cond, next;
+  int32_t i, n;
+
+  for(n = 0; n < FLAGS_LOOKAHEAD; n++){
+    blockInsts[n] = pArmAddr;
+    if(classifyOnPath(pArmAddr, &reads[n], &writes[n], &hostFlags[n])
+       == FALSE){
+      break;
+    }
+    pArmAddr = nextOnPath(pArmAddr);
+  }
+  blockInsts[n] = pArmAddr;
+
+  exitLive = FLAGS_ALL;
+  if(optimizing == TRUE){
+    exitLive = flagsLiveOut(n);
+  }
+
+  for(i = n; i <= FLAGS_LOOKAHEAD; i++){
+    blockFlagsLive[i] = FLAGS_ALL;
+    blockHostFlags[i] = HOST_FLAGS_NONE;
+    blockFuse[i] = FALSE;
+  }
+
+  blockRecords = 0;
+  blockRecordsDropped = 0;
+  blockReloads = 0;
+  blockReloadsDropped = 0;
+
+  /*
+  // Walk backwards from the end of what was understood, where everything
+  // is live. The instruction that ended the scan may still test the flags
+  // of the one before it, so it is considered as a consumer.
+  */
+  live = exitLive;
+  if(n < FLAGS_LOOKAHEAD){
+    live |= condFlags[(*blockInsts[n] & COND_MASK) >> COND_SHIFT];
+  }
+  for(i = n - 1; i >= 0; i--){
+    cond = (*blockInsts[i] & COND_MASK) >> COND_SHIFT;
+    next = (i + 1 < FLAGS_LOOKAHEAD)?
+      ((*blockInsts[i + 1] & COND_MASK) >> COND_SHIFT):AL;
+
+    liveOut[i] = live;
+    blockFlagsLive[i] = live & writes[i];
+    blockHostFlags[i] = HOST_FLAGS_NONE;
+    blockFuse[i] = FALSE;
+
+    if(cond == AL && hostFlagsUsable(hostFlags[i], next)){
+      /*
+      // The next instruction tests EFLAGS. Its condition does not need the
+      // record; only what is read past it does. A conditional instruction
+      // never kills the flags, so that is what is live out of it.
+      */
+      blockHostFlags[i + 1] = hostFlags[i];
+      blockFlagsLive[i] = writes[i] & ((i + 1 < n)?
+        (liveOut[i + 1] | reads[i + 1]):exitLive);
+      blockFuse[i] = ((*blockInsts[i] & OPCODE_MASK) == OPCODE_CMP);
+    }
+
+    if(writes[i] != 0){
+      blockRecords += FLAGS_GROUPS(writes[i]);
+      blockRecordsDropped += FLAGS_GROUPS(writes[i] & ~blockFlagsLive[i]);
+    }
+
+    if(cond == AL){
+      live &= ~writes[i];
+    }
+    live |= reads[i] | condFlags[cond];
+  }
+
+  /* Count the condition checks, including the one that ended the scan */
+  for(i = 0; i <= n && i < FLAGS_LOOKAHEAD; i++){
+    cond = (*blockInsts[i] & COND_MASK) >> COND_SHIFT;
+    if(cond != AL){
+      blockReloads++;
+      blockReloadsDropped += (blockHostFlags[i] != HOST_FLAGS_NONE);
+    }
+  }
+}
+
+/*
+// Register allocation
+//
+// Every ARM register has a home in armCpu.regFile. The ones in armPinnedReg
+// are kept in r8-r15 across blocks (see "Dispatcher" above). Before a block is
+// translated, allocateRegs() counts how often each of the others is used
+// in the block and gives the most used ones a host register of their own
+// for the whole block. EAX, ECX and EDX are scratch in the handlers, EBX
+// holds branchless conditions, RBP and RSI hold the state and guest memory
+// bases, which leaves EDI.
+//
+// A cached register is loaded at the start of the block. It is written
+// back to regFile, if the block has written it, before every exit, since
+// the dispatcher, the translator and the next block all expect it there.
+// Translated code calls out only to helpers that do not look at regFile,
+// and has no way of recovering from a fault in guest memory access, so
+// the exits are the only places that need the writeback. The handlers
+// access ARM registers only through ARM_OPERAND, LOAD_ARM_REG and
+// STORE_ARM_REG, which pick the host register or regFile as allocated.
+// The PC is never cached.
+//
+// An optimized translation also hands out EBX, if none of the conditional
+// instructions in sight could use it for a cmov (see "Branchless
+// conditions" below). Those further on then branch instead.
+*/
+#define REGS_MIN_USES           2
+
+static const uint8_t hostRegs[] = { X86_EDI, X86_EBX };
+static bool blockBranchless;    /* EBX is left for branchless conditions */
+
+#ifdef DEBUG
+static const char *hostRegNames[] = {
+  "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"
+};
+#endif /* DEBUG */
+
+uint8_t armHostReg[NUM_ARM_REGISTERS];
+uint16_t armHostDirty;
+
+#ifndef NOCMOV
+static bool branchlessEligible(uint32_t armInst);
+#endif /* NOCMOV */
+
+/*
+// The ARM registers an instruction reads or writes, as a bit mask.
+*/
+static uint16_t armRegUses(uint32_t armInst){
+  uint32_t opcode = armInst & OPCODE_MASK;
+  uint16_t uses = 0;
+
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+      if((armInst & 0x00000090) == 0x00000090){
+        return (1 << RN(armInst)) | (1 << RD(armInst)) |
+               (1 << RS(armInst)) | (1 << RM(armInst));
+      }
+      if((armInst & 0x01900000) == 0x01000000){
+        return ((armInst & MRS_MASK) == MRS_CPSR)?(1 << RD(armInst)):
+          (1 << RM(armInst));
+      }
+      uses = (1 << RM(armInst));
+      if(armInst & 0x00000010){
+        uses |= (1 << RS(armInst));
+      }
+      /* fall through */
+    case INST_TYPE_IMM_UNDEF:
+      if((armInst & 0x01900000) == 0x01000000){
+        return uses;
+      }
+      if(opcode != OPCODE_MOV && opcode != OPCODE_MVN){
+        uses |= (1 << RN(armInst));
+      }
+      if(opcode < OPCODE_TST || opcode > OPCODE_CMN){
+        uses |= (1 << RD(armInst));
+      }
+      return uses;
+    case INST_TYPE_LSR_UNDEF:
+      uses = (1 << RM(armInst));
+      /* fall through */
+    case INST_TYPE_LSIMM:
+      return uses | (1 << RN(armInst)) | (1 << RD(armInst));
+    case INST_TYPE_LSMULT:
+      return (1 << RN(armInst)) | (armInst & 0x0000FFFF);
+    case INST_TYPE_BRCH:
+      return (armInst & 0x01000000)?(1 << 14):0;
+    default:
+      return 0;
+  }
+}
+
+/*
+// Pick the ARM registers to cache in the block analyzeFlags() has just
+// looked at, and emit the code that loads them at pX86Addr. Returns the
+// size of that code.
+*/
+static uint8_t allocateRegs(uint8_t *pX86Addr){
+  struct decodeInfo_t instInfo;
+  uint32_t uses[NUM_ARM_REGISTERS];
+  uint8_t reads, writes, hostFlags;
+  uint16_t regs;
+  uint8_t count = 0;
+  uint8_t numHostRegs = 1;
+  int32_t i, r, best;
+
+  memset(uses, 0, sizeof(uses));
+  memcpy(armHostReg, armPinnedReg, sizeof(armHostReg));
+  armHostDirty = 0;
+  blockBranchless = TRUE;
+  if(optimizing == TRUE){
+    numHostRegs = sizeof(hostRegs);
+  }
+
+  for(i = 0; i < FLAGS_LOOKAHEAD; i++){
+    regs = armRegUses(*blockInsts[i]);
+    for(r = 0; r < NUM_ARM_REGISTERS - 1; r++){
+      uses[r] += ((regs >> r) & 1);
+    }
+#ifndef NOCMOV
+    if((*blockInsts[i] & COND_MASK) != COND_AL &&
+       branchlessEligible(*blockInsts[i]) == TRUE){
+      numHostRegs = 1;
+    }
+#endif /* NOCMOV */
+    if(classifyOnPath(blockInsts[i], &reads, &writes, &hostFlags) == FALSE){
+      break;
+    }
+  }
+
+  /*
+  // Hand out the host registers in order of use.
+  */
+  instInfo.pX86Addr = pX86Addr;
+  for(i = 0; i < numHostRegs; i++){
+    best = -1;
+    for(r = 0; r < NUM_ARM_REGISTERS - 1; r++){
+      if(armHostReg[r] == X86_NOREG && uses[r] >= REGS_MIN_USES &&
+         (best < 0 || uses[r] > uses[best])){
+        best = r;
+      }
+    }
+    if(best < 0){
+      break;
+    }
+
+    armHostReg[best] = hostRegs[i];
+    if(hostRegs[i] == X86_EBX){
+      blockBranchless = FALSE;
+    }
+    DP3("Allocating r%d to %s (%u uses)\n", best,
+      hostRegNames[hostRegs[i]], uses[best]);
+
+    ADD_REX(0,hostRegs[i],0);
+    ADD_BYTE(X86_OP_MOV_TO_REG);
+    ADD_BYTE(0x45 | ((hostRegs[i] & 7) << 3)); /* MOD R/M - rbp+disp8 */
+    ADD_BYTE(REGFILE_DISP(best));
+  }
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+#ifndef NOIDIOM
+/*
+// Copy and fill loops
+//
+// gcc copies and clears memory a chunk at a time, with loops like
+//
+//   loop:  ldmia r1!, {r3-r6}         loop:  stmia r0!, {r3-r6}
+//          stmia r0!, {r3-r6}                subs r2, r2, #16
+//          subs r2, r2, #16                  bne loop
+//          bne loop
+//
+// The translation of a block that is such a loop first runs the whole
+// loop at once, with rep movsb or rep stosd, and leaves the registers and
+// flags as the last time round would have, before it exits past the bne:
+//
+//   mov [rsi + r0], [rsi + r1], r2     r0 += r2, r1 += r2
+//   r2 = 0, flags of 16 - 16           ldmdb r0, {r3-r6}
+//
+// The registers are reloaded from the last chunk of the destination, where
+// the last stmia left them. The last chunk of the source may have been
+// overwritten since it was read, when the destination is less than a
+// chunk below it.
+//
+// It falls into the translation of the loop as it stands where that
+// would not do the same: the count is not a non-zero multiple of the
+// chunk, the destination is less than a chunk past the source (the loop
+// reads each chunk before it writes any of it, rep movsb goes byte by
+// byte), or the registers stored by a fill do not all hold the same word.
+// The chunk is a power of two, so that the count always reaches zero.
+*/
+#define IDIOM_NONE              0
+#define IDIOM_COPY              1
+#define IDIOM_FILL              2
+
+#define LDMIA_WB_MASK           0x0FF00000
+#define LDMIA_WB                0x08B00000  /* ldmia rn!, {..} */
+#define STMIA_WB                0x08A00000  /* stmia rn!, {..} */
+#define SUBS_IMM                0x02500000  /* subs rd, rn, #imm */
+#define BNE_MASK                0xFF000000
+#define BNE                     0x1A000000
+
+struct loopIdiom_t{
+  uint8_t rS;           /* Source, for a copy */
+  uint8_t rD;           /* Destination */
+  uint8_t rC;           /* Count of bytes left */
+  uint16_t regList;     /* Registers each chunk goes through */
+  uint32_t size;        /* Bytes in a chunk */
+  const uint32_t *pExit;/* Instruction after the bne */
+};
+
+/*
+// Does the block at pArmInst loop as above? Returns the kind of loop, and
+// fills in pLoop if it does.
+*/
+static uint8_t matchLoopIdiom(const uint32_t *pArmInst,
+  struct loopIdiom_t *pLoop){
+  const uint32_t *pInst;
+  uint32_t armInst;
+  uint16_t loadList = 0, storeList = 0, regs;
+  int32_t rS = -1, rD = -1, rC = -1;
+  uint32_t step = 0;
+
+  for(pInst = pArmInst; pInst < pArmInst + 4; pInst++){
+    armInst = *pInst;
+    if((armInst & BNE_MASK) == BNE){
+      break;
+    }
+    if((armInst & LDMIA_WB_MASK) == LDMIA_WB && rS < 0 && rD < 0){
+      rS = RN(armInst);
+      loadList = armInst & 0x0000FFFF;
+    }else if((armInst & LDMIA_WB_MASK) == STMIA_WB && rD < 0){
+      rD = RN(armInst);
+      storeList = armInst & 0x0000FFFF;
+    }else if((armInst & LDMIA_WB_MASK) == SUBS_IMM && rC < 0 &&
+             RN(armInst) == RD(armInst)){
+      rC = RN(armInst);
+      step = ROTATED_IMM(armInst);
+    }else{
+      return IDIOM_NONE;
+    }
+    if((armInst & COND_MASK) != COND_AL){
+      return IDIOM_NONE;
+    }
+  }
+  if(pInst == pArmInst + 4 || rD < 0 || rC < 0 ||
+     branchTarget(pInst) != pArmInst ||
+     (rS >= 0 && loadList != storeList)){
+    return IDIOM_NONE;
+  }
+
+  /*
+  // The list leaves out the stack pointer, the PC and the other registers
+  // of the loop, which all differ.
+  */
+  regs = (1 << rD) | (1 << rC) | ((rS >= 0)?(1 << rS):0);
+  if(__builtin_popcount(regs) != ((rS >= 0)?3:2) ||
+     ((regs | storeList) & ((1 << 13) | (1 << 15))) != 0 ||
+     (regs & storeList) != 0 || storeList == 0){
+    return IDIOM_NONE;
+  }
+  pLoop->size = 4 * __builtin_popcount(storeList);
+  if(step != pLoop->size || (step & (step - 1)) != 0){
+    return IDIOM_NONE;
+  }
+
+  pLoop->rS = rS;
+  pLoop->rD = rD;
+  pLoop->rC = rC;
+  pLoop->regList = storeList;
+  pLoop->pExit = pInst + 1;
+  return (rS >= 0)?IDIOM_COPY:IDIOM_FILL;
+}
+
+/*
+// If the block at pArmInst is a copy or fill loop, emit the code that runs
+// it at once at pX86Addr, and falls through to the rest of the block where
+// it cannot. Returns the size of that code.
+*/
+static uint32_t emitLoopIdiom(uint8_t *pX86Addr, const uint32_t *pArmInst){
+  struct decodeInfo_t instInfo;
+  struct loopIdiom_t loop;
+  uint8_t *fallback[NUM_ARM_REGISTERS + 2];
+  uint16_t dirty = armHostDirty;
+  uint32_t count = 0;
+  uint32_t numFallback = 0;
+  uint8_t kind;
+  int32_t i;
+
+  kind = matchLoopIdiom(pArmInst, &loop);
+  if(kind == IDIOM_NONE){
+    return 0;
+  }
+  DP2("%s loop of %u byte chunks\n",(kind == IDIOM_COPY)?"Copy":"Fill",
+    loop.size);
+#ifdef PROFILE
+  if(kind == IDIOM_COPY){
+    idiomCopies++;
+  }else{
+    idiomFills++;
+  }
+#endif /* PROFILE */
+  instInfo.pX86Addr = pX86Addr;
+  instInfo.pArmAddr = (uint32_t *)pArmInst;
+
+  /*
+  // The count is a non-zero multiple of the chunk.
+  */
+  LOAD_ARM_REG(X86_ECX,loop.rC);
+  ADD_BYTE(X86_OP_TEST_RM32);
+  ADD_BYTE(0xC9); /* MOD R/M - test ecx, ecx */
+  ADD_BYTE(X86_PRE_JCC);
+  ADD_BYTE(X86_OP_JE);
+  fallback[numFallback++] = instInfo.pX86Addr + count;
+  ADD_WORD(0);
+  ADD_BYTE(X86_OP_TEST_IMM32_RM32);
+  ADD_BYTE(0xC1); /* MOD R/M - test ecx, imm32 */
+  ADD_WORD(loop.size - 1);
+  ADD_BYTE(X86_PRE_JCC);
+  ADD_BYTE(X86_OP_JNE);
+  fallback[numFallback++] = instInfo.pX86Addr + count;
+  ADD_WORD(0);
+
+  if(kind == IDIOM_COPY){
+    /*
+    // The destination is not 1 to size - 1 bytes past the source.
+    */
+    LOAD_ARM_REG(X86_EAX,loop.rD);
+    ARM_OPERAND(X86_OP_SUB_RM32_FROM_REG,X86_EAX,loop.rS);
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xE8); /* MOD R/M - sub eax, imm8 */
+    ADD_BYTE(1);
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xF8); /* MOD R/M - cmp eax, imm8 */
+    ADD_BYTE(loop.size - 1);
+    ADD_BYTE(X86_PRE_JCC);
+    ADD_BYTE(X86_OP_JC);
+    fallback[numFallback++] = instInfo.pX86Addr + count;
+    ADD_WORD(0);
+
+    LOAD_ARM_REG(X86_EAX,loop.rD);
+    LOAD_ARM_REG(X86_EDX,loop.rS);
+    ADD_BYTE(X86_OP_PUSH_REG + X86_ESI);
+    ADD_BYTE(X86_OP_PUSH_REG + X86_EDI);
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_LEA);
+    ADD_BYTE(0x3C); /* MOD R/M - lea rdi, [rsi + rax] */
+    ADD_BYTE(0x06);
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_LEA);
+    ADD_BYTE(0x34); /* MOD R/M - lea rsi, [rsi + rdx] */
+    ADD_BYTE(0x16);
+    ADD_BYTE(X86_PRE_REP);
+    ADD_BYTE(X86_OP_MOVSB);
+    ADD_BYTE(X86_OP_POP_REG + X86_EDI);
+    ADD_BYTE(X86_OP_POP_REG + X86_ESI);
+  }else{
+    /*
+    // The registers stored all hold the same word.
+    */
+    for(i = 0; i < NUM_ARM_REGISTERS; i++){
+      if((loop.regList & (1 << i)) == 0){
+        continue;
+      }
+      if(loop.regList & ((1 << i) - 1)){
+        ARM_OPERAND(X86_OP_CMP_REG_WITH_MEM32,X86_EAX,i);
+        ADD_BYTE(X86_PRE_JCC);
+        ADD_BYTE(X86_OP_JNE);
+        fallback[numFallback++] = instInfo.pX86Addr + count;
+        ADD_WORD(0);
+      }else{
+        LOAD_ARM_REG(X86_EAX,i);
+      }
+    }
+
+    LOAD_ARM_REG(X86_EDX,loop.rD);
+    ADD_BYTE(X86_OP_PUSH_REG + X86_EDI);
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_LEA);
+    ADD_BYTE(0x3C); /* MOD R/M - lea rdi, [rsi + rdx] */
+    ADD_BYTE(0x16);
+    ADD_BYTE(X86_OP_SHIFT_IMM8_RM32);
+    ADD_BYTE(0xE9); /* MOD R/M - shr ecx, imm8 */
+    ADD_BYTE(2);
+    ADD_BYTE(X86_PRE_REP);
+    ADD_BYTE(X86_OP_STOSD);
+    ADD_BYTE(X86_OP_POP_REG + X86_EDI);
+  }
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  /*
+  // Leave the registers as the last time round the loop would have.
+  */
+  LOAD_ARM_REG(X86_ECX,loop.rC);
+  ARM_OPERAND(X86_OP_ADD_REG_TO_RM32,X86_ECX,loop.rD);
+  armHostDirty |= (1 << loop.rD);
+  if(kind == IDIOM_COPY){
+    ARM_OPERAND(X86_OP_ADD_REG_TO_RM32,X86_ECX,loop.rS);
+    armHostDirty |= (1 << loop.rS);
+  }
+  ADD_BYTE(X86_OP_XOR_RM32_TO_REG);
+  ADD_BYTE(0xC0); /* MOD R/M - xor eax, eax */
+  STORE_ARM_REG(X86_EAX,loop.rC);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  if(kind == IDIOM_COPY){
+    LSMULT_INFO.Rn = loop.rD;
+    LSMULT_INFO.regList = loop.regList;
+    LSMULT_INFO.P = TRUE;
+    LSMULT_INFO.U = FALSE;
+    LSMULT_INFO.S = FALSE;
+    LSMULT_INFO.W = FALSE;
+    LSMULT_INFO.L = TRUE;
+    instInfo.pX86Addr = pX86Addr + count;
+    count += lsmHandler((void *)&instInfo);
+    instInfo.pX86Addr = pX86Addr;
+    ADD_BYTE(X86_OP_XOR_RM32_TO_REG);
+    ADD_BYTE(0xC0); /* MOD R/M - xor eax, eax */
+  }
+
+  /*
+  // The flags of the last subs, which takes size from size.
+  */
+  ADD_BYTE(X86_OP_MOV_IMM_TO_EDX);
+  ADD_WORD(loop.size);
+  RECORD_FLAGS_ARITH(FLAGS_SUB,FLAGS_ALL);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  instInfo.pX86Addr = pX86Addr + count;
+  count += exitHandler((void *)&instInfo, (uint32_t)(uintptr_t)loop.pExit);
+  instInfo.pX86Addr = pX86Addr;
+
+  for(i = 0; i < numFallback; i++){
+    *(uint32_t *)fallback[i] =
+      (uint32_t)(pX86Addr + count - (fallback[i] + 4));
+  }
+  armHostDirty = dirty;
+
+  return count;
+}
+#endif /* NOIDIOM */
+
+/*
+// Predicated runs
+//
+// Consecutive instructions with the same condition share one condition
+// check: the jcc that skips the first one skips the whole run. A run that
+// is followed by instructions with the opposite condition becomes an
+// if/else: the first run ends with a jmp over the second, and the jcc of
+// the first run lands on the second. A run ends at any instruction that
+// may change the flags, since those that follow have to see the new ones.
+*/
+static bool mayWriteFlags(uint32_t armInst){
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+    case INST_TYPE_IMM_UNDEF:
+      /* S bit, or an MSR */
+      return ((armInst & BIT20_MASK) ||
+              ((armInst & 0x01900000) == 0x01000000 &&
+               (armInst & 0x00200000)));
+    case INST_TYPE_LSIMM:
+    case INST_TYPE_LSR_UNDEF:
+    case INST_TYPE_LSMULT:
+      return FALSE;
+    default:
+      return TRUE;
   }
+}
 
-  DP1("Chaining BB to %p\n",nextX86BB);
-  *(uint8_t *)pUntakenCalloutSourceLoc = X86_OP_JMP;
-  *(uint32_t *)((uint8_t*)pUntakenCalloutSourceLoc + 1) = (uintptr_t)nextX86BB
-    - ((uintptr_t)((uint8_t *)pUntakenCalloutSourceLoc + 5));
-#endif /* NOCHAINING */
-
-  DISPLAY_REGS;
-  pArmPC = nextBB;
-  decodeBasicBlock();
+#ifndef NOCMOV
+/*
+// Branchless conditions
+//
+// A conditional data processing instruction that writes a register other
+// than the PC and leaves the flags alone is not branched over. Instead,
+// the condition is evaluated first into BL, set if it fails, the old value
+// of Rd is kept in ECX, and the instruction is translated as usual. Its
+// result, which the handlers leave in EAX, is then replaced by the old
+// value with a cmov if the condition failed:
+//
+//   <condition check>; setcc bl
+//   mov ecx, Rd
+//   <instruction>              ; eax = Rd = result
+//   test bl, bl
+//   cmovnz eax, ecx
+//   mov Rd, eax
+//
+// BL stays valid until the flags change, so a later instruction with the
+// same or the opposite condition only needs the cmov. The handlers used
+// here must not touch EBX or ECX, which rules out shifts by a register, as
+// x86 takes the amount in CL.
+*/
+static bool branchlessEligible(uint32_t armInst){
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+      if((armInst & 0x00000010) != 0){
+        return FALSE; /* Shift by register, multiply, extra load/store */
+      }
+      /* fall through */
+    case INST_TYPE_IMM_UNDEF:
+      if((armInst & 0x01900000) == 0x01000000 || (armInst & BIT20_MASK) ||
+         RD(armInst) == 15){
+        return FALSE;
+      }
+    break;
+    default:
+      return FALSE;
+  }
 
-  DP_BYE;
+  switch(armInst & OPCODE_MASK){
+    case OPCODE_AND:
+    case OPCODE_SUB:
+    case OPCODE_RSB:
+    case OPCODE_ADD:
+    case OPCODE_ORR:
+    case OPCODE_MOV:
+    case OPCODE_BIC:
+    case OPCODE_MVN:
+      return TRUE;
+    default:
+      return FALSE;
+  }
 }
+#endif /* NOCMOV */
 
 uint8_t handleConditional(void *pInst){ 
   struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
   uint8_t count = 0;
+  uint8_t jcc = X86_OP_JO;
 
   DP_HI;
 
-  ADD_BYTE(X86_OP_PUSH_MEM32);
-  ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-  ADD_WORD((uintptr_t)&x86Flags);
-  ADD_BYTE(X86_OP_POPF);
+  /*
+  // N and Z are checked against the recorded result directly. The other
+  // conditions need the flags established in EFLAGS first, with CF holding
+  // the ARM carry. Neither is needed if the instruction before left its
+  // flags in EFLAGS.
+  */
+  if(instInfo.hostFlags != HOST_FLAGS_NONE){
+    DP1("Condition tested on host flags (%d)\n",instInfo.hostFlags);
+  }else{
+    switch(instInfo.cond){
+      case COND_EQ:
+      case COND_NE:
+      case COND_MI:
+      case COND_PL:
+        ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+        CPU_OPERAND(7,CPU_FLAG_NZ); /* CMP - 0x83 /7 */
+        ADD_BYTE(0x00);
+      break;
+      default:
+        ADD_BYTE(X86_OP_CALL);
+        ADD_WORD((uintptr_t)((intptr_t)&materializeFlags -
+          (intptr_t)(instInfo.pX86Addr + count + 4)));
+      break;
+    }
+  }
   LOG_INSTR(instInfo.pX86Addr,count);
 
   DP1("cond = %d\n",instInfo.cond);
   switch(instInfo.cond){
     case COND_EQ:
       /* jne */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNE);
+      jcc = X86_OP_JNE;
     break;
     case COND_NE:
       /* je */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JE);
+      jcc = X86_OP_JE;
     break;
     case COND_CS:
-      /* jnc */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNC);
+      /* jnc, or jc on the borrow of a sub */
+      jcc = (instInfo.hostFlags == HOST_FLAGS_SUB)?X86_OP_JC:X86_OP_JNC;
     break;
     case COND_CC:
-      /* jc */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JC);
+      /* jc, or jnc on the borrow of a sub */
+      jcc = (instInfo.hostFlags == HOST_FLAGS_SUB)?X86_OP_JNC:X86_OP_JC;
     break;
     case COND_MI:
+      /* jns */
+      jcc = X86_OP_JNS;
+    break;
     case COND_PL:
+      /* js */
+      jcc = X86_OP_JS;
+    break;
     case COND_VS:
+      /* jno */
+      jcc = X86_OP_JNO;
+    break;
     case COND_VC:
-      DP_ASSERT(0,"Unimplemented flag check\n");
+      /* jo */
+      jcc = X86_OP_JO;
     break;
     case COND_HI:
-      /* cmc + jna */
-      ADD_BYTE(X86_OP_CMC);
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNA); 
+      /* cmc + jna; the borrow of a sub is already inverted */
+      if(instInfo.hostFlags != HOST_FLAGS_SUB){
+        ADD_BYTE(X86_OP_CMC);
+      }
+      jcc = X86_OP_JNA;
     break;
     case COND_LS:
-      /* cmc + jnbe */
-      ADD_BYTE(X86_OP_CMC);
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNBE); 
+      /* cmc + jnbe; the borrow of a sub is already inverted */
+      if(instInfo.hostFlags != HOST_FLAGS_SUB){
+        ADD_BYTE(X86_OP_CMC);
+      }
+      jcc = X86_OP_JNBE;
     break;
     case COND_GE:
       /* jl */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JL);
+      jcc = X86_OP_JL;
     break;
     case COND_LT:
       /* jnl or jge */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNL);
+      jcc = X86_OP_JNL;
     break;
     case COND_GT:
       /* jng or jle */
-      ADD_BYTE(X86_PRE_JCC);
-      ADD_BYTE(X86_OP_JNG);
+      jcc = X86_OP_JNG;
     break;
     case COND_LE:
       /* jg */
-      ADD_BYTE(X86_PRE_JCC)
-      ADD_BYTE(X86_OP_JG)
+      jcc = X86_OP_JG;
     break;
     case COND_UNDEF:
-      DP_ASSERT(0, "Unsupported condition code\n");
+      UNSUPPORTED;
     default:
       DP_ASSERT(0, "Invalid condition code\n");
     break;
   }
 
+  if(instInfo.branchless == TRUE){
+    /* setcc bl, set when the condition fails just like the jcc is taken */
+    ADD_BYTE(X86_PRE_JCC);
+    ADD_BYTE(jcc - X86_OP_JO + X86_OP_SETO);
+    ADD_BYTE(0xC3); /* MOD R/M - bl */
+  }else{
+    ADD_BYTE(X86_PRE_JCC);
+    ADD_BYTE(jcc);
+  }
+
   DP_BYE;
 
   return count;
@@ -220,29 +2540,328 @@ uint32_t sEq0Count = 0;
 
 translator x86Translator;
 
+/*
+// Giving up on a block
+//
+// A handler that comes to an instruction the translator cannot handle calls
+// unsupportedInst() through UNSUPPORTED, which jumps back to
+// decodeBasicBlock(). The block being translated, the last one started in
+// codeRegion, is dropped, and decodeBasicBlock() returns NULL with pArmPC
+// left where translation stopped. The caller runs the block another way:
+// in the interpreter at run time, or not at all ahead of time.
+*/
+static jmp_buf unsupportedJump;
+
+void unsupportedInst(const char *handler){
+  DP1("Unsupported ARM instruction in %s()\n", handler);
+  longjmp(unsupportedJump, 1);
+}
+
+/*
+// Does the data processing instruction armInst read the PC? Translated code
+// does not keep the PC in armCpu, so the handlers cannot read it. The IR
+// takes these instructions when they are unconditional.
+*/
+static bool readsPC(uint32_t armInst){
+  uint32_t opcode = armInst & OPCODE_MASK;
+
+  if(RN(armInst) == 15 && opcode != OPCODE_MOV && opcode != OPCODE_MVN){
+    return TRUE;
+  }
+  if(armInst & 0x02000000){
+    return FALSE;
+  }
+  return RM(armInst) == 15 || ((armInst & 0x00000010) != 0 &&
+    RS(armInst) == 15);
+}
+
+static void dropBlock(void){
+  struct codeBlock_t *block = codeRegion->blocks;
+
+  if(optimizing == FALSE){
+    EvictItem(ARM_HOST_ADDR(block->armAddr), block->x86Addr);
+  }
+  codeRegion->blocks = block->next;
+  codeBlocksNew--;
+  pX86PC = block->x86Addr - sizeof(struct codeBlock_t *);
+}
+
+/*
+// Tiered execution
+//
+// A block is not translated the first time it runs. Until it has been
+// entered HOT_THRESHOLD times, enterBlock() runs it in the interpreter
+// (see interp.c), and goes on with the blocks that follow it, up to the
+// first one that has a translation or turns hot. Code that only runs a
+// few times, such as startup code, is never translated, and a block the
+// translator gives up on is interpreted for good.
+//
+// Entries are counted in coldBlocks, a direct mapped table tagged with the
+// ARM address of the block. A block that loses its slot to another starts
+// counting again, which only delays its translation.
+//
+// The dispatcher only chains a jump, or fills in an indirect or return
+// site, when the block it enters is the one the exit asked for rather
+// than one the interpreter went on to.
+//
+// The entry of a routine run natively is translated right away (see
+// "Native routines").
+*/
+#ifndef NOINTERP
+#define HOT_THRESHOLD           16
+#ifndef NONATIVE
+#define NATIVE_ENTRY(armAddr)   (armX86NativeRoutine(armAddr,NULL) != NULL)
+#else /* NONATIVE */
+#define NATIVE_ENTRY(armAddr)   FALSE
+#endif /* NONATIVE */
+#define COLD_BLOCKS             4096
+#define COLD_NEVER              UINT32_MAX
+#define COLD_SLOT(armAddr)      ((((armAddr) >> 2) * 0x9E3779B1) >> 20)
+
+struct coldBlock_t{
+  uint32_t armAddr;
+  uint32_t count;           /* Entries so far, or COLD_NEVER */
+};
+
+static struct coldBlock_t coldBlocks[COLD_BLOCKS];
+#endif /* NOINTERP */
+
+/*
+// Return the translation of the block at armAddr, or of the first block
+// the interpreter gets to from there that has one, and leave the ARM
+// address of that block in armCpu.nextBB.
+*/
+static void *enterBlock(uint32_t armAddr){
+#ifdef NOINTERP
+  void *x86Block;
+
+  pArmPC = ARM_HOST_ADDR(armAddr);
+  armCpu.nextBB = armAddr;
+  x86Block = decodeBasicBlock();
+  panic(x86Block != NULL, ("Unsupported ARM instruction 0x%08x at 0x%x\n",
+    *pArmPC, (uint32_t)(uintptr_t)pArmPC));
+  return x86Block;
+#else /* NOINTERP */
+  struct coldBlock_t *cold;
+  bool interpreted = FALSE;
+  void *x86Block;
+#ifdef PROFILE
+  uint64_t startTime;
+#endif /* PROFILE */
+
+  while((x86Block = INDEXED_BLOCK(ARM_HOST_ADDR(armAddr))) == NULL){
+    cold = &coldBlocks[COLD_SLOT(armAddr)];
+    if(cold->armAddr != armAddr){
+      cold->armAddr = armAddr;
+      cold->count = 0;
+    }
+
+    if(cold->count != COLD_NEVER && (++cold->count >= HOT_THRESHOLD ||
+       NATIVE_ENTRY(armAddr))){
+      pArmPC = ARM_HOST_ADDR(armAddr);
+      if((x86Block = decodeBasicBlock()) != NULL){
+#ifdef PROFILE
+        hotBlocks++;
+#endif /* PROFILE */
+        break;
+      }
+      DP1("Block at 0x%x left to the interpreter\n", armAddr);
+      cold->count = COLD_NEVER;
+#ifdef PROFILE
+      rejectedBlocks++;
+#endif /* PROFILE */
+    }
+
+    if(interpreted == FALSE){
+      armX86ReadFlags();
+      interpreted = TRUE;
+    }
+#ifdef PROFILE
+    startTime = profileClock();
+#endif /* PROFILE */
+    armAddr = armX86Interpret(armAddr, BLOCK_MAX_INSTS);
+#ifdef PROFILE
+    tierNanos[TIER_INTERP] += profileClock() - startTime;
+    interpBlocks++;
+#endif /* PROFILE */
+    if(armAddr == 0){
+      endProgram();
+    }
+  }
+
+  if(interpreted == TRUE){
+    armX86WriteFlags();
+  }
+  armCpu.nextBB = armAddr;
+  return x86Block;
+#endif /* NOINTERP */
+}
+
+/*
+ * Set up the code cache, and map in the persistent one if there is one.
+ *
+ * Return: None
+ */
+static void
+initDecode(const struct map_t *memMap)
+{
+    pArmPC = memMap->pArmInstr;
+    pX86PC = memMap->pX86Instr;
+    x86Translator = (translator)memMap->pX86Instr;
+    initCodeCache(memMap->pX86Instr, memMap->x86CodeSize,
+        memMap->pX86Records);
+#ifndef NOINDEX
+    if (memMap->x86CachePath != NULL) {
+        cachePath = memMap->x86CachePath;
+        cacheOffset = memMap->x86CacheOffset;
+        cacheKey = hashBytes(memMap->armImageHash, __executable_start,
+            etext - __executable_start);
+        loadCodeCache();
+    }
+#endif /* NOINDEX */
+#ifndef NONATIVE
+    armX86NativeInit();
+#endif /* NONATIVE */
+}
+
 /*
  * Entry point for the instruction decoder and binary translator.
  * From this point, x86 code is generated and executed until the
- * end of the program is reached.
+ * end of the program is reached. The first block is translated
+ * here and entered through the dispatcher, which does not return.
  * 
  * Return: None
  */
 void
 armX86Decode(const struct map_t *memMap)
 {
-    pArmPC = memMap->pArmInstr;
-    pX86PC = memMap->pX86Instr;
-    x86Translator = (translator)memMap->pX86Instr;
+    uint32_t i;
+
+    initDecode(memMap);
 
     PC = (uintptr_t)memMap->pArmInstr;
     SP = (uintptr_t)memMap->pArmStackPtr;
     LR = 0;
 
-    decodeBasicBlock();
+    for (i = 0; i < RAS_SIZE; i++) {
+        returnStack[i] = &noReturnSite;
+    }
+    armCpu.returnStackTop = 0;
+
+    dispatchEnter(enterBlock(PC));
 }
 
-void
-decodeBasicBlock()
+/*
+// Ahead-of-time translation
+//
+// armX86Translate() translates what can be found of a program without
+// running it, and saves it as a persistent code cache for an executable
+// made ahead of time (see aot.c). It starts from the entry point and the
+// functions of the symbol table. From each block it translates, it goes on
+// to the targets of its b and bl instructions, to the return addresses of
+// its bl instructions, and to the next instruction if the block ends on a
+// condition or is cut. Indirect branches are left to run time, and so is
+// whatever follows an unconditional exit, which may be a literal pool.
+//
+// A block the translator gives up on is dropped (see decodeBasicBlock()),
+// and only fails at run time if the program ever gets there. Translation
+// stops before the code cache would have to flush a region.
+*/
+#ifndef NOINDEX
+/*
+ * Translate the program ahead of time from its entry point and from the
+ * numFunctions ARM addresses in functions, and save the translation in the
+ * persistent code cache named in memMap.
+ *
+ * Return: Number of blocks translated.
+ */
+uint32_t
+armX86Translate(const struct map_t *memMap, const uint32_t *functions,
+    uint32_t numFunctions)
+{
+    struct codeRegion_t *lastRegion = &codeRegions[X86_CODE_REGIONS - 1];
+    uint32_t *work, numWork, maxWork;
+    uint32_t *pArmInst, *pArmBlock;
+    uint32_t armAddr, armInst, offset;
+    uint32_t dropped = 0;
+
+    initDecode(memMap);
+
+    maxWork = numFunctions + 64;
+    work = malloc(maxWork * sizeof(uint32_t));
+    panic(work != NULL, ("No memory for the translation work list"));
+    memcpy(work, functions, numFunctions * sizeof(uint32_t));
+    numWork = numFunctions;
+    work[numWork++] = (uint32_t)(uintptr_t)memMap->pArmInstr;
+
+    while (numWork > 0) {
+        armAddr = work[--numWork];
+        pArmBlock = ARM_HOST_ADDR(armAddr);
+        if ((armAddr & 3) != 0 || !armX86ElfIsText(armAddr) ||
+            INDEXED_BLOCK(pArmBlock) != NULL) {
+            continue;
+        }
+
+        if (codeRegion == lastRegion &&
+            pX86PC + sizeof(struct codeBlock_t *) + X86_CODE_BLOCK_MAX >
+            codeRegion->end) {
+            info(("Code cache full, the rest is left to run time\n"));
+            break;
+        }
+
+        pArmPC = pArmBlock;
+        if (decodeBasicBlock() == NULL) {
+            info(("Block at 0x%x left to run time\n", armAddr));
+            dropped++;
+            continue;
+        }
+
+        /* At most two successors per instruction */
+        if (maxWork - numWork < 2 * (pArmPC - pArmBlock) + 1) {
+            maxWork = 2 * maxWork + 2 * (pArmPC - pArmBlock) + 1;
+            work = realloc(work, maxWork * sizeof(uint32_t));
+            panic(work != NULL, ("No memory for the translation work list"));
+        }
+
+        for (pArmInst = pArmBlock; pArmInst < pArmPC; pArmInst++) {
+            armInst = *pArmInst;
+            if ((armInst & INST_TYPE_MASK) != INST_TYPE_BRCH ||
+                ((armInst & COND_MASK) >> COND_SHIFT) > AL) {
+                continue;
+            }
+            offset = armInst & OFFSET_MASK;
+            offset |= ((offset & 0x00800000) > 0)?0xFF000000:0x00000000;
+            work[numWork++] = (uint32_t)(uintptr_t)pArmInst + 8 + (offset << 2);
+            if ((armInst & BIT24_MASK) != 0) {
+                work[numWork++] = (uint32_t)(uintptr_t)(pArmInst + 1);
+            }
+        }
+
+        if (((pArmPC[-1] & COND_MASK) >> COND_SHIFT) != AL ||
+            pArmPC - pArmBlock == BLOCK_MAX_INSTS) {
+            work[numWork++] = (uint32_t)(uintptr_t)pArmPC;
+        }
+    }
+
+    free(work);
+
+    debug(("Translated %u blocks ahead of time, dropped %u\n",
+        codeBlocksNew, dropped));
+    saveCodeCache();
+
+    return codeBlocksNew;
+}
+#endif /* NOINDEX */
+
+/*
+ * Translate the basic block at pArmPC unless it has been translated
+ * already. Translation is appended at pX86PC.
+ *
+ * Return: Address of the x86 translation of the block, or NULL if the
+ * translator gave up on it (see "Giving up on a block").
+ */
+void *
+decodeBasicBlock(void)
 {
     struct decodeInfo_t instInfo;
     uint32_t armInst;
@@ -250,12 +2869,36 @@ decodeBasicBlock()
     uint32_t x86InstCount;
     uint8_t *pCondJumpOffsetAddr = 0;
     uint8_t count = 0;
+    uint32_t flagIndex = 0;
+    uint32_t numInsts = 0;
+    uint8_t runCond = AL;
+    bool runElse = FALSE;
+#ifndef NOCMOV
+    uint8_t blCond = AL;
+#endif /* NOCMOV */
+#ifndef NOOPTIMIZE
+    struct codeBlock_t *block;
+#endif /* NOOPTIMIZE */
+#ifdef PROFILE
+    uint64_t startTime;
+#endif /* PROFILE */
+    uint32_t *pArmBlock = pArmPC;
+    void *native = NULL;
+    const uint32_t *pTraceNext;
+    uint8_t *pLoopStart;
+    uint8_t *sideExitJump[TRACE_MAX_BRANCHES];
+    uint32_t sideExitTarget[TRACE_MAX_BRANCHES];
+    uint32_t sideExits = 0, i;
+#ifndef NOINDEX
+  int indexed;
+#endif /* NOINDEX */
  
     debug_in;
 
     debug(("x86 PC = %p, Arm PC = %p\n",pX86PC, pArmPC));
 
-    x86Translator = (translator)INDEXED_BLOCK((void *)pArmPC);
+    x86Translator = (optimizing == TRUE)?NULL:
+      (translator)INDEXED_BLOCK((void *)pArmPC);
 
     if (x86Translator != NULL) {
         instInfo.endBB = TRUE;
@@ -263,33 +2906,219 @@ decodeBasicBlock()
         debug(("Translated block. Cached at %p\n", x86Translator));
     } else {
         debug(("Untranslated basic block at %p\n",pArmPC));
+#ifdef PROFILE
+        startTime = profileClock();
+#endif /* PROFILE */
 
 #ifndef NOINDEX
-        INDEX_BLOCK((void *)pArmPC, (void *)pX86PC);
+        if(optimizing == FALSE && !IndexHasRoom((void *)pArmPC)){
+          flushCodeCache();
+        }
+#endif /* NOINDEX */
+        pX86PC = startBlock(pX86PC, pArmPC);
+        if(setjmp(unsupportedJump) != 0){
+          dropBlock();
+          return NULL;
+        }
+#ifndef NOIR
+        irReset();
+#endif /* NOIR */
+
+        /*
+        // An optimized translation is only indexed once it is complete, in
+        // place of the one it replaces.
+        */
+#ifndef NOINDEX
+        if(optimizing == FALSE){
+          indexed = INDEX_BLOCK((void *)pArmPC, (void *)pX86PC);
+          panic(indexed != -1, ("No room in the index for the block at "
+            "0x%x\n", (uint32_t)(uintptr_t)pArmPC));
+          codeRetranslations += (indexed == 1);
+        }
 #endif /* NOINDEX */
 
         instInfo.endBB = FALSE;
         x86Translator = (translator)pX86PC;
+#ifndef NONATIVE
+        native = armX86NativeRoutine((uint32_t)(uintptr_t)pArmPC,NULL);
+#endif /* NONATIVE */
+#ifndef NOOPTIMIZE
+        block = BLOCK_OF(pX86PC);
+        if(optimizing == FALSE && native == NULL){
+          pX86PC += countEntries(block);
+        }
+#endif /* NOOPTIMIZE */
+        analyzeFlags(pArmPC);
+#ifndef NONATIVE
+        if(native != NULL){
+          instInfo.pArmAddr = pArmPC;
+          instInfo.pX86Addr = pX86PC;
+          pX86PC += nativeHandler((void *)&instInfo);
+          instInfo.pX86Addr = pX86PC;
+          pX86PC += indirectExitHandler((void *)&instInfo);
+        }
+#endif /* NONATIVE */
+        if(instInfo.endBB == FALSE){
+          pX86PC += allocateRegs(pX86PC);
+#ifndef NOIDIOM
+          pX86PC += emitLoopIdiom(pX86PC, pArmPC);
+#endif /* NOIDIOM */
+        }
+        pLoopStart = pX86PC;
+        flagIndex = 0;
+        blockCondGrouped = 0;
+        blockCondBranchless = 0;
 
     while(instInfo.endBB == FALSE){
+      /*
+      // Keep the block within X86_CODE_BLOCK_MAX. The flag analysis covers
+      // no more than the first BLOCK_MAX_INSTS instructions, and takes the
+      // flags to be live past them, so the block can be cut there and go
+      // on in a block of its own.
+      */
+      if(numInsts == BLOCK_MAX_INSTS){
+        DP1("Block cut at %p\n",(void *)pArmPC);
+#ifndef NOIR
+        pX86PC += irLower(pX86PC);
+#endif /* NOIR */
+        instInfo.pX86Addr = pX86PC;
+        pX86PC += exitHandler((void *)&instInfo, (uint32_t)(uintptr_t)pArmPC);
+        break;
+      }
+      numInsts++;
+
       DP2("Processing instruction: 0x%x @ %p\n",*pArmPC, (void *)pArmPC);
       DP1("x86PC = %p\n",pX86PC);
       count = 0;
       armInst = *pArmPC;
       instInfo.pArmAddr = pArmPC;
+      instInfo.indirect = FALSE;
+      instInfo.ret = FALSE;
+      instInfo.branchless = FALSE;
+
+      if(flagIndex <= FLAGS_LOOKAHEAD){
+        instInfo.flagsLive = blockFlagsLive[flagIndex];
+        instInfo.hostFlags = blockHostFlags[flagIndex];
+        instInfo.fuse = blockFuse[flagIndex];
+        flagIndex++;
+      }else{
+        instInfo.flagsLive = FLAGS_ALL;
+        instInfo.hostFlags = HOST_FLAGS_NONE;
+        instInfo.fuse = FALSE;
+      }
 
       /*
       // First check the condition field. Set a jump in the code if the
       //  instruction is to be executed conditionally.
       */
       instInfo.cond = ((armInst & COND_MASK) >> COND_SHIFT);
+
+      /*
+      // Instructions the IR covers are built into the region of them
+      // before this one. The region is lowered to x86 when one that it
+      // does not cover comes up (see "Intermediate representation" in
+      // ir.c).
+      */
+#ifndef NOIR
+      if(irAdd(armInst, pArmPC) == TRUE){
+        runCond = AL;
+        pArmPC++;
+        continue;
+      }
+      pX86PC += irLower(pX86PC);
+      irForget(((armInst & INST_TYPE_MASK) == INST_TYPE_COP_SWI)?0xFFFF:
+        armRegUses(armInst));
+#endif /* NOIR */
       instInfo.pX86Addr = pX86PC;
-      if(instInfo.cond != AL){
+
+      /*
+      // A branch the trace follows only leaves it, through a side exit,
+      // when it goes the other way than it did while recording. The jcc
+      // that skips a conditional instruction does just that for a taken
+      // branch; for an untaken one the condition is turned around.
+      */
+      pTraceNext = traceFollow(pArmPC);
+      if(pTraceNext != NULL){
+        DP1("Trace goes on at %p\n",(void *)pTraceNext);
+        if(instInfo.cond != AL){
+          sideExitTarget[sideExits] = (uint32_t)(uintptr_t)(pArmPC + 1);
+          if(pTraceNext != branchTarget(pArmPC)){
+            sideExitTarget[sideExits] =
+              (uint32_t)(uintptr_t)branchTarget(pArmPC);
+            instInfo.cond ^= 1;
+          }
+          pX86PC += handleConditional((void *)&instInfo);
+          sideExitJump[sideExits++] = pX86PC;
+          pX86PC += 4;
+        }
+        if(pTraceNext == pArmBlock){
+          count = 0;
+          instInfo.pX86Addr = pX86PC;
+          ADD_BYTE(X86_OP_JMP);
+          ADD_WORD((uint32_t)(pLoopStart - (pX86PC + count + 4)));
+          LOG_INSTR(instInfo.pX86Addr,count);
+          pX86PC += count;
+          instInfo.endBB = TRUE;
+        }
+        runCond = AL;
+#ifndef NOCMOV
+        blCond = AL;
+#endif /* NOCMOV */
+        pArmPC = (uint32_t *)pTraceNext;
+        continue;
+      }
+
+      if(instInfo.cond != AL && instInfo.cond == runCond){
+        /*
+        // Same condition as the instruction before, whose flags are still
+        // in force: extend the run it started.
+        */
+        DP1("Predicated run continues (cond = %d)\n",instInfo.cond);
+        blockCondGrouped++;
+      }else if(instInfo.cond != AL && runCond != AL && runElse == FALSE &&
+               instInfo.cond == (runCond ^ 1)){
+        /*
+        // The opposite condition: end the run with a jmp over this one,
+        // and have the jcc of the run land here.
+        */
+        DP1("Predicated run continues as else (cond = %d)\n",instInfo.cond);
+        ADD_BYTE(X86_OP_JMP);
+        ADD_WORD(0);
+        pX86PC += count;
+        *(uint32_t *)pCondJumpOffsetAddr =
+          (uint32_t)(pX86PC - (pCondJumpOffsetAddr + 4));
+        pCondJumpOffsetAddr = pX86PC - 4;
+        runCond = instInfo.cond;
+        runElse = TRUE;
+        blockCondGrouped++;
+#ifndef NOCMOV
+      }else if(instInfo.cond != AL && blockBranchless == TRUE &&
+               branchlessEligible(armInst) == TRUE){
+        instInfo.branchless = TRUE;
+        if(blCond != AL &&
+           (instInfo.cond == blCond || instInfo.cond == (blCond ^ 1))){
+          DP1("Branchless, condition still in bl (cond = %d)\n",
+            instInfo.cond);
+          blockCondGrouped++;
+        }else{
+          count = handleConditional((void *)&instInfo);
+          blCond = instInfo.cond;
+        }
+        LOAD_ARM_REG(X86_ECX,RD(armInst));
+        pX86PC += count;
+        runCond = AL;
+        blockCondBranchless++;
+#endif /* NOCMOV */
+      }else if(instInfo.cond != AL){
         x86InstCount = handleConditional((void *)&instInfo);
         pCondJumpOffsetAddr = instInfo.pX86Addr + x86InstCount;
         x86InstCount += 4; /* Reserve space for a 4-byte offset */
         *(uint32_t *)pCondJumpOffsetAddr = 0; /* Set the offset to 0 at first */
         pX86PC += x86InstCount; 
+        runCond = instInfo.cond;
+        runElse = FALSE;
+      }else{
+        runCond = AL;
       }
 
       /*
@@ -313,6 +3142,9 @@ decodeBasicBlock()
           */
           if(((armInst & 0x01900000) != 0x01000000) && 
             ((armInst & 0x00000090) != 0x00000090)){
+            if(readsPC(armInst)){
+              UNSUPPORTED;
+            }
             DPREG_INFO.Rn = RN(armInst);
             DPREG_INFO.Rm = RM(armInst);
             DPREG_INFO.Rd = RD(armInst);
@@ -336,51 +3168,39 @@ decodeBasicBlock()
               DPREG_INFO.shiftImm = TRUE;
             }else{
               DPREG_INFO.Rs = RS(armInst);
+              DPREG_INFO.shiftAmt = 0;
               DPREG_INFO.shiftImm = FALSE;
             }
             x86InstCount = 
               (opcodeHandler[((armInst & OPCODE_MASK) >> OPCODE_SHIFT)])
               ((void *)&instInfo);
             pX86PC += x86InstCount;
+          }else if((armInst & MRS_MASK) == MRS_CPSR){
+            DPREG_INFO.Rd = RD(armInst);
+            instInfo.pX86Addr = pX86PC;
+            x86InstCount = mrsHandler((void *)&instInfo);
+            pX86PC += x86InstCount;
+          }else if((armInst & MSR_REG_MASK) == MSR_REG_CPSR){
+            DPREG_INFO.Rn = RN(armInst);
+            DPREG_INFO.Rm = RM(armInst);
+            instInfo.pX86Addr = pX86PC;
+            instInfo.immediate = FALSE;
+            x86InstCount = msrHandler((void *)&instInfo);
+            pX86PC += x86InstCount;
           }else{
             UNSUPPORTED;
           }
           instInfo.pX86Addr = pX86PC;
-
-          /*
-          // The mov instruction may have set the PC to a new value. Handle this
-          // as the end of a basic block.
-          */
-          if(instInfo.endBB == TRUE){
-            if(instInfo.cond != AL){
-              count = 0;
-              ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-              ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-              ADD_WORD((uintptr_t)&nextBB);
-              ADD_WORD((uint32_t)((uintptr_t)pArmPC + 4));
-
-#ifndef NOCHAINING
-              ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-              ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-              ADD_WORD((uintptr_t)&pUntakenCalloutSourceLoc);
-              ADD_WORD((uintptr_t)(pX86PC + count + 4));
-#endif /* NOCHAINING */
-
-              ADD_BYTE(X86_OP_CALL);
-              ADD_WORD((uintptr_t)(
-                (intptr_t)&callEndBBNotTaken - (intptr_t)(pX86PC + count + 4)
-              ));
-              pX86PC += count;
-            }
-          }
-          instInfo.pX86Addr = pX86PC;
         break;
         case INST_TYPE_IMM_UNDEF:
           if((armInst & 0x01900000) != 0x01000000){
+            if(readsPC(armInst)){
+              UNSUPPORTED;
+            }
             DPIMM_INFO.Rn = RN(armInst);
             DPIMM_INFO.Rd = RD(armInst);
             DPIMM_INFO.rotate = ROTATE(armInst);
-            DPIMM_INFO.imm = (armInst & 0x000000FF);
+            DPIMM_INFO.imm = ROTATED_IMM(armInst);
             DPIMM_INFO.S = ((armInst & BIT20_MASK) >0?TRUE:FALSE);
 
 #ifdef DEBUG
@@ -397,6 +3217,14 @@ decodeBasicBlock()
               (opcodeHandler[((armInst & OPCODE_MASK) >> OPCODE_SHIFT)])
               ((void *)&instInfo);
             pX86PC += x86InstCount;
+          }else if((armInst & MSR_IMM_MASK) == MSR_IMM_CPSR){
+            DPIMM_INFO.Rn = RN(armInst);
+            DPIMM_INFO.rotate = ROTATE(armInst);
+            DPIMM_INFO.imm = ROTATED_IMM(armInst);
+            instInfo.pX86Addr = pX86PC;
+            instInfo.immediate = TRUE;
+            x86InstCount = msrHandler((void *)&instInfo);
+            pX86PC += x86InstCount;
           }else{
             UNSUPPORTED;
           }
@@ -447,36 +3275,6 @@ decodeBasicBlock()
           x86InstCount = lsmHandler((void *)&instInfo);
           pX86PC += x86InstCount;
           instInfo.pX86Addr = pX86PC;
-
-          /*
-          // The load instruction has set the PC to a new value. Handle this
-          // as the end of a basic block.
-          */
-          if(instInfo.endBB == TRUE){
-            count = 0;
-
-            ADD_BYTE(X86_OP_PUSH_MEM32);
-            ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-            ADD_WORD((uintptr_t)&regFile[15]);
-            ADD_BYTE(X86_OP_POP_MEM32);
-            ADD_BYTE(0x05); /* MOD R/M for POP - 0x8F /0 */
-            ADD_WORD((uintptr_t)&nextBB);
-
-#ifndef NOCHAINING
-            ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-            ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-            ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
-            ADD_WORD((uintptr_t)(pX86PC + count + 4));
-#endif /* NOCHAINING */
-
-            pX86PC += count;
-
-            ADD_BYTE(X86_OP_CALL);
-            ADD_WORD((uintptr_t)(
-              (intptr_t)&callEndBBTaken - (intptr_t)(pX86PC + 5)
-            ));
-            pX86PC += 5;
-          }
         break;
         case INST_TYPE_BRCH:
           BRCH_INFO.L = ((armInst & BIT24_MASK) > 0?TRUE:FALSE);
@@ -485,67 +3283,125 @@ decodeBasicBlock()
           x86InstCount = brchHandler((void *)&instInfo);
           pX86PC += x86InstCount;
           instInfo.pX86Addr = pX86PC;
-
-          /*
-          // There is a little trick here. A conditional branch may be thought
-          // of as a branch instruction that is executed when the condition is
-          // True. So a conditional branch is treated like all other conditional
-          // instructions. However, for all other instructions, it suffices to
-          // jump beyond the instruction. However, in the case of the branch
-          // jumping beyond the instruction should equate to a branch that is 
-          // untaken. So at the instruction 'beyond', place a call to the 
-          // handler for the NotTakenBranch. The offset for the conditional
-          //  jump points to this call instrution.
-          */
-          if(instInfo.cond != AL){
-            count = 0;
-            ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-            ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-            ADD_WORD((uintptr_t)&nextBB);
-            ADD_WORD((uint32_t)((uintptr_t)pArmPC + 4));
-
-#ifndef NOCHAINING
-            ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-            ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-            ADD_WORD((uintptr_t)&pUntakenCalloutSourceLoc);
-            ADD_WORD((uintptr_t)(pX86PC + count + 4));
-#endif /* NOCHAINING */
-
-            ADD_BYTE(X86_OP_CALL);
-            ADD_WORD((uintptr_t)(
-              (intptr_t)&callEndBBNotTaken - (intptr_t)(pX86PC + count + 4)
-            ));
-            pX86PC += count;
-          }
         break;
         case INST_TYPE_COPLS:
           UNSUPPORTED;
         break;
         case INST_TYPE_COP_SWI:
           x86InstCount = 0;
+          if(armInst & BIT24_MASK){
+            instInfo.pX86Addr = pX86PC;
+            x86InstCount = swiHandler((void *)&instInfo);
+          }
           pX86PC += x86InstCount;
           instInfo.pX86Addr = pX86PC;
-          DP("************* IGNORING Software Interrupt ****************\n");
         break;
         default:
           UNSUPPORTED;
         break;
       }
-      if(instInfo.cond != AL){
-        *(uint32_t *)pCondJumpOffsetAddr = x86InstCount;
+
+      /*
+      // A branch to an address held in a register or loaded from memory
+      // leaves the block through the indirect branch lookup. The lookup is
+      // part of the instruction, so a failed condition skips it as well.
+      */
+      if(instInfo.indirect == TRUE){
+        instInfo.pX86Addr = pX86PC;
+        count = indirectExitHandler((void *)&instInfo);
+        pX86PC += count;
+        x86InstCount += count;
+      }
+
+#ifndef NOCMOV
+      if(instInfo.branchless == TRUE){
+        count = 0;
+        instInfo.pX86Addr = pX86PC;
+        ADD_BYTE(X86_OP_TEST_REG8);
+        ADD_BYTE(0xDB); /* MOD R/M - test bl, bl */
+        ADD_BYTE(X86_PRE_JCC);
+        ADD_BYTE((instInfo.cond == blCond)?X86_OP_CMOVNE:X86_OP_CMOVE);
+        ADD_BYTE(0xC1); /* MOD R/M - ecx to eax */
+        STORE_ARM_REG(X86_EAX,RD(armInst));
+        pX86PC += count;
+      }
+#endif /* NOCMOV */
+
+      if(mayWriteFlags(armInst) == TRUE){
+        runCond = AL;
+#ifndef NOCMOV
+        blCond = AL;
+#endif /* NOCMOV */
+      }
+
+      if(instInfo.cond != AL && instInfo.branchless == FALSE){
+        /* The end of the run so far */
+        *(uint32_t *)pCondJumpOffsetAddr =
+          (uint32_t)(pX86PC - (pCondJumpOffsetAddr + 4));
+
+        /*
+        // There is a little trick here. A conditional branch may be thought
+        // of as a branch instruction that is executed when the condition is
+        // True. So a conditional branch is treated like all other conditional
+        // instructions. However, for all other instructions, it suffices to
+        // jump beyond the instruction. However, in the case of the branch
+        // jumping beyond the instruction should equate to a branch that is 
+        // untaken. So at the instruction 'beyond', place a jump to the 
+        // handler for the NotTakenBranch. The offset for the conditional
+        //  jump points to this jump instrution. The same holds for any
+        // other instruction that ends the block by writing the PC.
+        */
+        if(instInfo.endBB == TRUE){
+          instInfo.pX86Addr = pX86PC;
+          pX86PC += untakenExitHandler((void *)&instInfo);
+        }
       }
 
       pArmPC++;
     }
+
+    /* The side exits of a trace, out of the way of the path it follows */
+    for(i = 0; i < sideExits; i++){
+      *(uint32_t *)sideExitJump[i] =
+        (uint32_t)(pX86PC - (sideExitJump[i] + 4));
+      instInfo.pX86Addr = pX86PC;
+      pX86PC += exitHandler((void *)&instInfo, sideExitTarget[i]);
+    }
+
+#ifndef NOOPTIMIZE
+    if(optimizing == FALSE && native == NULL){
+      pX86PC += hotExitHandler(block, pX86PC);
+    }
+#endif /* NOOPTIMIZE */
+
+    DP_ASSERT(pX86PC <= codeRegion->end, "Block overran the code cache\n");
   
     DP1("x86PC = %p\n",pX86PC);
+    DP2("Flag records: %u of %u dropped\n",
+      blockRecordsDropped, blockRecords);
+    DP2("Condition reloads: %u of %u dropped\n",
+      blockReloadsDropped, blockReloads);
+    DP1("Predicated runs: %u instructions grouped\n", blockCondGrouped);
+    DP1("Branchless: %u instructions\n", blockCondBranchless);
+#ifdef PROFILE
+    condGrouped += blockCondGrouped;
+    condBranchless += blockCondBranchless;
+    flagBlocks++;
+    flagRecords += blockRecords;
+    flagRecordsDropped += blockRecordsDropped;
+    flagReloads += blockReloads;
+    flagReloadsDropped += blockReloadsDropped;
+    codeArmInsts += numInsts;
+    codeX86Bytes += pX86PC - (uint8_t *)x86Translator;
+    tierNanos[(optimizing == TRUE)?TIER_OPTIMIZED:TIER_BASE] +=
+      profileClock() - startTime;
+#ifndef NOTRACE
+    traceSideExits += sideExits;
+#endif /* NOTRACE */
+#endif /* PROFILE */
   }
   DISPLAY_REGS;
 
-  asm ("jmp *x86Translator");
-
-  DISPLAY_REGS;
-
 #ifdef DEBUG
   float sEq1Percent = ((100.0 * sEq1Count)/(sEq1Count + sEq0Count));
   float sEq0Percent = ((100.0 * sEq0Count)/(sEq1Count + sEq0Count));
@@ -555,6 +3411,7 @@ decodeBasicBlock()
 #endif /* DEBUG */
 
   DP_BYE;
+  return (void *)x86Translator;
 }
 
 /*
@@ -605,96 +3462,110 @@ decodeBasicBlock()
 // that do modify flags as special cases.
 //
 // Hence the following strategy is adopted:
-// There is a flags variable that is maintained as a global variable by the
-// binary translator and meant to be a snapshot of the x86 flags. When an
-// instruction has the 'S' bit set to 1, this variable is loaded into the x86
-// flags register using the following combination of instructions:
-//   push <flags> Pushes the global flags variable on to the stack
-//   popf         Loads the flags register from the top of the stack
-// This is like loading the last flag context, i.e. the context created by the
-// last instruction to modify the flags.
-// An instruction that checks the condition and executes can then proceed
-// by using native x86 condition checks. An instruction that modifies the
-// flags can update the x86 flags register itself.
-// Once the instruction has been completed, if the flags have been updated,
-// the snapshot of the flags must once again be saved. This is done by the
-// following combination of instructions:
-//   pushf        Pushes the flags register to the stack
-//   pop <flags>  Loads the flags variable from the top of the stack
-// This strategy ensures that even if there are instructions that do not
-// modify flags that are placed in between instructions that do and those
-// that check them (such a strategy may be adopted for optimization when the
-// compiler wants to keep the pipeline full), the logic remains valid.
+// An instruction that has the 'S' bit set does not compute the ARM flags.
+// It records what they are computed from: the result, the second operand
+// and whether it added or subtracted (flagNZ, flagSrc, flagRes, flagOp).
+// An instruction that checks a condition tests N and Z against the
+// recorded result, and has materializeFlags rebuild EFLAGS from the record
+// for the other conditions. Instructions that do not set flags leave the
+// record alone, so the logic remains valid even if there are instructions
+// in between those that set the flags and those that check them (such a
+// strategy may be adopted for optimization when the compiler wants to keep
+// the pipeline full).
+//
+// Within a block, analyzeFlags() drops the parts of the record that are
+// overwritten before anything reads them, and lets a condition that
+// directly follows the instruction setting its flags test EFLAGS as they
+// were left.
 */
 /*
 // FIXME: Don't bother making a copy of the entire data structure. Use
 // pInst directly.
 */
 
+/*
+// Load and store multiple
+//
+// The registers in the list go to consecutive words, the lowest numbered
+// at the lowest address, which starts at Rn (IA), Rn + 4 (IB),
+// Rn - 4n + 4 (DA) or Rn - 4n (DB) for n registers. A register with a host
+// home moves straight between it and guest memory, and the others through
+// EAX. The PC is not kept up to date, so a PC in a store list is stored as
+// the address of the instruction plus 8, which is what it reads as:
+//
+//   push {r4-r6, lr}       mov edx, r14d
+//                          mov [rsi + rdx - 16], r12d
+//                          mov eax, [rbp + r5]
+//                          mov [rsi + rdx - 12], eax
+//                          ...
+//                          mov [rsi + rdx - 4], r15d
+//                          lea r14d, [rdx - 16]
+//
+// Runs of registers in armCpu.regFile could move 16 bytes at a time with
+// SSE, as regFile is in the same order as the words. That turns out slower
+// on call heavy code: the registers were mostly just written one word at a
+// time, and a wide load of narrow stores that are still in flight is not
+// forwarded from the store buffer.
+*/
 int lsmHandler(void *pInst){
   struct decodeInfo_t instInfo
     = *(struct decodeInfo_t *)pInst;
   uint8_t count = 0;
-  int8_t i, istart, iend, idelta;
-  uint32_t disp = 0;
+  uint8_t i, reg;
+  int32_t n = 0, disp;
 
   DP("Load-Store Multiple\n");
 
-  istart = ((LSMULT_INFO.U == 1)?0:(NUM_ARM_REGISTERS - 1));
-  iend = ((LSMULT_INFO.U == 1)?NUM_ARM_REGISTERS:-1);
-  idelta = ((LSMULT_INFO.U == 1)?1:-1);
+  for(i = 0; i < NUM_ARM_REGISTERS; i++){
+    n += ((LSMULT_INFO.regList >> i) & 1);
+  }
+  if(LSMULT_INFO.U == 1){
+    disp = (LSMULT_INFO.P == 1)?4:0;
+  }else{
+    disp = (LSMULT_INFO.P == 1)?-4 * n:-4 * n + 4;
+  }
 
-  ADD_BYTE(X86_OP_MOV_TO_REG);
-  ADD_BYTE(0x15) /* MODR/M - Mov from disp32 to edx */
-  ADD_WORD((uintptr_t)&regFile[LSMULT_INFO.Rn]);
+  LOAD_ARM_REG(X86_EDX,LSMULT_INFO.Rn);
 
-  for(i=istart; i != iend; i += idelta){
-    if((LSMULT_INFO.regList & (0x00000001 << i)) == 0){
+  for(i = 0; i < NUM_ARM_REGISTERS; i++){
+    if((LSMULT_INFO.regList & (1 << i)) == 0){
       continue;
     }
+    reg = armHostReg[i];
+
     if(LSMULT_INFO.L == 0){ /* Store */
-      /*
-      // If P = 1, the base register needs to be excluded. So increment early.
-      */
-      if(LSMULT_INFO.P != 0){
-        disp+=4;
+      if(reg != X86_NOREG){
+        ADD_REX(0,reg,0);
+        ADD_BYTE(X86_OP_MOV_FROM_REG);
+        GUEST_OPERAND(reg & 7); /* Mov from reg to [edx + disp32] */
+      }else{
+        if(i == 15){
+          ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
+          ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+        }else{
+          LOAD_ARM_REG(X86_EAX,i);
+        }
+
+        ADD_BYTE(X86_OP_MOV_FROM_REG);
+        GUEST_OPERAND(X86_EAX); /* Mov from eax to [edx + disp32] */
       }
-      ADD_BYTE(X86_OP_MOV_TO_EAX);
-      ADD_WORD((uintptr_t)&regFile[i]);
-
-      ADD_BYTE(X86_OP_MOV_FROM_REG);
-      ADD_BYTE(0x82) /* MODR/M - Mov from eax to  edx + disp32 */
-      ADD_WORD((int32_t)disp * (LSMULT_INFO.U == 0?-1:1));
+      ADD_WORD(disp);
       LOG_INSTR(instInfo.pX86Addr,count);
-
-      /*
-      // If P = 0, the base register needs to be included. So increment late.
-      */
-      if(LSMULT_INFO.P == 0){
-        disp+=4;
-      }
     }else{ /* Load */
-      /*
-      // If P = 1, the base register needs to be excluded. So increment early.
-      */
-      if(LSMULT_INFO.P != 0){
-        disp+=4;
-      }
-
-      ADD_BYTE(X86_OP_MOV_TO_REG);
-      ADD_BYTE(0x82) /* MODR/M - Mov from edx + disp32 to eax */
-      ADD_WORD((int32_t)disp * (LSMULT_INFO.U == 0?-1:1));
+      if(reg != X86_NOREG){
+        ADD_REX(0,reg,0);
+        ADD_BYTE(X86_OP_MOV_TO_REG);
+        GUEST_OPERAND(reg & 7); /* Mov from [edx + disp32] to reg */
+        ADD_WORD(disp);
+        armHostDirty |= (1 << i);
+      }else{
+        ADD_BYTE(X86_OP_MOV_TO_REG);
+        GUEST_OPERAND(X86_EAX); /* Mov from [edx + disp32] to eax */
+        ADD_WORD(disp);
 
-      ADD_BYTE(X86_OP_MOV_FROM_EAX);
-      ADD_WORD((uintptr_t)&regFile[i]);
-      LOG_INSTR(instInfo.pX86Addr,count);
-      
-      /*
-      // If P = 0, the base register needs to be included. So increment late.
-      */
-      if(LSMULT_INFO.P == 0){
-        disp+=4;
+        STORE_ARM_REG(X86_EAX,i);
       }
+      LOG_INSTR(instInfo.pX86Addr,count);
 
       /*
       // Finally, if the register is the PC, signal that this is the end of
@@ -702,56 +3573,52 @@ int lsmHandler(void *pInst){
       */
       if(i == 15){
         ((struct decodeInfo_t *)pInst)->endBB = TRUE;
+        ((struct decodeInfo_t *)pInst)->indirect = TRUE;
+        ((struct decodeInfo_t *)pInst)->ret = TRUE;
       }
     }
+    disp += 4;
   }
 
   /*
-  // If the base register needs to be updated with the offset, do that now.
-  */
-  if(LSMULT_INFO.W == 1){
-    ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-    ADD_WORD((int32_t)disp *(LSMULT_INFO.U == 0?-1:1))
-
-    ADD_BYTE(X86_OP_ADD_REG_TO_REG);
-    ADD_BYTE(0xC2); /* EDX and EAX, EAX is the destination */
-
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[LSMULT_INFO.Rn]);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
-
-  if(((struct decodeInfo_t *)pInst)->endBB == TRUE){
-    ADD_BYTE(X86_OP_PUSH_MEM32);
-    ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-    ADD_WORD((uintptr_t)&PC);
-    ADD_BYTE(X86_OP_POP_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for POP - 0x8F /0 */
-    ADD_WORD((uintptr_t)&nextBB);
-
-#ifndef NOCHAINING
-    /*
-    // Load from register cannot be chained.
-    */
-    ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-    ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-    ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
-    ADD_WORD(0x00000000);
-#endif /* NOCHAINING */
-
-    ADD_BYTE(X86_OP_CALL);
-    ADD_WORD((uintptr_t)(
-      (intptr_t)&callEndBBTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
-    ));
+  // If the base register needs to be updated with the offset, do that now.
+  */
+  if(LSMULT_INFO.W == 1){
+    reg = armHostReg[LSMULT_INFO.Rn];
+    count += emitLea(instInfo.pX86Addr + count,
+      (reg != X86_NOREG)?reg:X86_EAX, X86_EDX, X86_NOREG, 0,
+      (LSMULT_INFO.U == 1)?4 * n:-4 * n);
+    if(reg != X86_NOREG){
+      armHostDirty |= (1 << LSMULT_INFO.Rn);
+    }else{
+      STORE_ARM_REG(X86_EAX,LSMULT_INFO.Rn);
+    }
     LOG_INSTR(instInfo.pX86Addr,count);
   }
 
   return count;
 }
 
+/*
+// Read size bytes of guest memory at armAddr into *pValue, if they are in a
+// segment that cannot be written and so hold the same value whenever the
+// translation runs. Returns FALSE, having read nothing, if they are not.
+*/
+bool readOnlyLoad(uint32_t armAddr, uint32_t size, uint32_t *pValue){
+  if(armX86ElfIsReadOnly(armAddr, size) == 0){
+    return FALSE;
+  }
+  *pValue = (size == 1)?*(uint8_t *)ARM_HOST_ADDR(armAddr):
+    *(uint32_t *)ARM_HOST_ADDR(armAddr);
+  return TRUE;
+}
+
 int lsimmHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
   uint8_t count = 0;
+  int32_t offset = (int32_t)LSIMM_INFO.imm * (LSIMM_INFO.U == 0?-1:1);
+  uint32_t literal;
+  bool folded = FALSE;
 
   DP("\tLoad-Store Immediate\n");
 
@@ -759,52 +3626,53 @@ int lsimmHandler(void *pInst){
     DP2("Load: Rd = %d, Rn = %d\n",LSIMM_INFO.Rd, LSIMM_INFO.Rn);
 
     /*
-    // If Rn is the PC, the addressing is PC relative. The PC should be
-    // updated to where the ARM PC is at the moment. If the code were 
-    // running on ARM hardware, R15 would be updated by hardware with 
-    // each instruction. We need to update it manually here.
-    // Instead of doing the update every instruction, update only when PC is
-    // used.
+    // If Rn is the PC, the addressing is PC relative, off the address of
+    // the instruction plus 8. The PC is not kept up to date, but that
+    // address is known here. A literal that is loaded from a segment that
+    // cannot be written is known as well, and is moved into Rd as it is.
     */
-    if(LSIMM_INFO.Rn == 15){
-      DP1("PC Relative Instruction. Updating PC to 0x%x\n",
-        (uint32_t)((uint8_t *)pArmPC + 8)
-      );
-
-      ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-      ADD_WORD((uint32_t)((uint8_t *)pArmPC + 8));
-
-      ADD_BYTE(X86_OP_MOV_FROM_EAX);
-      ADD_WORD((uintptr_t)&regFile[15]);
-      LOG_INSTR(instInfo.pX86Addr,count);
+    if(LSIMM_INFO.Rn == 15 && LSIMM_INFO.P == 1 && LSIMM_INFO.W == 0){
+      folded = readOnlyLoad((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8) +
+        offset, (LSIMM_INFO.B == 1)?1:4, &literal);
     }
 
-    ADD_BYTE(X86_OP_MOV_TO_REG);
-    ADD_BYTE(0x15) /* MODR/M - Mov from disp32 to edx */
-    ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rn]);
-
-    if(LSIMM_INFO.B != 1){
-      ADD_BYTE(X86_OP_MOV_TO_REG);
-      ADD_BYTE(0x82) /* MODR/M - Mov from edx + disp32 to eax */
-    }else{
+    if(folded == TRUE){
+      DP1("Literal 0x%x\n", literal);
       ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-      ADD_WORD(0x00000000);
-      ADD_BYTE(X86_OP_MOV_RM8_TO_REG);
-      ADD_BYTE(0x82) /* MODR/M - Mov from edx + disp32 to al */
-    }
-
-    if(LSIMM_INFO.P == 0){
-      /*
-      // Indexing is post addressed - the base address is used to address
-      // memory and updated by applying the offset later.
-      */
-      ADD_WORD(0x00000000);
+      ADD_WORD(literal);
     }else{
-      ADD_WORD((int32_t)LSIMM_INFO.imm * (LSIMM_INFO.U == 0?-1:1));
+      if(LSIMM_INFO.Rn == 15){
+        DP1("PC Relative Instruction. PC is 0x%x\n",
+          (uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8)
+        );
+        ADD_BYTE(X86_OP_MOV_IMM_TO_EDX);
+        ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+      }else{
+        LOAD_ARM_REG(X86_EDX,LSIMM_INFO.Rn);
+      }
+
+      if(LSIMM_INFO.B != 1){
+        ADD_BYTE(X86_OP_MOV_TO_REG);
+        GUEST_OPERAND(X86_EAX); /* Mov from [edx + disp32] to eax */
+      }else{
+        ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
+        ADD_WORD(0x00000000);
+        ADD_BYTE(X86_OP_MOV_RM8_TO_REG);
+        GUEST_OPERAND(X86_EAX); /* Mov from [edx + disp32] to al */
+      }
+
+      if(LSIMM_INFO.P == 0){
+        /*
+        // Indexing is post addressed - the base address is used to address
+        // memory and updated by applying the offset later.
+        */
+        ADD_WORD(0x00000000);
+      }else{
+        ADD_WORD((int32_t)LSIMM_INFO.imm * (LSIMM_INFO.U == 0?-1:1));
+      }
     }
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,LSIMM_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
 
     /*
@@ -817,8 +3685,7 @@ int lsimmHandler(void *pInst){
       ADD_BYTE(X86_OP_ADD_REG_TO_REG);
       ADD_BYTE(0xC2); /* EDX and EAX, EAX is the destination */
 
-      ADD_BYTE(X86_OP_MOV_FROM_EAX);
-      ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rn]);
+      STORE_ARM_REG(X86_EAX,LSIMM_INFO.Rn);
       LOG_INSTR(instInfo.pX86Addr,count);
     }
 
@@ -827,46 +3694,36 @@ int lsimmHandler(void *pInst){
     */
     if(LSIMM_INFO.Rd == 15){
       ((struct decodeInfo_t *)pInst)->endBB = TRUE;
-
-      /*
-      // FIXME: This can be optimized.
-      */
-      ADD_BYTE(X86_OP_PUSH_MEM32);
-      ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-      ADD_WORD((uintptr_t)&PC);
-      ADD_BYTE(X86_OP_POP_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for POP - 0x8F /0 */
-      ADD_WORD((uintptr_t)&nextBB);
-
-#ifndef NOCHAINING
-      ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-      ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
-      ADD_WORD((uintptr_t)(instInfo.pX86Addr + count + 4));
-#endif /* NOCHAINING */
-
-      ADD_BYTE(X86_OP_CALL);
-      ADD_WORD((uintptr_t)(
-        (intptr_t)&callEndBBTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
-      ));
-      LOG_INSTR(instInfo.pX86Addr,count);
+      ((struct decodeInfo_t *)pInst)->indirect = TRUE;
+      ((struct decodeInfo_t *)pInst)->ret = (LSIMM_INFO.Rn == 13);
     }
   }else{
     DP2("Store: Rd = %d, Rn = %d\n",LSIMM_INFO.Rd, LSIMM_INFO.Rn);
 
-    ADD_BYTE(X86_OP_MOV_TO_REG);
-    ADD_BYTE(0x15) /* MODR/M - Mov from disp32 to edx */
-    ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rn]);
+    /*
+    // The PC, as the base or as the value stored, reads as the address of
+    // the instruction plus 8.
+    */
+    if(LSIMM_INFO.Rn == 15){
+      ADD_BYTE(X86_OP_MOV_IMM_TO_EDX);
+      ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+    }else{
+      LOAD_ARM_REG(X86_EDX,LSIMM_INFO.Rn);
+    }
 
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rd]);
+    if(LSIMM_INFO.Rd == 15){
+      ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
+      ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+    }else{
+      LOAD_ARM_REG(X86_EAX,LSIMM_INFO.Rd);
+    }
 
     if(LSIMM_INFO.B != 1){
       ADD_BYTE(X86_OP_MOV_FROM_REG);
-      ADD_BYTE(0x82) /* MODR/M - Mov from eax to  edx + disp32 */
+      GUEST_OPERAND(X86_EAX); /* Mov from eax to [edx + disp32] */
     }else{
       ADD_BYTE(X86_OP_MOV_REG_TO_RM8);
-      ADD_BYTE(0x82) /* MODR/M - Mov from al to  edx + disp32 */
+      GUEST_OPERAND(X86_EAX); /* Mov from al to [edx + disp32] */
     }
     if(LSIMM_INFO.P == 0){
       /*
@@ -888,8 +3745,7 @@ int lsimmHandler(void *pInst){
       ADD_BYTE(X86_OP_ADD_REG_TO_REG);
       ADD_BYTE(0xC2); /* EDX and EAX, EAX is the destination */
 
-      ADD_BYTE(X86_OP_MOV_FROM_EAX);
-      ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rn]);
+      STORE_ARM_REG(X86_EAX,LSIMM_INFO.Rn);
       LOG_INSTR(instInfo.pX86Addr,count);
     }
     LOG_INSTR(instInfo.pX86Addr,count);
@@ -898,62 +3754,99 @@ int lsimmHandler(void *pInst){
   return count;
 }
 
+/*
+// The offset is Rm, shifted by an immediate. An offset that is added and
+// shifted left by at most 3 goes into the index of a lea, with the base and
+// Rm straight from their host registers, so that
+//
+//   ldr r0, [r1, r2, lsl #2]
+//
+// becomes lea edx, [r9 + r10*4] and a load from [rsi + rdx]. Any other
+// offset is shifted in EAX first. The address is computed into EDX when it
+// is used for the access; for post-indexing, the updated base goes to ECX
+// and the access uses the old base.
+*/
 int lsregHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
   uint8_t count = 0;
+  uint8_t base = armHostReg[LSREG_INFO.Rn];
+  uint8_t index = armHostReg[LSREG_INFO.Rm];
+  uint8_t scale = 0;
+  uint8_t address = (LSREG_INFO.P == 1)?X86_EDX:X86_ECX;
+
+  DP3("Load-Store Register: Rd = %d, Rn = %d, Rm = %d\n",
+    LSREG_INFO.Rd,
+    LSREG_INFO.Rn,
+    LSREG_INFO.Rm
+  );
 
-  DP_ASSERT(LSREG_INFO.B != 1, "Byte transfer not supported\n");
-  DP_ASSERT(LSREG_INFO.P != 0, "Post-Indexed addressing not supported\n");
-  DP_ASSERT(LSREG_INFO.W != 1, "Pre-Indexed addressing not supported\n");
-
-  if(LSREG_INFO.L == 1){
-    DP3("Load: Rd = %d, Rn = %d, Rm = %d\n",
-      LSREG_INFO.Rd,
-      LSREG_INFO.Rn,
-      LSREG_INFO.Rm
-    );
-
-    /*
-    // If Rn is the PC, the addressing is PC relative. The PC should be
-    // updated to where the ARM PC is at the moment. If the code were 
-    // running on ARM hardware, R15 would be updated by hardware with 
-    // each instruction. We need to update it manually here.
-    // Instead of doing the update every instruction, update only when PC is
-    // used.
-    */
-    if(LSREG_INFO.Rn == 15){
-      DP1("PC Relative Instruction. Updating PC to 0x%x\n",
-        (uint32_t)((uint8_t *)pArmPC + 8)
-      );
+  /*
+  // The PC is not kept up to date, but the address of the instruction plus
+  // 8, which is what it reads as, is known here.
+  */
+  if(LSREG_INFO.Rn == 15){
+    ADD_BYTE(X86_OP_MOV_IMM_TO_EDX);
+    ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+    base = X86_EDX;
+  }else if(base == X86_NOREG){
+    LOAD_ARM_REG(X86_EDX,LSREG_INFO.Rn);
+    base = X86_EDX;
+  }
 
+  if(LSREG_INFO.U == 1 && LSREG_INFO.shiftType == LSL &&
+     LSREG_INFO.shiftAmt <= 3 && index != X86_NOREG){
+    scale = LSREG_INFO.shiftAmt;
+  }else{
+    if(LSREG_INFO.Rm == 15){
       ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
-      ADD_WORD((uint32_t)((uint8_t *)pArmPC + 8));
+      ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+    }else{
+      LOAD_ARM_REG(X86_EAX,LSREG_INFO.Rm);
+    }
+    if(LSREG_INFO.U == 1 && LSREG_INFO.shiftType == LSL &&
+       LSREG_INFO.shiftAmt <= 3){
+      scale = LSREG_INFO.shiftAmt;
+    }else{
+      count += emitShift(instInfo.pX86Addr + count, X86_EAX,
+        LSREG_INFO.shiftType, LSREG_INFO.shiftAmt);
+    }
+    index = X86_EAX;
+  }
 
-      ADD_BYTE(X86_OP_MOV_FROM_EAX);
-      ADD_WORD((uintptr_t)&regFile[15]);
-      LOG_INSTR(instInfo.pX86Addr,count);
+  if(LSREG_INFO.U == 1){
+    count += emitLea(instInfo.pX86Addr + count, address, base, index, scale,
+      0);
+  }else{
+    if(base != address){
+      ADD_REX(0,base,address);
+      ADD_BYTE(X86_OP_MOV_FROM_REG);
+      ADD_BYTE(0xC0 | ((base & 7) << 3) | address); /* mov address, base */
     }
+    ADD_BYTE(X86_OP_SUB_RM32_FROM_REG);
+    ADD_BYTE(0xC0 | (address << 3) | X86_EAX); /* sub address, eax */
+  }
 
-    ADD_BYTE(X86_OP_MOV_TO_REG);
-    ADD_BYTE(0x15) /* MODR/M - Mov from disp32 to edx */
-    ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rn]);
+  /*
+  // Post-indexed: the access is at the base, which is only then updated.
+  */
+  if(LSREG_INFO.P == 0 && base != X86_EDX){
+    ADD_REX(0,base,0);
+    ADD_BYTE(X86_OP_MOV_FROM_REG);
+    ADD_BYTE(0xC2 | ((base & 7) << 3)); /* mov edx, base */
+  }
 
-    if(LSREG_INFO.U == 1){
-      ADD_BYTE(X86_OP_ADD_MEM32_TO_REG);
-      ADD_BYTE(0x15); /* MODR/M */
-      ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rm]);
+  if(LSREG_INFO.L == 1){
+    if(LSREG_INFO.B != 1){
+      ADD_BYTE(X86_OP_MOV_TO_REG);
+      GUEST_OPERAND(X86_EAX); /* Mov from [edx + disp32] to eax */
     }else{
-      ADD_BYTE(X86_OP_SUB_MEM32_FROM_REG);
-      ADD_BYTE(0x15); /* MODR/M */
-      ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rm]);
+      ADD_BYTE(X86_PRE_JCC);
+      ADD_BYTE(X86_OP_MOVZX_RM8);
+      GUEST_OPERAND(X86_EAX); /* Movzx from [edx + disp32] to eax */
     }
-
-    ADD_BYTE(X86_OP_MOV_TO_REG);
-    ADD_BYTE(0x82) /* MODR/M - Mov from edx + disp32 to eax */
     ADD_WORD(0x00000000);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rd]);
+    STORE_ARM_REG(X86_EAX,LSREG_INFO.Rd);
     LOG_INSTR(instInfo.pX86Addr,count);
 
     /*
@@ -961,72 +3854,137 @@ int lsregHandler(void *pInst){
     */
     if(LSREG_INFO.Rd == 15){
       ((struct decodeInfo_t *)pInst)->endBB = TRUE;
-
-      /*
-      // FIXME: This can be optimized.
-      */
-      ADD_BYTE(X86_OP_PUSH_MEM32);
-      ADD_BYTE(0x35); /* MOD R/M for PUSH - 0xFF /6 */
-      ADD_WORD((uintptr_t)&PC);
-      ADD_BYTE(X86_OP_POP_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for POP - 0x8F /0 */
-      ADD_WORD((uintptr_t)&nextBB);
-
-#ifndef NOCHAINING
-      ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-      ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-      ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
-      ADD_WORD((uintptr_t)(instInfo.pX86Addr + count + 4));
-#endif /* NOCHAINING */
-
-      ADD_BYTE(X86_OP_CALL);
-      ADD_WORD((uintptr_t)(
-        (intptr_t)&callEndBBTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
-      ));
-      LOG_INSTR(instInfo.pX86Addr,count);
-    }
-    if(LSREG_INFO.shiftAmt != 0){ 
-      UNSUPPORTED;
+      ((struct decodeInfo_t *)pInst)->indirect = TRUE;
     }
   }else{
-    DP2("Store: Rd = %d, Rn = %d\n",LSIMM_INFO.Rd, LSIMM_INFO.Rn);
-
-    ADD_BYTE(X86_OP_MOV_TO_REG);
-    ADD_BYTE(0x15) /* MODR/M - Mov from disp32 to edx */
-    ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rm]);
-
-    if(LSREG_INFO.shiftAmt != 0){
-      if(LSREG_INFO.shiftType == LSL){
-        ADD_BYTE(X86_OP_SHL);
-        ADD_BYTE(0xE2); /* MOD R/M edx /4 */
-        ADD_BYTE(LSREG_INFO.shiftAmt);
-      }else{
-        UNSUPPORTED;
-      }
+    if(LSREG_INFO.Rd == 15){
+      ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
+      ADD_WORD((uint32_t)(uintptr_t)((uint8_t *)pArmPC + 8));
+    }else{
+      LOAD_ARM_REG(X86_EAX,LSREG_INFO.Rd);
     }
 
-    if(LSREG_INFO.U == 1){
-      ADD_BYTE(X86_OP_ADD_MEM32_TO_REG);
-      ADD_BYTE(0x15); /* MODR/M */
-      ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rn]);
+    if(LSREG_INFO.B != 1){
+      ADD_BYTE(X86_OP_MOV_FROM_REG);
+      GUEST_OPERAND(X86_EAX); /* Mov from eax to [edx + disp32] */
     }else{
-      ADD_BYTE(X86_OP_SUB_MEM32_FROM_REG);
-      ADD_BYTE(0x15); /* MODR/M */
-      ADD_WORD((uintptr_t)&regFile[LSREG_INFO.Rn]);
+      ADD_BYTE(X86_OP_MOV_REG_TO_RM8);
+      GUEST_OPERAND(X86_EAX); /* Mov from al to [edx + disp32] */
     }
-
-    ADD_BYTE(X86_OP_MOV_TO_EAX);
-    ADD_WORD((uintptr_t)&regFile[LSIMM_INFO.Rd]);
-
-    ADD_BYTE(X86_OP_MOV_FROM_REG);
-    ADD_BYTE(0x82) /* MODR/M - Mov from eax to  edx + disp32 */
     ADD_WORD(0x00000000);
     LOG_INSTR(instInfo.pX86Addr,count);
+  }
+
+  /*
+  // If the base register needs to be updated with the offset, do that now.
+  */
+  if(LSREG_INFO.P == 0 || LSREG_INFO.W == 1){
+    STORE_ARM_REG(address,LSREG_INFO.Rn);
+    LOG_INSTR(instInfo.pX86Addr,count);
+  }
+
+  return count;
+}
+
+#ifndef NONATIVE
+/*
+// Native routines
+//
+// Where the program has one of the routines in native.c, the translation
+// of the block at its entry calls the host's version instead. It takes
+// its arguments from r0-r3, leaves its results in r0 on, as many as the
+// routine returns, and returns through lr, like the ARM routine would:
+//
+//   push rsi; push rdi; push r8-r11
+//   mov edi, r8d; mov esi, r9d; mov edx, r10d; mov ecx, r11d
+//   call nativeDadd
+//   pop r11-r8; pop rdi; pop rsi
+//   mov r8d, eax; shr rax, 32; mov r9d, eax
+//   mov pc, lr                               (then the return lookup)
+//
+// A BL straight to such a routine, which is how the compiler calls its
+// floating point and division helpers, makes the call itself, and then
+// leaves the block for the return address through a chained exit. The
+// entry stub is still there for calls that get to the routine otherwise.
+//
+// The other registers and the flags are left as they were, which the
+// procedure call standard allows for. The block is translated the first
+// time it is entered, rather than interpreted until it is hot, and does
+// not count its entries, as there is nothing in it to optimize.
+*/
+static int nativeCall(void *pInst, void *host, uint32_t results){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
+  uint8_t count = 0;
+  int chReg;
+
+  ADD_BYTE(X86_OP_PUSH_REG + X86_ESI);
+  ADD_BYTE(X86_OP_PUSH_REG + X86_EDI);
+  for(chReg = 0; chReg < 4; chReg++){
+    ADD_BYTE(X86_PRE_REX | X86_REX_B);
+    ADD_BYTE(X86_OP_PUSH_REG + chReg);
+  }
+  LOAD_ARM_REG(X86_EDI,0);
+  LOAD_ARM_REG(X86_ESI,1);
+  LOAD_ARM_REG(X86_EDX,2);
+  LOAD_ARM_REG(X86_ECX,3);
+  ADD_BYTE(X86_OP_CALL);
+  ADD_WORD((uintptr_t)(
+    (intptr_t)host - (intptr_t)(instInfo.pX86Addr + count + 4)));
+  for(chReg = 3; chReg >= 0; chReg--){
+    ADD_BYTE(X86_PRE_REX | X86_REX_B);
+    ADD_BYTE(X86_OP_POP_REG + chReg);
+  }
+  ADD_BYTE(X86_OP_POP_REG + X86_EDI);
+  ADD_BYTE(X86_OP_POP_REG + X86_ESI);
 
+  /*
+  // A 64-bit result is in RAX, and a pair of them in RAX and RDX.
+  */
+  STORE_ARM_REG(X86_EAX,0);
+  if(results > 1){
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_SHIFT_IMM8_RM32);
+    ADD_BYTE(0xE8); /* MOD R/M - shr rax, imm8 */
+    ADD_BYTE(32);
+    STORE_ARM_REG(X86_EAX,1);
+  }
+  if(results > 2){
+    STORE_ARM_REG(X86_EDX,2);
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_SHIFT_IMM8_RM32);
+    ADD_BYTE(0xEA); /* MOD R/M - shr rdx, imm8 */
+    ADD_BYTE(32);
+    STORE_ARM_REG(X86_EDX,3);
   }
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+int nativeHandler(void *pInst){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
+  uint8_t count = 0;
+  uint32_t results;
+  void *host = armX86NativeRoutine((uint32_t)(uintptr_t)instInfo.pArmAddr,
+                                   &results);
+
+  DP1("Native routine at %p\n",(void *)instInfo.pArmAddr);
+
+  memcpy(armHostReg, armPinnedReg, sizeof(armHostReg));
+  armHostDirty = 0;
+
+  count = nativeCall(pInst, host, results);
+  LOAD_ARM_REG(X86_EAX,14);
+  STORE_ARM_REG(X86_EAX,15);
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  ((struct decodeInfo_t *)pInst)->endBB = TRUE;
+  ((struct decodeInfo_t *)pInst)->indirect = TRUE;
+  ((struct decodeInfo_t *)pInst)->ret = TRUE;
 
   return count;
 }
+#endif /* NONATIVE */
 
 int brchHandler(void *pInst){
   struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
@@ -1034,40 +3992,82 @@ int brchHandler(void *pInst){
 
   DP("Branch\n");
 
+  int32_t branchOffset = BRCH_INFO.offset;
+  branchOffset |= (((BRCH_INFO.offset & 0x00800000) > 0)?0xFF000000:0x00000000);
+  branchOffset = (uint32_t)((branchOffset << 2) + 
+                            (uintptr_t)instInfo.pArmAddr + 8);
+
+  DP1("Branch Address = 0x%x\n",branchOffset);
+
   if(BRCH_INFO.L == TRUE){
     DP("Branch and Link Instruction\n");
-    DP1("Link Address = 0x%x\n",(uintptr_t)instInfo.pArmAddr + 4);
+    DP1("Link Address = 0x%x\n",(uint32_t)(uintptr_t)instInfo.pArmAddr + 4);
 
     ADD_BYTE(X86_OP_MOV_IMM_TO_EAX);
     ADD_WORD((uintptr_t) instInfo.pArmAddr + 4);
 
-    ADD_BYTE(X86_OP_MOV_FROM_EAX);
-    ADD_WORD((uintptr_t)&LR);
-    LOG_INSTR(instInfo.pX86Addr,count);
-  }
+    STORE_ARM_REG(X86_EAX,14);
 
-  int32_t branchOffset = BRCH_INFO.offset;
-  branchOffset |= (((BRCH_INFO.offset & 0x00800000) > 0)?0xFF000000:0x00000000);
-  branchOffset = (uint32_t)((branchOffset << 2) + 
-                            (uintptr_t)instInfo.pArmAddr + 8);
+#ifndef NONATIVE
+    /*
+    // A call to a routine run natively (see "Native routines").
+    */
+    uint32_t results;
+    void *host = armX86NativeRoutine(branchOffset, &results);
 
-  DP1("Branch Address = 0x%x\n",branchOffset);
+    if(host != NULL){
+      uint8_t *pX86Addr = instInfo.pX86Addr;
+
+      LOG_INSTR(instInfo.pX86Addr,count);
+      instInfo.pX86Addr = pX86Addr + count;
+      count += nativeCall((void *)&instInfo, host, results);
+      instInfo.pX86Addr = pX86Addr + count;
+      count += untakenExitHandler((void *)&instInfo);
+
+      ((struct decodeInfo_t *)pInst)->endBB = TRUE;
+
+      return count;
+    }
+#endif /* NONATIVE */
+
+#if !defined(NOCHAINING) && !defined(NORAS)
+    /*
+    // Push the return site onto the shadow return stack.
+    */
+    ADD_BYTE(X86_OP_MOV_TO_REG);
+    CPU_OPERAND(X86_EAX,CPU_RETURN_TOP); /* mov eax, returnStackTop */
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xC0); /* MOD R/M for ADD - 0x83 /0, eax */
+    ADD_BYTE(sizeof(void *));
+    ADD_BYTE(X86_OP_AND_IMM32_RM32);
+    ADD_BYTE(0xE0); /* MOD R/M for AND - 0x81 /4, eax */
+    ADD_WORD(RAS_TOP_MASK);
+    ADD_BYTE(X86_OP_MOV_FROM_REG);
+    CPU_OPERAND(X86_EAX,CPU_RETURN_TOP); /* mov returnStackTop, eax */
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+    ADD_BYTE(0x80); /* MOD R/M for mov imm32 to [rax + disp32] */
+    ADD_WORD((uintptr_t)returnStack);
+    ADD_WORD((uintptr_t)newReturnSite(instInfo.pArmAddr));
+#endif /* NOCHAINING && NORAS */
+    LOG_INSTR(instInfo.pX86Addr,count);
+  }
 
+  WRITEBACK_ARM_REGS;
   ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-  ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-  ADD_WORD((uintptr_t)&nextBB);
+  CPU_OPERAND(0,CPU_NEXT_BB); /* mov imm32 to rm32 0xC7 /0 */
   ADD_WORD(branchOffset);
 
 #ifndef NOCHAINING
+  ADD_BYTE(X86_PRE_REX | X86_REX_W);
   ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
-  ADD_BYTE(0x05); /* MOD R/M for mov imm32 to rm32 0xC7 /0 */
-  ADD_WORD((uintptr_t)&pTakenCalloutSourceLoc);
+  CPU_OPERAND(0,CPU_TAKEN_SOURCE);
   ADD_WORD((uintptr_t)(instInfo.pX86Addr + count + 4));
 #endif /* NOCHAINING */
 
-  ADD_BYTE(X86_OP_CALL);
+  ADD_BYTE(X86_OP_JMP);
   ADD_WORD((uintptr_t)(
-    (intptr_t)&callEndBBTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
+    (intptr_t)&dispatchTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
   ));
 
   ((struct decodeInfo_t *)pInst)->endBB = TRUE;
@@ -1075,49 +4075,240 @@ int brchHandler(void *pInst){
   return count;
 }
 
-OPCODE_HANDLER_RETURN
-swiHandler(void *pInst){
-  struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
+/*
+// Emit the exit of a block that goes on with the ARM instruction after
+// the one at instInfo.pArmAddr, the way an untaken branch does.
+*/
+int untakenExitHandler(void *pInst){
+  return exitHandler(pInst,
+    (uint32_t)(uintptr_t)(((struct decodeInfo_t *)pInst)->pArmAddr + 1));
+}
+
+/*
+// Emit an exit of a block that goes on with the ARM instruction at
+// armAddr, through dispatchNotTaken: the untaken exit, the exit of a block
+// that is cut, and the side exits of a trace.
+*/
+int exitHandler(void *pInst, uint32_t armAddr){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
   uint8_t count = 0;
 
-  /* copy system call number to EAX */
-  ADD_BYTE(X86_OP_MOV_TO_EAX);
-  // ADD_WORD(...);
+  WRITEBACK_ARM_REGS;
+  ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+  CPU_OPERAND(0,CPU_NEXT_BB); /* mov imm32 to rm32 0xC7 /0 */
+  ADD_WORD(armAddr);
 
-  /* copy R0 -> EBX */
-  ADD_BYTE(X86_OP_MOV_FROM_REG);
-  ADD_BYTE(0x1D);
-  ADD_WORD((uintptr_t)&regFile[0]);
+#ifndef NOCHAINING
+  ADD_BYTE(X86_PRE_REX | X86_REX_W);
+  ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+  CPU_OPERAND(0,CPU_UNTAKEN_SOURCE);
+  ADD_WORD((uintptr_t)(instInfo.pX86Addr + count + 4));
+#endif /* NOCHAINING */
 
-  /* copy R1 -> ECX */
-  ADD_BYTE(X86_OP_MOV_FROM_REG);
-  ADD_BYTE(0x0D);
-  ADD_WORD((uintptr_t)&regFile[1]);
+  ADD_BYTE(X86_OP_JMP);
+  ADD_WORD((uintptr_t)(
+    (intptr_t)&dispatchNotTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
+  ));
+  LOG_INSTR(instInfo.pX86Addr,count);
 
-  /* copy R2 -> EDX */
-  ADD_BYTE(X86_OP_MOV_FROM_REG);
-  ADD_BYTE(0x15);
-  ADD_WORD((uintptr_t)&regFile[2]);
+  return count;
+}
+
+/*
+// Emit the exit of a block whose target has been written to the PC. See
+// "Indirect branch sites" above for the layout of the lookup.
+*/
+int indirectExitHandler(void *pInst){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t *)pInst;
+  uint8_t count = 0;
 
-  /* copy R3 -> ESI */
+  WRITEBACK_ARM_REGS;
+
+#ifdef NOCHAINING
+  LOAD_ARM_REG(X86_EAX,15);
   ADD_BYTE(X86_OP_MOV_FROM_REG);
-  ADD_BYTE(0x35);
-  ADD_WORD((uintptr_t)&regFile[3]);
+  CPU_OPERAND(X86_EAX,CPU_NEXT_BB); /* mov nextBB, eax */
+
+  ADD_BYTE(X86_OP_JMP);
+  ADD_WORD((uintptr_t)(
+    (intptr_t)&dispatchTaken - (intptr_t)(instInfo.pX86Addr + count + 4)
+  ));
+#else /* NOCHAINING */
+  struct indirectSite_t *site = newIndirectSite(instInfo.pArmAddr);
+  uint8_t sharedProbe, miss;
+
+  DP1("Indirect branch site %p\n",site);
+
+  LOAD_ARM_REG(X86_EAX,15);
+
+#ifndef NORAS
+  if(instInfo.ret == TRUE){
+    uint8_t unfilled, mispredicted;
+
+    /*
+    // Pop the shadow return stack into rcx.
+    */
+    ADD_BYTE(X86_OP_MOV_TO_REG);
+    CPU_OPERAND(X86_EDX,CPU_RETURN_TOP); /* mov edx, returnStackTop */
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_MOV_TO_REG);
+    ADD_BYTE(0x8A); /* MOD R/M for mov rcx, [rdx + disp32] */
+    ADD_WORD((uintptr_t)returnStack);
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xEA); /* MOD R/M for SUB - 0x83 /5, edx */
+    ADD_BYTE(sizeof(void *));
+    ADD_BYTE(X86_OP_AND_IMM32_RM32);
+    ADD_BYTE(0xE2); /* MOD R/M for AND - 0x81 /4, edx */
+    ADD_WORD(RAS_TOP_MASK);
+    ADD_BYTE(X86_OP_MOV_FROM_REG);
+    CPU_OPERAND(X86_EDX,CPU_RETURN_TOP); /* mov returnStackTop, edx */
+
+    /* Predicted? */
+    ADD_BYTE(X86_OP_CMP_REG_WITH_MEM32);
+    ADD_BYTE(0x01); /* MODR/M - cmp eax, [ecx] (armTarget) */
+    ADD_BYTE(X86_OP_JNE_REL8);
+    ADD_BYTE(0x00);
+    unfilled = count;
+
+#ifdef PROFILE
+    ADD_BYTE(X86_OP_INC_RM32);
+    ADD_ABSOLUTE(0x05,&returnHits); /* MOD R/M for INC - 0xFF /0 */
+#endif /* PROFILE */
+
+    ADD_BYTE(X86_OP_JMP_RM32);
+    ADD_BYTE(0x61); /* MOD R/M for JMP - 0xFF /4, [ecx + disp8] */
+    ADD_BYTE(offsetof(struct returnSite_t, x86Target));
+    instInfo.pX86Addr[unfilled - 1] = count - unfilled;
+
+    /* Right, but the continuation has not been translated yet? */
+    ADD_BYTE(X86_OP_CMP_REG_WITH_MEM32);
+    ADD_BYTE(0x41); /* MODR/M - cmp eax, [ecx + disp8] */
+    ADD_BYTE(offsetof(struct returnSite_t, armLink));
+    ADD_BYTE(X86_OP_JNE_REL8);
+    ADD_BYTE(0x00);
+    mispredicted = count;
+
+    ADD_BYTE(X86_PRE_REX | X86_REX_W);
+    ADD_BYTE(X86_OP_MOV_FROM_REG);
+    CPU_OPERAND(X86_ECX,CPU_RETURN_SITE); /* mov pReturnSite, rcx */
+    ADD_BYTE(X86_OP_MOV_FROM_REG);
+    CPU_OPERAND(X86_EAX,CPU_NEXT_BB); /* mov nextBB, eax */
+    ADD_BYTE(X86_OP_JMP);
+    ADD_WORD((uintptr_t)(
+      (intptr_t)&dispatchReturn - (intptr_t)(instInfo.pX86Addr + count + 4)
+    ));
+    instInfo.pX86Addr[mispredicted - 1] = count - mispredicted;
+
+#ifdef PROFILE
+    ADD_BYTE(X86_OP_INC_RM32);
+    ADD_ABSOLUTE(0x05,&returnMisses); /* MOD R/M for INC - 0xFF /0 */
+#endif /* PROFILE */
+  }
+#endif /* NORAS */
+
+  /* Last target of this site? */
+  ADD_BYTE(X86_OP_CMP_REG_WITH_MEM32);
+  ADD_ABSOLUTE(0x05,&site->armTarget); /* MODR/M - cmp eax, disp32 */
+  ADD_BYTE(X86_OP_JNE_REL8);
+  ADD_BYTE(0x00);
+  sharedProbe = count;
+
+#ifdef PROFILE
+  ADD_BYTE(X86_OP_INC_RM32);
+  ADD_ABSOLUTE(0x05,&site->hits); /* MOD R/M for INC - 0xFF /0 */
+#endif /* PROFILE */
+
+  ADD_BYTE(X86_OP_JMP_RM32);
+  ADD_ABSOLUTE(0x25,&site->x86Target); /* MOD R/M for JMP - 0xFF /4, disp32 */
+  instInfo.pX86Addr[sharedProbe - 1] = count - sharedProbe;
+
+  /*
+  // Slot of the lookaside: ((target >> 2) & mask) * 16, computed as
+  // (target & (mask << 2)) scaled by 4 in the addressing mode.
+  */
+  ADD_BYTE(X86_OP_MOV_TO_REG);
+  ADD_BYTE(0xD0); /* MOD R/M EAX to EDX */
+  ADD_BYTE(X86_OP_AND_IMM32_RM32);
+  ADD_BYTE(0xE2); /* MOD R/M for AND - 0x81 /4, edx */
+  ADD_WORD((INDEX_LOOKASIDE_SIZE - 1) << 2);
+
+  ADD_BYTE(X86_OP_CMP_REG_WITH_MEM32);
+  ADD_BYTE(0x04); /* MODR/M - eax, SIB */
+  ADD_BYTE(0x95); /* SIB - rdx * 4 + disp32 */
+  ADD_WORD((uintptr_t)&indexLookaside[0].armAddr);
+  ADD_BYTE(X86_OP_JNE_REL8);
+  ADD_BYTE(0x00);
+  miss = count;
+
+#ifdef PROFILE
+  ADD_BYTE(X86_OP_INC_RM32);
+  ADD_ABSOLUTE(0x05,&site->sharedHits); /* MOD R/M for INC - 0xFF /0 */
+#endif /* PROFILE */
+
+  ADD_BYTE(X86_OP_JMP_RM32);
+  ADD_BYTE(0x24); /* MOD R/M for JMP - 0xFF /4, SIB */
+  ADD_BYTE(0x95); /* SIB - rdx * 4 + disp32 */
+  ADD_WORD((uintptr_t)&indexLookaside[0].x86Addr);
+  instInfo.pX86Addr[miss - 1] = count - miss;
 
-  /* copy R4 -> EDI */
   ADD_BYTE(X86_OP_MOV_FROM_REG);
-  ADD_BYTE(0x3D);
-  ADD_WORD((uintptr_t)&regFile[4]);
+  CPU_OPERAND(X86_EAX,CPU_NEXT_BB); /* mov nextBB, eax */
+
+  ADD_BYTE(X86_PRE_REX | X86_REX_W);
+  ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+  CPU_OPERAND(0,CPU_INDIRECT_SITE); /* mov imm32 to rm64 */
+  ADD_WORD((uintptr_t)site);
 
-  /* invoke X86 system call */
-  ADD_BYTE(X86_OP_INT_VECTOR);
-  ADD_BYTE(X86_OP_SYSTEM_CALL);
+  ADD_BYTE(X86_OP_JMP);
+  ADD_WORD((uintptr_t)(
+    (intptr_t)&dispatchIndirect - (intptr_t)(instInfo.pX86Addr + count + 4)
+  ));
+#endif /* NOCHAINING */
+  LOG_INSTR(instInfo.pX86Addr,count);
+
+  return count;
+}
+
+/*
+// Emit a software interrupt. There are no system calls, so it is ignored,
+// unless it asks to end the program (see SWI_EXIT), which is done through
+// an exit to ARM address 0. An EABI swi 0 has its call number in r7, which
+// is only known at run time.
+*/
+OPCODE_HANDLER_RETURN
+swiHandler(void *pInst){
+  struct decodeInfo_t instInfo = *(struct decodeInfo_t*)pInst;
+  uint32_t number = SWI_NUMBER(*instInfo.pArmAddr);
+  uint8_t *pX86Addr = instInfo.pX86Addr;
+  uint8_t count = 0, exit;
+
+  if(number == SWI_OABI_BASE + SYS_EXIT ||
+     number == SWI_OABI_BASE + SYS_EXIT_GROUP){
+    ((struct decodeInfo_t *)pInst)->endBB = TRUE;
+    return exitHandler(pInst, 0);
+  }
+  if(number != 0){
+    DP("IGNORING Software Interrupt\n");
+    return 0;
+  }
 
-  /* get result from EAX and store it in R0 */
-  ADD_BYTE(X86_OP_MOV_FROM_EAX);
-  ADD_WORD((uintptr_t)&regFile[0]);
+  LOAD_ARM_REG(X86_EAX,7);
+  ADD_BYTE(X86_OP_CMP32_WITH_EAX);
+  ADD_WORD(SYS_EXIT);
+  ADD_BYTE(X86_OP_JE_REL8);
+  ADD_BYTE(0x00);
+  exit = count;
+  ADD_BYTE(X86_OP_CMP32_WITH_EAX);
+  ADD_WORD(SYS_EXIT_GROUP);
+  ADD_BYTE(X86_OP_JNE_REL8);
+  ADD_BYTE(0x00);
+  pX86Addr[exit - 1] = count - exit;
+  exit = count;
   LOG_INSTR(instInfo.pX86Addr,count);
 
-  DP_ASSERT(0, "Swi not supported\n");
+  instInfo.pX86Addr = pX86Addr + count;
+  count += exitHandler(&instInfo, 0);
+  pX86Addr[exit - 1] = count - exit;
+
   return count;
 }
@@ -4,5 +4,7 @@
 #include "types.h"
 
 void armX86Decode(const struct map_t *memMap);
+uint32_t armX86Translate(const struct map_t *memMap, const uint32_t *functions,
+    uint32_t numFunctions);
 
 #endif /* _ARMX86_DECODE_H */
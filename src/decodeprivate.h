@@ -66,6 +66,57 @@
 #define OPCODE_MVN              0x01E00000  // Move not
 #define OPCODE_SHIFT            21
 
+/*
+// Status register transfers sit in the part of the data processing space
+// where the S bit of a test or compare is clear.
+*/
+#define MRS_MASK                0x0FBF0FFF
+#define MRS_CPSR                0x010F0000  // MRS Rd, CPSR
+#define MSR_REG_MASK            0x0FB0FFF0
+#define MSR_REG_CPSR            0x0120F000  // MSR CPSR_<fields>, Rm
+#define MSR_IMM_MASK            0x0FB0F000
+#define MSR_IMM_CPSR            0x0320F000  // MSR CPSR_<fields>, #imm
+#define MSR_FIELD_F             0x8         // Field mask bit for the flags
+
+/*
+// Software interrupts are ignored, except for the Linux system calls that
+// end the program, exit and exit_group. The old ABI has the call number in
+// the swi instruction, offset by SWI_OABI_BASE; EABI has swi 0 and the
+// number in r7.
+*/
+#define SWI_NUMBER(armInst)     ((armInst) & 0x00FFFFFF)
+#define SWI_OABI_BASE           0x900000
+#define SYS_EXIT                1
+#define SYS_EXIT_GROUP          248
+#define SWI_EXIT(armInst, r7)                                   \
+  (SWI_NUMBER(armInst) == SWI_OABI_BASE + SYS_EXIT ||           \
+   SWI_NUMBER(armInst) == SWI_OABI_BASE + SYS_EXIT_GROUP ||     \
+   (SWI_NUMBER(armInst) == 0 && ((r7) == SYS_EXIT || (r7) == SYS_EXIT_GROUP)))
+
+/*
+// Flag groups tracked by the liveness analysis. They match the parts of
+// the lazy flag record: flagNZ, and flagOp/flagSrc/flagRes.
+*/
+#define FLAGS_NZ                0x1
+#define FLAGS_CV                0x2
+#define FLAGS_ALL               (FLAGS_NZ | FLAGS_CV)
+
+/*
+// What EFLAGS hold right after a flag setting instruction. The x86 carry
+// of a subtraction is the complement of the ARM carry, and logical
+// operations clear the x86 carry and overflow where ARM keeps them.
+*/
+#define HOST_FLAGS_NONE         0
+#define HOST_FLAGS_LOGIC        1
+#define HOST_FLAGS_ADD          2
+#define HOST_FLAGS_SUB          3
+
+#define CPSR_N_SHIFT            31
+#define CPSR_Z_SHIFT            30
+#define CPSR_C_SHIFT            29
+#define CPSR_V_SHIFT            28
+#define CPSR_FLAGS_MASK         0xF0000000
+
 /*
 // Set of macros and global variables to deal with registers
 */
@@ -78,6 +129,9 @@
 #define RS(x)                   (((x) & 0x00000F00) >> RS_SHIFT)
 #define RM(x)                   ((x) & 0x0000000F)
 #define ROTATE(x)               RS(x)
+/* The immediate of data processing: imm8 rotated right by 2 * rotate */
+#define ROTATED_IMM(x)          ((((x) & 0xFF) >> (ROTATE(x) * 2)) |        \
+                                 (((x) & 0xFF) << ((32 - ROTATE(x) * 2) & 31)))
 #define SHIFT_AMT_MASK          0x00000F80
 #define SHIFT_AMT_SHIFT         7
 #define SHIFT_TYPE_MASK         0x00000060
@@ -90,9 +144,9 @@
 #define BIT20_MASK              0x00100000
 
 #define NUM_ARM_REGISTERS       16
-#define R13                     regFile[13]
-#define R14                     regFile[14]
-#define R15                     regFile[15]
+#define R13                     armCpu.regFile[13]
+#define R14                     armCpu.regFile[14]
+#define R15                     armCpu.regFile[15]
 
 #define SP                      R13
 #define LR                      R14
@@ -108,13 +162,13 @@
 #define CARRY(x)                (((x) & C_FLAG_MASK) > 0?1:0)
 #define OVERFLOW(x)             (((x) & V_FLAG_MASK) > 0?1:0)
 
-#define EQ                      ZER0(cpsr)      /* Z = 1            */
+#define EQ                      ZER0(armCpu.cpsr) /* Z = 1            */
 #define NE                      !EQ             /* Z = 0            */
-#define CS                      CARRY(cpsr)     /* C = 1            */
+#define CS                      CARRY(armCpu.cpsr) /* C = 1            */
 #define CC                      !CS             /* C = 0            */
-#define MI                      NEGATIVE(cpsr)  /* N = 1            */
+#define MI                      NEGATIVE(armCpu.cpsr) /* N = 1            */
 #define PL                      !MI             /* N = 0            */
-#define VS                      OVERFLOW(cpsr)  /* V = 1            */
+#define VS                      OVERFLOW(armCpu.cpsr) /* V = 1            */
 #define VC                      !VS             /* V = 0            */
 #define HI                      (CS && NE)      /* C = 1 && Z = 0   */
 #define LS                      (CC || EQ)      /* C = 0 || Z = 1   */
@@ -143,8 +197,6 @@
 /*
 // Set of macros defining x86 opcodes.
 */
-#define X86_OP_MOV_TO_EAX            0xA1
-#define X86_OP_MOV_FROM_EAX          0xA3
 #define X86_OP_MOV_RM8_TO_REG        0x8A
 #define X86_OP_MOV_REG_TO_RM8        0x88
 #define X86_OP_SUB32_FROM_EAX        0x2D
@@ -159,9 +211,7 @@
 #define X86_OP_MOV_IMM_TO_EAX        0xB8
 #define X86_OP_NOT_RM32              0xF7
 #define X86_OP_NEG_RM32              0xF7
-#define X86_OP_PUSH_MEM32            0xFF
 #define X86_OP_POPF                  0x9D
-#define X86_OP_POP_MEM32             0x8F
 #define X86_OP_PUSHF                 0x9C
 #define X86_OP_PUSH_IMM32            0x68
 #define X86_OP_CMP_MEM32_WITH_REG    0x39
@@ -191,8 +241,56 @@
 #define X86_OP_CMC                   0xF5
 #define X86_OP_XOR_IMM32_AND_EAX     0x35
 #define X86_OP_SHL                   0xC1
+#define X86_OP_CMP_REG_WITH_MEM32    0x3B
+#define X86_OP_AND_IMM32_RM32        0x81
+#define X86_OP_INC_RM32              0xFF
+#define X86_OP_DEC_RM32              0xFF
+#define X86_OP_JMP_RM32              0xFF
+#define X86_OP_JE_REL8               0x74
+#define X86_OP_JNE_REL8              0x75
+#define X86_OP_ALU_IMM8_RM32         0x83
+#define X86_OP_MOV_IMM_TO_EDX        0xBA
+#define X86_OP_OR_REG_TO_MEM32       0x09
+#define X86_OP_JO                    0x80
+#define X86_OP_JNO                   0x81
+#define X86_OP_JS                    0x88
+#define X86_OP_JNS                   0x89
+#define X86_OP_SETO                  0x90 /* 0F 90+cc, cc as for jcc */
+#define X86_OP_CMOVO                 0x40 /* 0F 40+cc, cc as for jcc */
+#define X86_OP_CMOVE                 0x44
+#define X86_OP_CMOVNE                0x45
+#define X86_OP_TEST_REG8             0x84
+#define X86_OP_PUSH_REG              0x50 /* 50+r */
+#define X86_OP_POP_REG               0x58 /* 58+r */
+#define X86_OP_ALU_RM32_TO_REG       0x03 /* 03+8*ext, ext as for 81 /ext */
+#define X86_OP_ALU_IMM32_RM32        0x81
+#define X86_OP_SHIFT_IMM8_RM32       0xC1
+#define X86_OP_MOVZX_RM8             0xB6 /* 0F B6 */
+#define X86_OP_MOV_IMM_TO_MEM8       0xC6
+#define X86_OP_LEA                   0x8D
+#define X86_OP_SHIFT_CL_RM32         0xD3
+#define X86_OP_SBB_RM32_TO_REG       0x1B
+#define X86_OP_AND_REG_TO_RM32       0x21
+#define X86_OP_XOR_RM32_TO_REG       0x33
+#define X86_OP_JBE_REL8              0x76
+#define X86_OP_ADD_REG_TO_RM32       0x01
+#define X86_OP_TEST_RM32             0x85
+#define X86_OP_TEST_IMM32_RM32       0xF7 /* F7 /0 */
+#define X86_OP_MOVSB                 0xA4
+#define X86_OP_STOSD                 0xAB
+#define X86_PRE_REP                  0xF3
+#define X86_PRE_REX                  0x40 /* 40+WRXB */
+#define X86_REX_W                    0x08 /* 64-bit operand */
+#define X86_REX_R                    0x04 /* Extends ModR/M reg */
+#define X86_REX_X                    0x02 /* Extends SIB index */
+#define X86_REX_B                    0x01 /* Extends ModR/M r/m */
 
-#define UNSUPPORTED              DP_ASSERT(0,"Unsupported ARM instruction\n")
+/*
+// The translator gives up on the block it is working on when it comes to an
+// instruction it cannot handle. decodeBasicBlock() then drops the block and
+// returns NULL.
+*/
+#define UNSUPPORTED              unsupportedInst(__FUNCTION__)
 typedef enum {
   LSL,
   LSR,
@@ -228,8 +326,8 @@ struct decodeInfo_t{
       bool S;
       uint8_t Rn;
       uint8_t Rd;
-      uint8_t rotate;
-      uint8_t imm;
+      uint8_t rotate;   /* Only for the carry; imm is already rotated */
+      uint32_t imm;
     }dpimm;
 
     struct {
@@ -269,13 +367,21 @@ struct decodeInfo_t{
   uint8_t cond;
   bool immediate; /* True => DPIMM */
   bool endBB; /* Instruction signals end of basic block */
+  bool indirect; /* Block ends in a branch to the address written to PC */
+  bool ret; /* The indirect branch returns from a subroutine */
+  uint8_t flagsLive; /* Flag groups that must be recorded (FLAGS_NZ/CV) */
+  uint8_t hostFlags; /* Condition can use EFLAGS as left by the previous
+                        instruction (HOST_FLAGS_*) */
+  bool fuse; /* Set EFLAGS last, for the jcc of the next instruction */
+  bool branchless; /* Condition is kept in BL for a cmov, not a jcc */
   uint8_t* pX86Addr;
   uint32_t* pArmAddr;
 };
 
 
 #define OPCODE_HANDLER_RETURN   int
-void decodeBasicBlock();
+void *decodeBasicBlock(void);
+extern void unsupportedInst(const char *handler) __attribute__((noreturn));
 
 OPCODE_HANDLER_RETURN andHandler(void *pInst);
 OPCODE_HANDLER_RETURN eorHandler(void *pInst);
@@ -294,9 +400,26 @@ OPCODE_HANDLER_RETURN movHandler(void *pInst);
 OPCODE_HANDLER_RETURN bicHandler(void *pInst);
 OPCODE_HANDLER_RETURN mvnHandler(void *pInst);
 OPCODE_HANDLER_RETURN swiHandler(void *pInst);
+OPCODE_HANDLER_RETURN mrsHandler(void *pInst);
+OPCODE_HANDLER_RETURN msrHandler(void *pInst);
 extern int lsmHandler(void *pInst);
 extern int lsimmHandler(void *pInst);
 extern int lsregHandler(void *pInst);
 extern int brchHandler(void *pInst);
+extern int nativeHandler(void *pInst);
+extern int indirectExitHandler(void *pInst);
+extern int untakenExitHandler(void *pInst);
+extern int exitHandler(void *pInst, uint32_t armAddr);
+extern void analyzeFlags(const uint32_t *pArmAddr);
+extern uint32_t armX86Interpret(uint32_t armAddr, uint32_t maxInsts);
+extern bool readOnlyLoad(uint32_t armAddr, uint32_t size, uint32_t *pValue);
+extern void irReset(void);
+extern bool irAdd(uint32_t armInst, const uint32_t *pArmAddr);
+extern void irForget(uint16_t regs);
+extern uint32_t irLower(uint8_t *pX86Addr);
+extern uint8_t emitShift(uint8_t *pX86Addr, uint8_t reg, shift_t type,
+                         uint8_t amount);
+extern uint8_t emitLea(uint8_t *pX86Addr, uint8_t reg, uint8_t base,
+                       uint8_t index, uint8_t scale, int32_t disp);
 
 #endif /* _ARMX86_DECODEPRIVATE_H */
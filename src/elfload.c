@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -8,6 +9,7 @@
 
 #include "debug.h"
 #include "elfload.h"
+#include "codeenv.h"
 
 /* Looking for an ARM executable */
 #define EI_NIDENT 	        16
@@ -16,6 +18,18 @@
 
 /* Looking for loadable segments */
 #define PT_LOAD                 1
+#define PF_X                    0x1
+#define PF_W                    0x2
+
+/* Looking for functions */
+#define SHT_SYMTAB              2
+#define STT_FUNC                2
+#define STB_GLOBAL              1
+#define STB_WEAK                2
+#define ELF32_ST_TYPE(info)     ((info) & 0xF)
+#define ELF32_ST_BIND(info)     ((info) >> 4)
+
+#define SEGMENT_PAGE_SIZE       0x1000
 
 struct elfHeader_t {
     unsigned        char e_ident[EI_NIDENT];/* Elf Identification */
@@ -45,6 +59,19 @@ struct programHeader_t {
     uint32_t        p_align;
 };
 
+struct sectionHeader_t {
+    uint32_t        sh_name;
+    uint32_t        sh_type;                /* Classification of section */
+    uint32_t        sh_flags;
+    uint32_t        sh_addr;
+    uint32_t        sh_offset;              /* Offset of section data */
+    uint32_t        sh_size;                /* Size of section data */
+    uint32_t        sh_link;
+    uint32_t        sh_info;
+    uint32_t        sh_addralign;
+    uint32_t        sh_entsize;             /* Size of each entry */
+};
+
 struct symTableEntry_t {
     uint32_t        st_name;
     uint32_t        st_value;
@@ -56,6 +83,19 @@ struct symTableEntry_t {
 
 FILE *elf;
 
+/*
+ * The ELF may start anywhere in the file, as it does when it is carried by
+ * an executable made ahead of time (see aot.c). File offsets taken from the
+ * ELF are relative to elfOffset. The header is kept for the symbol table.
+ */
+static long elfOffset;
+static struct elfHeader_t loadedHeader;
+
+/* The heap reserved after the segments, if any (see armX86ElfHeap()) */
+static int heapMapped;
+static uint32_t heapStart;
+static uint32_t heapSize;
+
 /*
  * Data structures to capture information about segments of the process image in
  * memory; used to map and unmap memory areas in the image.
@@ -114,7 +154,7 @@ showElfHeader(const struct elfHeader_t *elfHeader)
     debug(("ELF Type: %d\n", elfHeader->e_type));
     debug(("ELF Machine: %d\n", elfHeader->e_machine));
     debug(("ELF Version: %d\n", elfHeader->e_version));
-    debug(("ELF Entry: %p\n", (void *)elfHeader->e_entry));
+    debug(("ELF Entry: 0x%x\n", elfHeader->e_entry));
     debug(("ELF Program Header Offset: 0x%x\n", elfHeader->e_phoff));
     debug(("ELF Section Header Offset: 0x%x\n", elfHeader->e_shoff));
     debug(("ELF Flags: 0x%x\n", elfHeader->e_flags));
@@ -335,10 +375,34 @@ showSegments()
     }
 }
 
+/*
+ * Compute the page aligned range that covers a segment. mmap needs a page
+ * aligned address, but segments such as an empty .data following .text
+ * may start anywhere.
+ *
+ * Return: Size of the range, 0 for a segment with nothing in memory.
+ */
+static uint32_t
+segmentPageRange(const struct segment_t *seg, uintptr_t *start)
+{
+    uintptr_t end;
+
+    if (seg->progHdr->p_memsz == 0) {
+        return 0;
+    }
+
+    *start = seg->progHdr->p_vaddr & ~(SEGMENT_PAGE_SIZE - 1);
+    end = (seg->progHdr->p_vaddr + seg->progHdr->p_memsz +
+           SEGMENT_PAGE_SIZE - 1) & ~(SEGMENT_PAGE_SIZE - 1);
+
+    return end - *start;
+}
+
 /*
  * Allocate space in the x86 process image for the ARM image segments.
  * There are expected to be text and data segments. Only exclusive segments
- * are mapped.
+ * are mapped. They are mapped at their virtual addresses in the ARM
+ * address space reserved by initArmMemory().
  *
  * Mapping a segment may fail for a variety of reasons.
  *
@@ -350,6 +414,8 @@ mapSegments()
 {
     struct segment_t *temp = segmentList;
     uintptr_t *addr;
+    uintptr_t start;
+    uint32_t size;
 
     debug_in;
 
@@ -363,17 +429,17 @@ mapSegments()
             debug(("Mapping segment starting at 0x%08x\n", temp->progHdr->p_vaddr));
             debug(("Segment size: %u\n", temp->progHdr->p_memsz));
 
-            addr = mmap((void *)temp->progHdr->p_vaddr, temp->progHdr->p_memsz,
+            if ((size = segmentPageRange(temp, &start)) == 0) {
+                temp = temp->next;
+                continue;
+            }
+
+            addr = mmap(ARM_HOST_ADDR(start), size,
 	                PROT_READ | PROT_WRITE,
                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED , -1, 0);
 
 	    if (addr == (void *)-1) {
                 sys_err(("mmap: "));
-                info((" \
-                       If you are using Linux kernel 2.6.28 or later, the\n \
-                       kernel might be configured to disallow mmaps at some \n \
-                       addresses. To fix this, do the following as root: \n \
-                        $ echo 0 > /proc/sys/vm/mmap_min_addr\n"));
 		return -1;
 	    } else {
                 debug(("Mapped at %p\n", addr));
@@ -388,18 +454,68 @@ mapSegments()
     return 0;
 }
 
+/*
+ * Reserve the heap of the ARM program, from the end of the last segment
+ * that was mapped to ARM_HEAP_SIZE bytes on, or to the stack if that is
+ * closer. The pages are only committed as they are touched. A program
+ * that has no room for a heap goes without one.
+ *
+ * Return: None
+ */
+static void
+mapHeap()
+{
+    struct segment_t *temp = segmentList;
+    uintptr_t start, end = 0;
+    uint32_t size;
+    void *addr;
+
+    while (temp) {
+        if (temp->segType == EXCLUSIVE &&
+            (size = segmentPageRange(temp, &start)) != 0 &&
+            start + size > end) {
+            end = start + size;
+        }
+        temp = temp->next;
+    }
+
+    heapStart = end;
+    heapSize = 0;
+    if (end >= ARM_STACK_TOP - ARM_STACK_SIZE) {
+        debug(("No room for a heap\n"));
+        return;
+    }
+    size = ARM_STACK_TOP - ARM_STACK_SIZE - end;
+    if (size > ARM_HEAP_SIZE) {
+        size = ARM_HEAP_SIZE;
+    }
+
+    addr = mmap(ARM_HOST_ADDR(heapStart), size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                -1, 0);
+    if (addr == MAP_FAILED) {
+        debug(("Could not map the heap\n"));
+        return;
+    }
+
+    heapSize = size;
+    debug(("Heap at 0x%08x, size 0x%x\n", heapStart, heapSize));
+}
+
 /*
  * Unmap all the exclusive segments that have been mapped so far. A flag in
  * the segment data structure indicates whether the segment was mapped
- * successfully.
+ * successfully. The range goes back to being reserved for the ARM program.
  *
  * Return: None.
- * FIXME: Check for the return valud of munmap.
+ * FIXME: Check for the return valud of mmap.
  */
 static void
 unmapSegments()
 {
     struct segment_t *temp = segmentList;
+    uintptr_t start;
+    uint32_t size;
 
     if (!segmentList) {
 	debug(("No segments in list!\n"));
@@ -409,8 +525,11 @@ unmapSegments()
     while (temp) {
 	debug(("Unmapping segment starting at 0x%08x\n", temp->progHdr->p_vaddr));
 
-        if (temp->segType == EXCLUSIVE && temp->segmentMapped) {
-            munmap((void *)temp->progHdr->p_vaddr, temp->progHdr->p_memsz);
+        if (temp->segType == EXCLUSIVE && temp->segmentMapped &&
+            (size = segmentPageRange(temp, &start)) != 0) {
+            mmap(ARM_HOST_ADDR(start), size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                 -1, 0);
 	}
 
         temp = temp->next;
@@ -439,8 +558,8 @@ initSegments()
     }
 
     while (temp) {
-        inst = (uint8_t *)(temp->progHdr->p_vaddr);
-        fseek(elf, temp->progHdr->p_offset, SEEK_SET);
+        inst = ARM_HOST_ADDR(temp->progHdr->p_vaddr);
+        fseek(elf, elfOffset + temp->progHdr->p_offset, SEEK_SET);
         numBytesRead = fread((void *)inst, 1, temp->progHdr->p_filesz, elf);
     
         if (temp->progHdr->p_filesz != 0) {
@@ -529,8 +648,303 @@ classifySegment(struct segment_t *seg)
     }
 }
 
+/*
+ * Add up the in-memory size of the loadable, executable segments that were
+ * mapped. This bounds the amount of ARM code that may ever be translated,
+ * and is used to size the translation index.
+ *
+ * Return: Size of the text in bytes, 0 if nothing has been loaded.
+ */
+uint32_t
+armX86ElfTextSize(void)
+{
+    struct segment_t *temp = segmentList;
+    uint32_t textSize = 0;
+
+    while (temp) {
+        if (temp->segType == EXCLUSIVE && temp->progHdr->p_type == PT_LOAD &&
+            (temp->progHdr->p_flags & PF_X)) {
+            textSize += temp->progHdr->p_memsz;
+        }
+        temp = temp->next;
+    }
+
+    debug(("Text size: 0x%x\n", textSize));
+    return textSize;
+}
+
+/*
+ * Hash the loadable segments as they were laid out in memory: where they
+ * are and what they hold. Two programs with the same hash run the same
+ * code from the same addresses.
+ *
+ * Return: Hash of the loaded image.
+ */
+uint64_t
+armX86ElfHash(void)
+{
+    struct segment_t *temp = segmentList;
+    uint64_t hash = HASH_SEED;
+
+    while (temp) {
+        if (temp->segType == EXCLUSIVE && temp->progHdr->p_type == PT_LOAD) {
+            hash = hashBytes(hash, &temp->progHdr->p_vaddr,
+                sizeof(temp->progHdr->p_vaddr));
+            hash = hashBytes(hash, &temp->progHdr->p_memsz,
+                sizeof(temp->progHdr->p_memsz));
+            hash = hashBytes(hash, ARM_HOST_ADDR(temp->progHdr->p_vaddr),
+                temp->progHdr->p_memsz);
+        }
+        temp = temp->next;
+    }
+
+    return hash;
+}
+
+/*
+ * Tell whether an ARM address lies in a loadable, executable segment.
+ *
+ * Return: 1 if it does, 0 otherwise.
+ */
+int
+armX86ElfIsText(uint32_t armAddr)
+{
+    struct segment_t *temp = segmentList;
+
+    while (temp) {
+        if (temp->segType == EXCLUSIVE && temp->progHdr->p_type == PT_LOAD &&
+            (temp->progHdr->p_flags & PF_X) &&
+            armAddr >= temp->progHdr->p_vaddr &&
+            armAddr - temp->progHdr->p_vaddr < temp->progHdr->p_memsz) {
+            return 1;
+        }
+        temp = temp->next;
+    }
+
+    return 0;
+}
+
+/*
+ * Tell whether size bytes at an ARM address lie in a loadable segment that
+ * is not writable, such as the text with its literal pools. What is read
+ * there is known when the code that reads it is translated.
+ *
+ * Return: 1 if they do, 0 otherwise.
+ */
+int
+armX86ElfIsReadOnly(uint32_t armAddr, uint32_t size)
+{
+    struct segment_t *temp = segmentList;
+
+    while (temp) {
+        if (temp->segType == EXCLUSIVE && temp->progHdr->p_type == PT_LOAD &&
+            !(temp->progHdr->p_flags & PF_W) &&
+            armAddr >= temp->progHdr->p_vaddr &&
+            armAddr - temp->progHdr->p_vaddr <= temp->progHdr->p_filesz &&
+            size <= temp->progHdr->p_filesz -
+                    (armAddr - temp->progHdr->p_vaddr)) {
+            return 1;
+        }
+        temp = temp->next;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the symbol table described by sectionHeader in one go.
+ *
+ * Return: malloc'ed copy of the table, NULL if it cannot be read.
+ */
+static uint8_t *
+readSymbols(const struct sectionHeader_t *sectionHeader)
+{
+    uint8_t *symbols;
+
+    if (sectionHeader->sh_size == 0) {
+        return NULL;
+    }
+    symbols = malloc(sectionHeader->sh_size);
+    panic(symbols != NULL, ("No memory for the symbol table"));
+    fseek(elf, elfOffset + sectionHeader->sh_offset, SEEK_SET);
+    if (fread(symbols, 1, sectionHeader->sh_size, elf) !=
+        sectionHeader->sh_size) {
+        free(symbols);
+        return NULL;
+    }
+
+    return symbols;
+}
+
+/*
+ * Tell whether a symbol names an ARM function in the text that can be
+ * called from other files: a global or weak one. A local symbol may share
+ * its name with a function elsewhere in the program.
+ *
+ * Return: 1 if it does, 0 otherwise.
+ */
+static int
+isFunction(const struct symTableEntry_t *symbol)
+{
+    return ELF32_ST_TYPE(symbol->st_info) == STT_FUNC &&
+        (ELF32_ST_BIND(symbol->st_info) == STB_GLOBAL ||
+         ELF32_ST_BIND(symbol->st_info) == STB_WEAK) &&
+        (symbol->st_value & 3) == 0 &&
+        armX86ElfIsText(symbol->st_value);
+}
+
+/*
+ * Collect the global and weak ARM functions named in the symbol table of
+ * the ELF that was loaded, which stays open. Thumb functions and functions
+ * outside the text are left out.
+ *
+ * Return: Number of functions, whose addresses are handed back in a
+ *         malloc'ed array. 0 if there is no symbol table.
+ */
+uint32_t
+armX86ElfFunctions(uint32_t **functions)
+{
+    struct sectionHeader_t sectionHeader;
+    const struct symTableEntry_t *symbol;
+    uint32_t i, j, numSymbols, numFunctions = 0;
+    uint8_t *symbols;
+
+    *functions = NULL;
+
+    for (i = 0; i < loadedHeader.e_shnum && loadedHeader.e_shoff != 0; i++) {
+        fseek(elf, elfOffset + loadedHeader.e_shoff +
+            i * loadedHeader.e_shentsize, SEEK_SET);
+        if (fread(&sectionHeader, sizeof(sectionHeader), 1, elf) != 1) {
+            break;
+        }
+        if (sectionHeader.sh_type != SHT_SYMTAB ||
+            sectionHeader.sh_entsize < sizeof(*symbol) ||
+            (symbols = readSymbols(&sectionHeader)) == NULL) {
+            continue;
+        }
+
+        numSymbols = sectionHeader.sh_size / sectionHeader.sh_entsize;
+        *functions = realloc(*functions,
+            (numFunctions + numSymbols) * sizeof(uint32_t));
+        panic(*functions != NULL, ("No memory for the function list"));
+
+        for (j = 0; j < numSymbols; j++) {
+            symbol = (const struct symTableEntry_t *)
+                (symbols + j * sectionHeader.sh_entsize);
+            if (isFunction(symbol)) {
+                (*functions)[numFunctions++] = symbol->st_value;
+            }
+        }
+        free(symbols);
+    }
+
+    debug(("Functions in the symbol table: %u\n", numFunctions));
+    return numFunctions;
+}
+
+/*
+ * Where the heap reserved for the ARM program is. It is only reserved the
+ * first time it is asked for, by the native allocator (see native.c), so a
+ * program that keeps its own allocator goes without one.
+ *
+ * Return: ARM address of the heap, whose size is handed back in size, 0 if
+ *         there is none.
+ */
+uint32_t
+armX86ElfHeap(uint32_t *size)
+{
+    if (!heapMapped) {
+        mapHeap();
+        heapMapped = 1;
+    }
+    *size = heapSize;
+    return (heapSize != 0) ? heapStart : 0;
+}
+
+/*
+ * Look up the ARM functions named in names in the symbol table of the ELF
+ * that was loaded, as armX86ElfFunctions() finds them. A global function
+ * is taken over a weak one of the same name.
+ *
+ * Return: Number of names found. addrs[i] is the address of names[i], or 0
+ *         if there is no such function.
+ */
+uint32_t
+armX86ElfLookup(const char *const *names, uint32_t numNames, uint32_t *addrs)
+{
+    struct sectionHeader_t sectionHeader, strHeader;
+    const struct symTableEntry_t *symbol;
+    uint32_t i, j, k, bind, numSymbols, found = 0;
+    uint8_t *symbols;
+    char *strings;
+
+    memset(addrs, 0, numNames * sizeof(uint32_t));
+
+    for (i = 0; i < loadedHeader.e_shnum && loadedHeader.e_shoff != 0; i++) {
+        fseek(elf, elfOffset + loadedHeader.e_shoff +
+            i * loadedHeader.e_shentsize, SEEK_SET);
+        if (fread(&sectionHeader, sizeof(sectionHeader), 1, elf) != 1) {
+            break;
+        }
+        if (sectionHeader.sh_type != SHT_SYMTAB ||
+            sectionHeader.sh_entsize < sizeof(*symbol) ||
+            sectionHeader.sh_link >= loadedHeader.e_shnum) {
+            continue;
+        }
+
+        /* The names are in the string table the symbol table links to */
+        fseek(elf, elfOffset + loadedHeader.e_shoff +
+            sectionHeader.sh_link * loadedHeader.e_shentsize, SEEK_SET);
+        if (fread(&strHeader, sizeof(strHeader), 1, elf) != 1 ||
+            strHeader.sh_size == 0) {
+            continue;
+        }
+        strings = malloc(strHeader.sh_size + 1);
+        panic(strings != NULL, ("No memory for the symbol names"));
+        fseek(elf, elfOffset + strHeader.sh_offset, SEEK_SET);
+        if (fread(strings, 1, strHeader.sh_size, elf) != strHeader.sh_size ||
+            (symbols = readSymbols(&sectionHeader)) == NULL) {
+            free(strings);
+            continue;
+        }
+        strings[strHeader.sh_size] = '\0';
+
+        /* Global functions first, then weak ones for the names left */
+        numSymbols = sectionHeader.sh_size / sectionHeader.sh_entsize;
+        for (bind = STB_GLOBAL; bind <= STB_WEAK; bind++) {
+            for (j = 0; j < numSymbols; j++) {
+                symbol = (const struct symTableEntry_t *)
+                    (symbols + j * sectionHeader.sh_entsize);
+                if (ELF32_ST_BIND(symbol->st_info) != bind ||
+                    symbol->st_name >= strHeader.sh_size ||
+                    !isFunction(symbol)) {
+                    continue;
+                }
+                for (k = 0; k < numNames; k++) {
+                    if (addrs[k] == 0 &&
+                        strcmp(strings + symbol->st_name, names[k]) == 0) {
+                        addrs[k] = symbol->st_value;
+                        found++;
+                    }
+                }
+            }
+        }
+        free(symbols);
+        free(strings);
+    }
+
+    debug(("Functions looked up in the symbol table: %u of %u\n", found,
+        numNames));
+    return found;
+}
+
+/*
+ * Load the ARM executable that starts at offset in elfFile.
+ *
+ * Return: Host address of the entry point, or NULL.
+ */
 uint32_t *
-armX86ElfLoad(char *elfFile)
+armX86ElfLoad(char *elfFile, long offset)
 {
     struct elfHeader_t elfHeader;
     struct programHeader_t *programHeader;
@@ -544,6 +958,8 @@ armX86ElfLoad(char *elfFile)
         return NULL;
     }
 
+    elfOffset = offset;
+    fseek(elf, elfOffset, SEEK_SET);
     parseElfHeader(elf, &elfHeader);
     debug(("Done parsing elf\n"));
 
@@ -568,7 +984,8 @@ armX86ElfLoad(char *elfFile)
 
     for (i = 0; i < elfHeader.e_phnum; i++) {
 	struct segment_t *newseg;
-        fseek(elf, elfHeader.e_phoff + i * elfHeader.e_phentsize, SEEK_SET);
+        fseek(elf, elfOffset + elfHeader.e_phoff + i * elfHeader.e_phentsize,
+            SEEK_SET);
         parseProgramHeader(elf, &programHeader[i]);
 
         newseg = createSegment(&programHeader[i]);
@@ -598,7 +1015,8 @@ armX86ElfLoad(char *elfFile)
      */
     initSegments();
 
-    entryPoint = (uint32_t *)elfHeader.e_entry;
+    loadedHeader = elfHeader;
+    entryPoint = ARM_HOST_ADDR(elfHeader.e_entry);
     goto out_done;
 
 out_unmap:
@@ -1,6 +1,14 @@
 #ifndef _ARMX86_ELFLOAD_H
 #define _ARMX86_ELFLOAD_H
 
-uint32_t* armX86ElfLoad(char *elfFile);
+uint32_t* armX86ElfLoad(char *elfFile, long offset);
+uint32_t armX86ElfTextSize(void);
+int armX86ElfIsText(uint32_t armAddr);
+int armX86ElfIsReadOnly(uint32_t armAddr, uint32_t size);
+uint32_t armX86ElfFunctions(uint32_t **functions);
+uint32_t armX86ElfLookup(const char *const *names, uint32_t numNames,
+    uint32_t *addrs);
+uint32_t armX86ElfHeap(uint32_t *size);
+uint64_t armX86ElfHash(void);
 
 #endif /* _ARMX86_ELFLOAD_H */
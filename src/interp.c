@@ -0,0 +1,583 @@
+#include <stdint.h>
+#include "debug.h"
+#include "decodeprivate.h"
+#include "codegen.h"
+#include "codeenv.h"
+
+/*
+// Interpreter
+//
+// Code that has not run often enough to be worth translating is run here
+// instead (see "Tiered execution" in decode.c). armX86Interpret() runs one
+// ARM block straight against armCpu and guest memory. Like a translated
+// block, it ends with the first instruction that may write the PC, whether
+// or not its condition holds, or after a given number of instructions.
+// The flags are read and written in armCpu.cpsr; the caller turns them
+// into the lazy flag record and back.
+//
+// Unlike the translator, the interpreter takes the whole ARMv5 integer
+// instruction set that user code uses, so a block the translator cannot
+// handle still runs. There is no coprocessor, so coprocessor instructions
+// are skipped, and software interrupts are ignored, as they are by the
+// translator, except for the system calls that end the program (see
+// SWI_EXIT). Anything else, such as Thumb code, ends the program with a
+// panic naming the instruction.
+*/
+#define GUEST_WORD(addr)        (*(uint32_t *)ARM_HOST_ADDR(addr))
+#define GUEST_HALF(addr)        (*(uint16_t *)ARM_HOST_ADDR(addr))
+#define GUEST_BYTE(addr)        (*(uint8_t *)ARM_HOST_ADDR(addr))
+
+#define REG(n)                  ((uint32_t *)armCpu.regFile)[n]
+
+#define UNSUPPORTED_AT(armInst, pc) panic(FALSE,                    \
+    ("Unsupported ARM instruction 0x%08x at 0x%x\n", (armInst), (pc)))
+
+#define FLAG_N                  (1 << CPSR_N_SHIFT)
+#define FLAG_Z                  (1 << CPSR_Z_SHIFT)
+#define FLAG_C                  (1 << CPSR_C_SHIFT)
+#define FLAG_V                  (1 << CPSR_V_SHIFT)
+
+#ifdef PROFILE
+uint32_t interpInsts;           /* ARM instructions interpreted */
+#endif /* PROFILE */
+
+/*
+// Value of register n as an operand of the instruction at pc, which reads
+// the PC 8 bytes ahead.
+*/
+static uint32_t readReg(uint32_t n, uint32_t pc){
+  return (n == 15)?pc + 8:REG(n);
+}
+
+static bool conditionPasses(uint32_t cond, uint32_t cpsr){
+  bool n = (cpsr & FLAG_N) != 0, z = (cpsr & FLAG_Z) != 0;
+  bool c = (cpsr & FLAG_C) != 0, v = (cpsr & FLAG_V) != 0;
+
+  switch(cond){
+    case COND_EQ: return z;
+    case COND_NE: return !z;
+    case COND_CS: return c;
+    case COND_CC: return !c;
+    case COND_MI: return n;
+    case COND_PL: return !n;
+    case COND_VS: return v;
+    case COND_VC: return !v;
+    case COND_HI: return c && !z;
+    case COND_LS: return !c || z;
+    case COND_GE: return n == v;
+    case COND_LT: return n != v;
+    case COND_GT: return !z && n == v;
+    case COND_LE: return z || n != v;
+    case AL: return TRUE;
+    default: return FALSE;
+  }
+}
+
+/*
+// Work out the shifter operand of a data processing instruction, and the
+// carry that comes out of the shifter.
+*/
+static uint32_t shifterOperand(uint32_t armInst, uint32_t pc, uint32_t *carry){
+  uint32_t rm, amount, rotate;
+
+  if(armInst & 0x02000000){
+    rotate = ROTATE(armInst) * 2;
+    rm = armInst & 0x000000FF;
+    if(rotate == 0){
+      return rm;
+    }
+    rm = (rm >> rotate) | (rm << (32 - rotate));
+    *carry = rm >> 31;
+    return rm;
+  }
+
+  rm = readReg(RM(armInst), pc);
+  if((armInst & 0x00000010) == 0){
+    amount = (armInst & SHIFT_AMT_MASK) >> SHIFT_AMT_SHIFT;
+    switch((armInst & SHIFT_TYPE_MASK) >> SHIFT_TYPE_SHIFT){
+      case LSL:
+        if(amount == 0){
+          return rm;
+        }
+        *carry = (rm >> (32 - amount)) & 1;
+        return rm << amount;
+      case LSR:
+        if(amount == 0){
+          *carry = rm >> 31;
+          return 0;
+        }
+        *carry = (rm >> (amount - 1)) & 1;
+        return rm >> amount;
+      case ASR:
+        if(amount == 0){
+          *carry = rm >> 31;
+          return (int32_t)rm >> 31;
+        }
+        *carry = (rm >> (amount - 1)) & 1;
+        return (int32_t)rm >> amount;
+      default:
+        if(amount == 0){ /* RRX */
+          amount = *carry;
+          *carry = rm & 1;
+          return (rm >> 1) | (amount << 31);
+        }
+        *carry = (rm >> (amount - 1)) & 1;
+        return (rm >> amount) | (rm << (32 - amount));
+    }
+  }
+
+  /* The PC reads 12 ahead when the shift comes from a register */
+  if(RM(armInst) == 15){
+    rm += 4;
+  }
+  amount = REG(RS(armInst)) & 0xFF;
+  if(amount == 0){
+    return rm;
+  }
+  switch((armInst & SHIFT_TYPE_MASK) >> SHIFT_TYPE_SHIFT){
+    case LSL:
+      *carry = (amount <= 32)?(rm >> (32 - amount)) & 1:0;
+      return (amount < 32)?rm << amount:0;
+    case LSR:
+      *carry = (amount <= 32)?(rm >> (amount - 1)) & 1:0;
+      return (amount < 32)?rm >> amount:0;
+    case ASR:
+      if(amount >= 32){
+        *carry = rm >> 31;
+        return (int32_t)rm >> 31;
+      }
+      *carry = (rm >> (amount - 1)) & 1;
+      return (int32_t)rm >> amount;
+    default:
+      amount &= 31;
+      if(amount == 0){
+        *carry = rm >> 31;
+        return rm;
+      }
+      *carry = (rm >> (amount - 1)) & 1;
+      return (rm >> amount) | (rm << (32 - amount));
+  }
+}
+
+/*
+// Data processing. An instruction that writes the PC leaves the new PC in
+// *next, as do all the instructions below.
+*/
+static void dataProcessing(uint32_t armInst, uint32_t pc, uint32_t *next){
+  uint32_t cpsr = armCpu.cpsr;
+  uint32_t carry = (cpsr & FLAG_C) != 0;
+  uint32_t overflow = (cpsr & FLAG_V) != 0;
+  uint32_t a, b, result;
+  uint64_t wide;
+  uint32_t opcode = (armInst & OPCODE_MASK) >> OPCODE_SHIFT;
+
+  b = shifterOperand(armInst, pc, &carry);
+  a = readReg(RN(armInst), pc);
+  if(RN(armInst) == 15 && (armInst & 0x02000010) == 0x00000010){
+    a += 4;
+  }
+
+  switch(opcode << OPCODE_SHIFT){
+    case OPCODE_AND:
+    case OPCODE_TST:
+      result = a & b;
+      break;
+    case OPCODE_EOR:
+    case OPCODE_TEQ:
+      result = a ^ b;
+      break;
+    case OPCODE_ORR:
+      result = a | b;
+      break;
+    case OPCODE_MOV:
+      result = b;
+      break;
+    case OPCODE_BIC:
+      result = a & ~b;
+      break;
+    case OPCODE_MVN:
+      result = ~b;
+      break;
+    case OPCODE_RSB:
+    case OPCODE_RSC:
+      result = a;
+      a = b;
+      b = result;
+      /* fall through */
+    case OPCODE_SUB:
+    case OPCODE_SBC:
+    case OPCODE_CMP:
+      wide = (uint64_t)a - b;
+      if(opcode == OPCODE_SBC >> OPCODE_SHIFT ||
+         opcode == OPCODE_RSC >> OPCODE_SHIFT){
+        wide -= ((cpsr & FLAG_C) == 0);
+      }
+      result = (uint32_t)wide;
+      carry = (wide >> 32) == 0;
+      overflow = ((a ^ b) & (a ^ result)) >> 31;
+      break;
+    default: /* ADD, ADC, CMN */
+      wide = (uint64_t)a + b;
+      if(opcode == OPCODE_ADC >> OPCODE_SHIFT){
+        wide += ((cpsr & FLAG_C) != 0);
+      }
+      result = (uint32_t)wide;
+      carry = (uint32_t)(wide >> 32);
+      overflow = (~(a ^ b) & (a ^ result)) >> 31;
+      break;
+  }
+
+  if(armInst & BIT20_MASK){
+    armCpu.cpsr = (cpsr & ~CPSR_FLAGS_MASK) | (result & FLAG_N) |
+      ((result == 0) << CPSR_Z_SHIFT) | (carry << CPSR_C_SHIFT) |
+      (overflow << CPSR_V_SHIFT);
+  }
+
+  /* Tests and compares write no register */
+  if((opcode & 0xC) == 0x8){
+    return;
+  }
+
+  if(RD(armInst) == 15){
+    *next = result & ~3;
+    return;
+  }
+  REG(RD(armInst)) = result;
+}
+
+/*
+// Multiplies, swaps, and the halfword, signed byte and doubleword
+// transfers, which share the encodings where bits 7 and 4 are both set.
+*/
+static void multiplyOrExtra(uint32_t armInst, uint32_t pc, uint32_t *next){
+  uint32_t rn = RN(armInst), rd = RD(armInst), addr, offset, value = 0;
+  uint64_t wide;
+
+  if((armInst & 0x0FC000F0) == 0x00000090){ /* MUL, MLA */
+    value = REG(RM(armInst)) * REG(RS(armInst));
+    if(armInst & BIT21_MASK){
+      value += REG(rd);
+    }
+    REG(rn) = value;
+    if(armInst & BIT20_MASK){
+      armCpu.cpsr = (armCpu.cpsr & ~(FLAG_N | FLAG_Z)) | (value & FLAG_N) |
+        ((value == 0) << CPSR_Z_SHIFT);
+    }
+    return;
+  }
+
+  if((armInst & 0x0F8000F0) == 0x00800090){ /* UMULL, UMLAL, SMULL, SMLAL */
+    if(armInst & BIT22_MASK){
+      wide = (uint64_t)((int64_t)(int32_t)REG(RM(armInst)) *
+        (int32_t)REG(RS(armInst)));
+    }else{
+      wide = (uint64_t)REG(RM(armInst)) * REG(RS(armInst));
+    }
+    if(armInst & BIT21_MASK){
+      wide += ((uint64_t)REG(rn) << 32) | REG(rd);
+    }
+    REG(rd) = (uint32_t)wide;
+    REG(rn) = (uint32_t)(wide >> 32);
+    if(armInst & BIT20_MASK){
+      armCpu.cpsr = (armCpu.cpsr & ~(FLAG_N | FLAG_Z)) |
+        ((uint32_t)(wide >> 32) & FLAG_N) | ((wide == 0) << CPSR_Z_SHIFT);
+    }
+    return;
+  }
+
+  if((armInst & 0x0FB00FF0) == 0x01000090){ /* SWP, SWPB */
+    addr = REG(rn);
+    if(armInst & BIT22_MASK){
+      value = GUEST_BYTE(addr);
+      GUEST_BYTE(addr) = (uint8_t)REG(RM(armInst));
+    }else{
+      value = GUEST_WORD(addr);
+      GUEST_WORD(addr) = REG(RM(armInst));
+    }
+    REG(rd) = value;
+    return;
+  }
+
+  if((armInst & 0x00000060) == 0){
+    UNSUPPORTED_AT(armInst, pc);
+    return;
+  }
+
+  offset = (armInst & BIT22_MASK)?
+    ((armInst & 0x00000F00) >> 4) | (armInst & 0x0000000F):
+    REG(RM(armInst));
+  addr = readReg(rn, pc);
+  if(armInst & BIT24_MASK){
+    addr += (armInst & BIT23_MASK)?offset:-offset;
+  }
+
+  switch(((armInst & BIT20_MASK) >> 18) | ((armInst & 0x00000060) >> 5)){
+    case 1: /* STRH */
+      GUEST_HALF(addr) = (uint16_t)readReg(rd, pc);
+      break;
+    case 2: /* LDRD */
+      REG(rd) = GUEST_WORD(addr);
+      REG(rd + 1) = GUEST_WORD(addr + 4);
+      break;
+    case 3: /* STRD */
+      GUEST_WORD(addr) = REG(rd);
+      GUEST_WORD(addr + 4) = REG(rd + 1);
+      break;
+    case 5: /* LDRH */
+      value = GUEST_HALF(addr);
+      break;
+    case 6: /* LDRSB */
+      value = (int32_t)(int8_t)GUEST_BYTE(addr);
+      break;
+    default: /* LDRSH */
+      value = (int32_t)(int16_t)GUEST_HALF(addr);
+      break;
+  }
+
+  if((armInst & BIT24_MASK) == 0){
+    addr += (armInst & BIT23_MASK)?offset:-offset;
+    REG(rn) = addr;
+  }else if(armInst & BIT21_MASK){
+    REG(rn) = addr;
+  }
+
+  if(armInst & BIT20_MASK){
+    if(rd == 15){
+      *next = value & ~3;
+      return;
+    }
+    REG(rd) = value;
+  }
+}
+
+/*
+// Status register transfers, BX, BLX and CLZ, which sit where the tests
+// and compares would have their S bit clear.
+*/
+static void miscellaneous(uint32_t armInst, uint32_t pc, uint32_t *next){
+  uint32_t value, carry, n;
+
+  if((armInst & MRS_MASK) == MRS_CPSR){
+    REG(RD(armInst)) = armCpu.cpsr;
+    return;
+  }
+
+  if((armInst & MSR_REG_MASK) == MSR_REG_CPSR ||
+     (armInst & MSR_IMM_MASK) == MSR_IMM_CPSR){
+    if((RN(armInst) & MSR_FIELD_F) != 0){
+      value = (armInst & 0x02000000)?shifterOperand(armInst, pc, &carry):
+        REG(RM(armInst));
+      armCpu.cpsr = (armCpu.cpsr & ~CPSR_FLAGS_MASK) |
+        (value & CPSR_FLAGS_MASK);
+    }
+    return;
+  }
+
+  if((armInst & 0x0FFFFFD0) == 0x012FFF10){ /* BX, BLX */
+    value = REG(RM(armInst));
+    panic((value & 1) == 0, ("Thumb code at 0x%x not supported\n", pc));
+    if(armInst & 0x00000020){
+      REG(14) = pc + 4;
+    }
+    *next = value;
+    return;
+  }
+
+  if((armInst & 0x0FFF0FF0) == 0x016F0F10){ /* CLZ */
+    value = REG(RM(armInst));
+    for(n = 0; n < 32 && (value & 0x80000000) == 0; n++){
+      value <<= 1;
+    }
+    REG(RD(armInst)) = n;
+    return;
+  }
+
+  UNSUPPORTED_AT(armInst, pc);
+}
+
+static void loadStore(uint32_t armInst, uint32_t pc, uint32_t *next){
+  uint32_t rn = RN(armInst), rd = RD(armInst), addr, offset, value = 0;
+  uint32_t carry = (armCpu.cpsr & FLAG_C) != 0;
+
+  if(armInst & 0x02000000){
+    /* A register offset is shifted by an immediate, like an operand */
+    offset = shifterOperand(armInst & ~0x02000010, pc, &carry);
+  }else{
+    offset = armInst & 0x00000FFF;
+  }
+
+  addr = readReg(rn, pc);
+  if(armInst & BIT24_MASK){
+    addr += (armInst & BIT23_MASK)?offset:-offset;
+  }
+
+  if(armInst & BIT20_MASK){
+    value = (armInst & BIT22_MASK)?GUEST_BYTE(addr):GUEST_WORD(addr);
+  }else if(armInst & BIT22_MASK){
+    GUEST_BYTE(addr) = (uint8_t)readReg(rd, pc);
+  }else{
+    GUEST_WORD(addr) = readReg(rd, pc);
+  }
+
+  if((armInst & BIT24_MASK) == 0){
+    addr += (armInst & BIT23_MASK)?offset:-offset;
+    REG(rn) = addr;
+  }else if(armInst & BIT21_MASK){
+    REG(rn) = addr;
+  }
+
+  if(armInst & BIT20_MASK){
+    if(rd == 15){
+      *next = value & ~3;
+      return;
+    }
+    REG(rd) = value;
+  }
+}
+
+static void loadStoreMultiple(uint32_t armInst, uint32_t pc, uint32_t *next){
+  uint32_t rn = RN(armInst), regList = armInst & 0x0000FFFF;
+  uint32_t base = REG(rn), addr, size, i;
+
+  size = 4 * __builtin_popcount(regList);
+  if(armInst & BIT23_MASK){
+    addr = base + ((armInst & BIT24_MASK)?4:0);
+  }else{
+    addr = base - size + ((armInst & BIT24_MASK)?0:4);
+  }
+
+  if(armInst & BIT21_MASK){
+    REG(rn) = (armInst & BIT23_MASK)?base + size:base - size;
+  }
+
+  for(i = 0; i < NUM_ARM_REGISTERS; i++){
+    if((regList & (1 << i)) == 0){
+      continue;
+    }
+    if((armInst & BIT20_MASK) == 0){
+      GUEST_WORD(addr) = (i == rn)?base:readReg(i, pc);
+    }else if(i == 15){
+      *next = GUEST_WORD(addr) & ~3;
+    }else{
+      REG(i) = GUEST_WORD(addr);
+    }
+    addr += 4;
+  }
+}
+
+/*
+// Tell whether an instruction may write the PC, and so ends a block.
+*/
+static bool mayWritePC(uint32_t armInst){
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+      if((armInst & 0x00000090) == 0x00000090){
+        return (armInst & BIT20_MASK) != 0 && (armInst & 0x00000060) != 0 &&
+          RD(armInst) == 15;
+      }
+      if((armInst & 0x01900000) == 0x01000000){
+        return (armInst & 0x0FFFFFD0) == 0x012FFF10;
+      }
+      /* fall through */
+    case INST_TYPE_IMM_UNDEF:
+      return RD(armInst) == 15 && (armInst & 0x01800000) != 0x01000000;
+    case INST_TYPE_LSIMM:
+    case INST_TYPE_LSR_UNDEF:
+      return (armInst & BIT20_MASK) != 0 && RD(armInst) == 15;
+    case INST_TYPE_LSMULT:
+      return (armInst & BIT20_MASK) != 0 && (armInst & 0x00008000) != 0;
+    case INST_TYPE_BRCH:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/*
+ * Interpret the ARM block at armAddr, for no more than maxInsts
+ * instructions.
+ *
+ * Return: ARM address of the block that follows, or 0 if the program ends.
+ */
+uint32_t
+armX86Interpret(uint32_t armAddr, uint32_t maxInsts)
+{
+    uint32_t pc = armAddr, next, armInst, offset;
+    bool ends = FALSE;
+
+    DP1("Interpreting block at 0x%x\n", armAddr);
+
+    while (ends == FALSE && maxInsts-- > 0) {
+        armInst = GUEST_WORD(pc);
+        next = pc + 4;
+        ends = mayWritePC(armInst);
+#ifdef PROFILE
+        interpInsts++;
+#endif /* PROFILE */
+
+        if (!conditionPasses(armInst >> COND_SHIFT, armCpu.cpsr)) {
+            if ((armInst & COND_MASK) == 0xF0000000) {
+                UNSUPPORTED_AT(armInst, pc);
+            }
+            pc = next;
+            continue;
+        }
+
+        switch (armInst & INST_TYPE_MASK) {
+            case INST_TYPE_DP_MISC:
+                if ((armInst & 0x00000090) == 0x00000090) {
+                    multiplyOrExtra(armInst, pc, &next);
+                } else if ((armInst & 0x01900000) == 0x01000000) {
+                    miscellaneous(armInst, pc, &next);
+                } else {
+                    dataProcessing(armInst, pc, &next);
+                }
+            break;
+            case INST_TYPE_IMM_UNDEF:
+                if ((armInst & 0x01900000) == 0x01000000) {
+                    miscellaneous(armInst, pc, &next);
+                } else {
+                    dataProcessing(armInst, pc, &next);
+                }
+            break;
+            case INST_TYPE_LSR_UNDEF:
+                if (armInst & 0x00000010) {
+                    UNSUPPORTED_AT(armInst, pc);
+                }
+                /* fall through */
+            case INST_TYPE_LSIMM:
+                loadStore(armInst, pc, &next);
+            break;
+            case INST_TYPE_LSMULT:
+                loadStoreMultiple(armInst, pc, &next);
+            break;
+            case INST_TYPE_BRCH:
+                offset = armInst & OFFSET_MASK;
+                offset |= ((offset & 0x00800000) > 0)?0xFF000000:0x00000000;
+                if (armInst & BIT24_MASK) {
+                    REG(14) = pc + 4;
+                }
+                next = pc + 8 + (offset << 2);
+            break;
+            case INST_TYPE_COPLS:
+                DP1("Skipping coprocessor load/store 0x%08x\n", armInst);
+            break;
+            case INST_TYPE_COP_SWI:
+                if ((armInst & BIT24_MASK) == 0) {
+                    DP1("Skipping coprocessor instruction 0x%08x\n",
+                        armInst);
+                } else if (SWI_EXIT(armInst, REG(7))) {
+                    DP("Exit system call\n");
+                    return 0;
+                } else {
+                    DP("IGNORING Software Interrupt\n");
+                }
+            break;
+        }
+
+        DP2("0x%x: 0x%08x\n", pc, armInst);
+        pc = next;
+    }
+
+    return pc;
+}
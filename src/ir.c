@@ -0,0 +1,996 @@
+#include <stdint.h>
+#include <string.h>
+#include "debug.h"
+#include "decodeprivate.h"
+#include "codegen.h"
+
+/*
+// Intermediate representation
+//
+// The handlers in alu.c and decode.c translate one ARM instruction at a
+// time straight to x86, each moving its operands in and out of the homes
+// of the ARM registers (a host register, or armCpu.regFile) through EAX
+// and EDX. Consecutive instructions that the IR covers are instead built
+// by irAdd() into a region of operations on values, one value for each
+// operation, in the order the ARM instructions have them:
+//
+//   ldr r3, [fp, #-24]     v0 = get fp; v1 = load [v0 - 24]; put r3, v1
+//   add r3, r3, #1         v3 = get r3; v4 = const 1; v5 = add v3, v4;
+//                          put r3, v5
+//   str r3, [fp, #-24]     v7 = get fp; v8 = get r3; store [v7 - 24], v8
+//
+// When an instruction the IR does not cover comes up, irLower() runs the
+// passes over the region and lowers it to x86:
+//
+//   - Propagation: a get of a register that a value got or put earlier in
+//     the region already holds is replaced by that value, which both
+//     drops the reload and propagates the copy.
+//   - Dead stores: a put that is followed by another put to the same
+//     register, with no get of it in between, is dropped. Only the last
+//     value of each register reaches its home.
+//   - Dead values: an operation whose value is no longer used is dropped.
+//     Loads of guest memory are kept, as they may fault.
+//
+// The region above is left with v0 = get fp; v1 = load [v0 - 24];
+// v5 = add v1, 1; store [v0 - 24], v5; put r3, v5. A value that is put to
+// a register with a host home is computed right there, so with fp and r3
+// in r13 and r11 that is
+//
+//   mov r11d, [rsi + r13 - 24]
+//   add r11d, 1
+//   mov [rsi + r13 - 24], r11d
+//
+// where the handlers take nine instructions. Other values are kept in
+// EAX, ECX and EDX, or in the home of the register they were got from,
+// and spilled to irSpill, below 2GB with the rest of the translator's
+// data, should they not fit. EBX is left alone, as it may hold a
+// branchless condition (see "Branchless conditions" in decode.c). A region
+// has no exits or branches in it, so the lowering is a single pass in
+// order.
+//
+// Constants are folded as the region is built. The registers that hold a
+// known value are tracked from the start of the block, across regions,
+// until an instruction the IR does not cover writes them (see
+// irForget()). A read of one of them is that value, and an operation on
+// nothing but constants is one itself, so that
+//
+//   mov r2, #0x1000        put r2, 0x1000
+//   add r2, r2, #4         put r2, 0x1004
+//   ldr r3, [pc, #12]      put r3, 0x12345678
+//
+// where the literal, in a segment that cannot be written, is read at
+// translation time (see readOnlyLoad() in decode.c).
+//
+// Addressing is folded into the x86 operands before lowering. A load or
+// store off a base plus a constant takes the constant as its displacement,
+// and a sum with a register shifted left by 1 to 3, as in array indexing,
+// becomes a lea:
+//
+//   add r3, r1, r2, lsl #2       lea eax, [r9 + r10*4]
+//   ldr r0, [r3, #8]             mov r8d, [rsi + rax + 8]
+//
+// The IR covers data processing that does not set the flags or read the
+// carry, with an immediate or a register shifted by an immediate, and
+// loads and stores of words and bytes with an immediate offset or a
+// register shifted by an immediate. The rest,
+// and anything conditional, goes to the handlers as before. The IR is held
+// in a fixed arena that is reset for every region and block, so
+// translation allocates nothing.
+*/
+#define IR_MAX_OPS              512
+#define IR_MAX_INST_OPS         8       /* Most an ARM instruction builds */
+#define IR_NONE                 0xFFFF
+
+/* Operations */
+#define IR_NOP                  0       /* Dropped by a pass */
+#define IR_GET                  1       /* ARM register arm */
+#define IR_PUT                  2       /* ARM register arm = src[0] */
+#define IR_CONST                3       /* imm */
+#define IR_ALU                  4       /* src[0] kind src[1] */
+#define IR_SHIFT                5       /* src[0] shifted as kind by imm */
+#define IR_NOT                  6       /* ~src[0] */
+#define IR_LOAD                 7       /* [src[0] + imm], of size kind */
+#define IR_STORE                8       /* [src[0] + imm] = src[1] */
+#define IR_LEA                  9       /* src[0] + src[1] << imm */
+
+/*
+// Kinds of IR_ALU and IR_SHIFT. They are the x86 opcode extensions of the
+// operations, which the lowering uses as they are.
+*/
+#define IR_ADD                  0
+#define IR_OR                   1
+#define IR_AND                  4
+#define IR_SUB                  5
+#define IR_XOR                  6
+#define IR_ROR                  1
+#define IR_LSL                  4
+#define IR_LSR                  5
+#define IR_ASR                  7
+
+/* Kinds of IR_LOAD and IR_STORE */
+#define IR_WORD                 0
+#define IR_BYTE                 1
+
+/* Where the lowering keeps a value, other than in a host register */
+#define IR_LOC_HOME             0x10    /* The regFile slot of arm */
+#define IR_LOC_SPILL            0x11    /* Its slot of irSpill */
+#define IR_LOC_CONST            0x12    /* Nowhere yet: imm */
+
+struct irOp_t{
+  uint8_t op;
+  uint8_t kind;
+  uint8_t arm;          /* ARM register of IR_GET and IR_PUT */
+  uint8_t loc;          /* Where the lowering keeps the value */
+  uint16_t src[2];      /* Operand values, by index in irOps */
+  int32_t imm;
+};
+
+static struct irOp_t irOps[IR_MAX_OPS];
+static uint32_t irCount;
+static uint16_t irLastUse[IR_MAX_OPS];  /* Last operation to use each value */
+static uint16_t irHolder[X86_R15 + 1];  /* Value each host register holds */
+static uint16_t irHomeValue[NUM_ARM_REGISTERS]; /* Value left in regFile */
+static uint32_t irPos;                  /* Operation being lowered */
+static uint16_t irConstRegs;            /* ARM registers of known value */
+static uint32_t irConstValue[NUM_ARM_REGISTERS];
+uint32_t irSpill[IR_MAX_OPS];
+
+static const uint8_t irScratch[] = { X86_EAX, X86_ECX, X86_EDX };
+
+#ifdef PROFILE
+uint32_t irInsts;               /* ARM instructions built into the IR */
+uint32_t irRegions;             /* Regions lowered */
+uint32_t irGets;                /* Register reads built */
+uint32_t irGetsDropped;         /* Of those, replaced by a value */
+uint32_t irPuts;                /* Register writes built */
+uint32_t irPutsDropped;         /* Of those, dead */
+uint32_t irSpills;              /* Values spilled in lowering */
+uint32_t irFolds;               /* Reads and operations folded to constants */
+#endif /* PROFILE */
+
+/*
+// Building
+*/
+static uint16_t irEmit(uint8_t op, uint8_t kind, uint16_t a, uint16_t b,
+                       int32_t imm){
+  struct irOp_t *ir = &irOps[irCount];
+
+  ir->op = op;
+  ir->kind = kind;
+  ir->arm = 0;
+  ir->src[0] = a;
+  ir->src[1] = b;
+  ir->imm = imm;
+  return irCount++;
+}
+
+static uint16_t irConst(uint32_t imm){
+  return irEmit(IR_CONST, 0, IR_NONE, IR_NONE, imm);
+}
+
+static bool irIsConst(uint16_t v){
+  return (irOps[v].op == IR_CONST);
+}
+
+/*
+// The value of ARM register arm, read by the instruction at pArmAddr. The
+// PC reads as the address of the instruction plus 8.
+*/
+static uint16_t irGet(uint8_t arm, const uint32_t *pArmAddr){
+  uint16_t v;
+
+  if(arm == 15){
+    return irConst((uint32_t)(uintptr_t)((const uint8_t *)pArmAddr + 8));
+  }
+  if(irConstRegs & (1 << arm)){
+#ifdef PROFILE
+    irFolds++;
+#endif /* PROFILE */
+    return irConst(irConstValue[arm]);
+  }
+  v = irEmit(IR_GET, 0, IR_NONE, IR_NONE, 0);
+  irOps[v].arm = arm;
+#ifdef PROFILE
+  irGets++;
+#endif /* PROFILE */
+  return v;
+}
+
+static void irPut(uint8_t arm, uint16_t v){
+  irOps[irEmit(IR_PUT, 0, v, IR_NONE, 0)].arm = arm;
+  if(irIsConst(v) == TRUE){
+    irConstRegs |= (1 << arm);
+    irConstValue[arm] = irOps[v].imm;
+  }else{
+    irConstRegs &= ~(1 << arm);
+  }
+#ifdef PROFILE
+  irPuts++;
+#endif /* PROFILE */
+}
+
+/*
+// Operations, folded if their operands are constants.
+*/
+static uint16_t irAlu(uint8_t kind, uint16_t a, uint16_t b){
+  uint32_t x, y;
+
+  if(irIsConst(a) == FALSE || irIsConst(b) == FALSE){
+    return irEmit(IR_ALU, kind, a, b, 0);
+  }
+  x = irOps[a].imm;
+  y = irOps[b].imm;
+#ifdef PROFILE
+  irFolds++;
+#endif /* PROFILE */
+  switch(kind){
+    case IR_ADD: return irConst(x + y);
+    case IR_OR: return irConst(x | y);
+    case IR_AND: return irConst(x & y);
+    case IR_SUB: return irConst(x - y);
+    default: return irConst(x ^ y);
+  }
+}
+
+static uint16_t irShift(uint8_t kind, uint16_t a, uint8_t amount){
+  uint32_t x;
+
+  if(irIsConst(a) == FALSE){
+    return irEmit(IR_SHIFT, kind, a, IR_NONE, amount);
+  }
+  x = irOps[a].imm;
+#ifdef PROFILE
+  irFolds++;
+#endif /* PROFILE */
+  switch(kind){
+    case IR_LSL: return irConst(x << amount);
+    case IR_LSR: return irConst(x >> amount);
+    case IR_ASR: return irConst((uint32_t)((int32_t)x >> amount));
+    default: return irConst((x >> amount) | (x << ((32 - amount) & 31)));
+  }
+}
+
+static uint16_t irNot(uint16_t a){
+  if(irIsConst(a) == FALSE){
+    return irEmit(IR_NOT, 0, a, IR_NONE, 0);
+  }
+#ifdef PROFILE
+  irFolds++;
+#endif /* PROFILE */
+  return irConst(~irOps[a].imm);
+}
+
+/*
+// Rm shifted by an immediate, the second operand of data processing and
+// the offset of loads and stores. A shift of 0 stands for LSR #32 and
+// ASR #32, and for RRX, which is not covered (see IR_RRX).
+*/
+#define IR_RRX(x)       (((x) & (SHIFT_TYPE_MASK | SHIFT_AMT_MASK)) ==\
+                         (ROR << SHIFT_TYPE_SHIFT))
+
+static uint16_t irShifted(uint32_t armInst, const uint32_t *pArmAddr){
+  static const uint8_t shiftKinds[] = { IR_LSL, IR_LSR, IR_ASR, IR_ROR };
+  uint8_t shiftType = (armInst & SHIFT_TYPE_MASK) >> SHIFT_TYPE_SHIFT;
+  uint8_t shiftAmt = (armInst & SHIFT_AMT_MASK) >> SHIFT_AMT_SHIFT;
+  uint16_t v;
+
+  if(shiftAmt == 0 && shiftType == LSR){
+    return irConst(0);
+  }
+  v = irGet(RM(armInst), pArmAddr);
+  if(shiftAmt != 0 || shiftType == ASR){
+    v = irShift(shiftKinds[shiftType], v, (shiftAmt == 0)?31:shiftAmt);
+  }
+  return v;
+}
+
+/*
+// Data processing: the second operand is a rotated immediate, or Rm
+// shifted by an immediate.
+*/
+static bool irDataProcessing(uint32_t armInst, const uint32_t *pArmAddr){
+  uint32_t opcode = armInst & OPCODE_MASK;
+  bool immediate = ((armInst & INST_TYPE_MASK) == INST_TYPE_IMM_UNDEF);
+  uint16_t a = IR_NONE, b, v;
+
+  if((armInst & BIT20_MASK) || RD(armInst) == 15){
+    return FALSE;
+  }
+  switch(opcode){
+    case OPCODE_AND: case OPCODE_EOR: case OPCODE_SUB: case OPCODE_RSB:
+    case OPCODE_ADD: case OPCODE_ORR: case OPCODE_MOV: case OPCODE_BIC:
+    case OPCODE_MVN:
+    break;
+    default:
+      return FALSE;
+  }
+  if(immediate == FALSE && ((armInst & 0x00000010) || IR_RRX(armInst))){
+    return FALSE;
+  }
+
+  if(opcode != OPCODE_MOV && opcode != OPCODE_MVN){
+    a = irGet(RN(armInst), pArmAddr);
+  }
+  if(immediate == TRUE){
+    b = irConst(ROTATED_IMM(armInst));
+  }else{
+    b = irShifted(armInst, pArmAddr);
+  }
+
+  switch(opcode){
+    case OPCODE_AND: v = irAlu(IR_AND, a, b); break;
+    case OPCODE_EOR: v = irAlu(IR_XOR, a, b); break;
+    case OPCODE_SUB: v = irAlu(IR_SUB, a, b); break;
+    case OPCODE_RSB: v = irAlu(IR_SUB, b, a); break;
+    case OPCODE_ADD: v = irAlu(IR_ADD, a, b); break;
+    case OPCODE_ORR: v = irAlu(IR_OR, a, b); break;
+    case OPCODE_MOV: v = b; break;
+    case OPCODE_BIC: v = irAlu(IR_AND, a, irNot(b)); break;
+    default: v = irNot(b); break;
+  }
+  irPut(RD(armInst), v);
+
+  return TRUE;
+}
+
+/*
+// Loads and stores with an immediate offset, or Rm shifted by an
+// immediate. The offset is applied to the address before the access (P) or
+// to the base after it, and written back to the base if W or after. Forms
+// that write the PC, or load into their base register with writeback, are
+// not covered.
+*/
+static bool irLoadStore(uint32_t armInst, const uint32_t *pArmAddr){
+  bool load = ((armInst & BIT20_MASK) != 0);
+  bool pre = ((armInst & BIT24_MASK) != 0);
+  bool writeback = (pre == FALSE || (armInst & BIT21_MASK) != 0);
+  bool immediate = ((armInst & INST_TYPE_MASK) == INST_TYPE_LSIMM);
+  uint8_t kind = (armInst & BIT22_MASK)?IR_BYTE:IR_WORD;
+  int32_t offset = armInst & 0x00000FFF;
+  uint32_t value;
+  uint16_t base, address, access, v = IR_NONE;
+
+  if(RD(armInst) == 15 ||
+     (writeback == TRUE && (RN(armInst) == 15 || RN(armInst) == RD(armInst))) ||
+     (immediate == FALSE && IR_RRX(armInst))){
+    return FALSE;
+  }
+  if((armInst & BIT23_MASK) == 0){
+    offset = -offset;
+  }
+
+  /*
+  // The access is at a value, which irAddressing() folds into the x86
+  // operand where it can.
+  */
+  base = irGet(RN(armInst), pArmAddr);
+  if(immediate == TRUE){
+    address = irAlu(IR_ADD, base, irConst(offset));
+  }else{
+    address = irAlu((armInst & BIT23_MASK)?IR_ADD:IR_SUB, base,
+      irShifted(armInst, pArmAddr));
+  }
+  access = pre?address:base;
+  if(load == TRUE){
+    if(irIsConst(access) == TRUE &&
+       readOnlyLoad(irOps[access].imm, (kind == IR_BYTE)?1:4,
+         &value) == TRUE){
+#ifdef PROFILE
+      irFolds++;
+#endif /* PROFILE */
+      v = irConst(value);
+    }else{
+      v = irEmit(IR_LOAD, kind, access, IR_NONE, 0);
+    }
+  }else{
+    irEmit(IR_STORE, kind, access, irGet(RD(armInst), pArmAddr), 0);
+  }
+  if(writeback == TRUE){
+    irPut(RN(armInst), address);
+  }
+  if(load == TRUE){
+    irPut(RD(armInst), v);
+  }
+
+  return TRUE;
+}
+
+/*
+// Add the unconditional ARM instruction at pArmAddr to the region, if the
+// IR covers it. Returns FALSE, having added nothing, if it does not.
+*/
+bool irAdd(uint32_t armInst, const uint32_t *pArmAddr){
+  bool added;
+
+  if((armInst & COND_MASK) != COND_AL ||
+     irCount + IR_MAX_INST_OPS > IR_MAX_OPS){
+    return FALSE;
+  }
+
+  switch(armInst & INST_TYPE_MASK){
+    case INST_TYPE_DP_MISC:
+    case INST_TYPE_IMM_UNDEF:
+      /* Not multiplies, extra loads and stores, or the miscellaneous ones */
+      if((armInst & 0x01900000) == 0x01000000 ||
+         ((armInst & INST_TYPE_MASK) == INST_TYPE_DP_MISC &&
+          (armInst & 0x00000090) == 0x00000090)){
+        return FALSE;
+      }
+      added = irDataProcessing(armInst, pArmAddr);
+    break;
+    case INST_TYPE_LSR_UNDEF:
+      if(armInst & 0x00000010){
+        return FALSE;
+      }
+      /* fall through */
+    case INST_TYPE_LSIMM:
+      added = irLoadStore(armInst, pArmAddr);
+    break;
+    default:
+      return FALSE;
+  }
+
+#ifdef PROFILE
+  irInsts += added;
+#endif /* PROFILE */
+  DP2("IR: 0x%x, %u operations so far\n", armInst, irCount);
+  return added;
+}
+
+void irReset(void){
+  irCount = 0;
+  irConstRegs = 0;
+}
+
+/*
+// An instruction the IR does not cover may write the ARM registers regs.
+// Their values are no longer known.
+*/
+void irForget(uint16_t regs){
+  irConstRegs &= ~regs;
+}
+
+/*
+// Passes
+*/
+static void irPropagate(void){
+  uint16_t value[NUM_ARM_REGISTERS];
+  uint16_t replace[IR_MAX_OPS];
+  struct irOp_t *ir;
+  uint32_t i, s;
+
+  memset(value, 0xFF, sizeof(value));
+  for(i = 0; i < irCount; i++){
+    ir = &irOps[i];
+    replace[i] = i;
+    for(s = 0; s < 2; s++){
+      if(ir->src[s] != IR_NONE){
+        ir->src[s] = replace[ir->src[s]];
+      }
+    }
+
+    if(ir->op == IR_GET){
+      if(value[ir->arm] != IR_NONE){
+        replace[i] = value[ir->arm];
+        ir->op = IR_NOP;
+#ifdef PROFILE
+        irGetsDropped++;
+#endif /* PROFILE */
+      }else{
+        value[ir->arm] = i;
+      }
+    }else if(ir->op == IR_PUT){
+      value[ir->arm] = ir->src[0];
+    }
+  }
+}
+
+static void irDeadStores(void){
+  bool overwritten[NUM_ARM_REGISTERS];
+  struct irOp_t *ir;
+  int32_t i;
+
+  memset(overwritten, 0, sizeof(overwritten));
+  for(i = irCount - 1; i >= 0; i--){
+    ir = &irOps[i];
+    if(ir->op == IR_PUT){
+      if(overwritten[ir->arm] == TRUE){
+        ir->op = IR_NOP;
+#ifdef PROFILE
+        irPutsDropped++;
+#endif /* PROFILE */
+      }
+      overwritten[ir->arm] = TRUE;
+    }else if(ir->op == IR_GET){
+      overwritten[ir->arm] = FALSE;
+    }
+  }
+}
+
+/*
+// A load or store at x + c, or x - c, for a constant c, is made one at x
+// with a displacement. A sum x + y << 1..3 is made a lea, which scales y
+// as it adds. What is left of the sums and shifts is dropped as dead.
+*/
+static void irAddressing(void){
+  struct irOp_t *ir, *src;
+  uint32_t i;
+
+  for(i = 0; i < irCount; i++){
+    ir = &irOps[i];
+    if(ir->op == IR_ALU && ir->kind == IR_ADD){
+      src = &irOps[ir->src[1]];
+      if(src->op == IR_SHIFT && src->kind == IR_LSL && src->imm <= 3){
+        ir->op = IR_LEA;
+        ir->src[1] = src->src[0];
+        ir->imm = src->imm;
+      }
+    }else if(ir->op == IR_LOAD || ir->op == IR_STORE){
+      src = &irOps[ir->src[0]];
+      if(src->op == IR_ALU && (src->kind == IR_ADD || src->kind == IR_SUB) &&
+         irIsConst(src->src[1]) == TRUE){
+        ir->imm += (src->kind == IR_ADD)?irOps[src->src[1]].imm:
+          -irOps[src->src[1]].imm;
+        ir->src[0] = src->src[0];
+      }
+    }
+  }
+}
+
+static void irDeadValues(void){
+  bool used[IR_MAX_OPS];
+  struct irOp_t *ir;
+  int32_t i, s;
+
+  memset(used, 0, irCount * sizeof(bool));
+  for(i = irCount - 1; i >= 0; i--){
+    ir = &irOps[i];
+    switch(ir->op){
+      case IR_GET: case IR_CONST: case IR_ALU: case IR_SHIFT: case IR_NOT:
+      case IR_LEA:
+        if(used[i] == FALSE){
+          ir->op = IR_NOP;
+        }
+      break;
+      default:
+      break;
+    }
+    if(ir->op != IR_NOP){
+      for(s = 0; s < 2; s++){
+        if(ir->src[s] != IR_NONE){
+          used[ir->src[s]] = TRUE;
+        }
+      }
+    }
+  }
+}
+
+/*
+// Lowering
+//
+// Emitters of x86 code for irLower(). Each emits at pX86Addr and returns
+// the size of what it emitted.
+*/
+
+/*
+// Emit op, whose reg field is reg, with value v as the r/m operand, from
+// wherever v is other than a constant.
+*/
+static uint8_t irOperand(uint8_t *pX86Addr, uint8_t op, uint8_t reg,
+                         uint16_t v){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+  uint8_t loc = irOps[v].loc;
+
+  instInfo.pX86Addr = pX86Addr;
+  if(loc == IR_LOC_HOME){
+    ADD_REX(0,reg,0);
+    ADD_BYTE(op);
+    CPU_OPERAND(reg,REGFILE_DISP(irOps[v].arm));
+  }else if(loc == IR_LOC_SPILL){
+    ADD_REX(0,reg,0);
+    ADD_BYTE(op);
+    ADD_ABSOLUTE((reg & 7) << 3,&irSpill[v]);
+  }else{
+    ADD_REX(0,reg,loc);
+    ADD_BYTE(op);
+    ADD_BYTE(0xC0 | ((reg & 7) << 3) | (loc & 7));
+  }
+  return count;
+}
+
+/*
+// Emit op, whose reg field is reg, with guest memory at the ARM address in
+// host register base plus disp as the r/m operand: [rsi + base + disp32].
+// escape puts 0F before op. byteReg says reg is a byte register, which
+// takes a REX prefix to be SIL or DIL rather than DH or BH.
+*/
+static uint8_t irGuestOperand(uint8_t *pX86Addr, bool escape, uint8_t op,
+                              uint8_t reg, uint8_t base, int32_t disp,
+                              bool byteReg){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+  uint8_t rex = X86_PRE_REX;
+
+  instInfo.pX86Addr = pX86Addr;
+  if(reg >= X86_R8){
+    rex |= X86_REX_R;
+  }
+  if(base >= X86_R8){
+    rex |= X86_REX_X;
+  }
+  if(rex != X86_PRE_REX || (byteReg == TRUE && (reg & 7) >= X86_ESP)){
+    ADD_BYTE(rex);
+  }
+  if(escape == TRUE){
+    ADD_BYTE(X86_PRE_JCC);
+  }
+  ADD_BYTE(op);
+  ADD_BYTE(0x84 | ((reg & 7) << 3)); /* SIB + disp32 */
+  ADD_BYTE(((base & 7) << 3) | X86_ESI); /* SIB - rsi + base */
+  ADD_WORD(disp);
+  return count;
+}
+
+/*
+// Move value v into host register reg.
+*/
+static uint8_t irMove(uint8_t *pX86Addr, uint8_t reg, uint16_t v){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+
+  instInfo.pX86Addr = pX86Addr;
+  if(irOps[v].loc == reg){
+    return 0;
+  }
+  if(irOps[v].loc == IR_LOC_CONST){
+    ADD_REX(0,0,reg);
+    ADD_BYTE(X86_OP_MOV_IMM_TO_EAX + (reg & 7));
+    ADD_WORD(irOps[v].imm);
+    return count;
+  }
+  return irOperand(pX86Addr, X86_OP_MOV_TO_REG, reg, v);
+}
+
+/*
+// Is host register reg free for the value of the operation being lowered?
+// The value it holds may be an operand that is last used here, unless it
+// is to be read after reg is written.
+*/
+static bool irFree(uint8_t reg, uint16_t avoid){
+  uint16_t v = irHolder[reg];
+
+  return (v == IR_NONE || irLastUse[v] < irPos ||
+    (irLastUse[v] == irPos && (avoid & (1 << reg)) == 0));
+}
+
+static void irHold(uint8_t reg, uint16_t v){
+  irHolder[reg] = v;
+  irOps[v].loc = reg;
+}
+
+/*
+// Take a scratch register for a value, spilling the value needed last if
+// none is free. The operands of the operation being lowered stay.
+*/
+static uint8_t irTake(uint8_t **ppX86Addr, uint16_t avoid){
+  struct irOp_t *ir = &irOps[irPos];
+  uint8_t reg, victim = X86_NOREG;
+  uint16_t v;
+  uint32_t i;
+
+  for(i = 0; i < sizeof(irScratch); i++){
+    if(irFree(irScratch[i], avoid) == TRUE){
+      return irScratch[i];
+    }
+  }
+
+  for(i = 0; i < sizeof(irScratch); i++){
+    reg = irScratch[i];
+    v = irHolder[reg];
+    if(v != ir->src[0] && v != ir->src[1] &&
+       (victim == X86_NOREG || irLastUse[v] > irLastUse[irHolder[victim]])){
+      victim = reg;
+    }
+  }
+  DP_ASSERT(victim != X86_NOREG, "IR out of registers\n");
+
+  v = irHolder[victim];
+  DP2("IR: spilling v%u from %u\n", v, victim);
+  irOps[v].loc = IR_LOC_SPILL;
+  *ppX86Addr += irOperand(*ppX86Addr, X86_OP_MOV_FROM_REG, victim, v);
+  irHolder[victim] = IR_NONE;
+#ifdef PROFILE
+  irSpills++;
+#endif /* PROFILE */
+  return victim;
+}
+
+/*
+// Make sure value v is in a host register, and return it.
+*/
+static uint8_t irInReg(uint8_t **ppX86Addr, uint16_t v, uint16_t avoid){
+  uint8_t reg = irOps[v].loc;
+
+  if(reg <= X86_R15){
+    return reg;
+  }
+  if(reg == IR_LOC_HOME){
+    irHomeValue[irOps[v].arm] = IR_NONE;
+  }
+  reg = irTake(ppX86Addr, avoid);
+  *ppX86Addr += irMove(*ppX86Addr, reg, v);
+  irHold(reg, v);
+  return reg;
+}
+
+/*
+// The host register to compute value v in: the home of the register it is
+// put to next, if that is a host register and nothing still needed is in
+// it, or else a scratch register.
+*/
+static uint8_t irTarget(uint8_t **ppX86Addr, uint16_t v, uint16_t avoid){
+  uint8_t home;
+  uint32_t i;
+
+  for(i = v + 1; i < irCount; i++){
+    if(irOps[i].op != IR_NOP &&
+       (irOps[i].src[0] == v || irOps[i].src[1] == v)){
+      break;
+    }
+  }
+  if(i < irCount && irOps[i].op == IR_PUT){
+    home = armHostReg[irOps[i].arm];
+    if(home != X86_NOREG && irFree(home, avoid) == TRUE){
+      return home;
+    }
+  }
+  return irTake(ppX86Addr, avoid);
+}
+
+static uint16_t irRegMask(uint16_t v){
+  return (v != IR_NONE && irOps[v].loc <= X86_R15)?(1 << irOps[v].loc):0;
+}
+
+/*
+// Put value v to ARM register arm. Whatever is still needed in the home
+// of arm is moved out of the way first.
+*/
+static uint8_t irStoreReg(uint8_t *pX86Addr, uint8_t arm, uint16_t v){
+  struct decodeInfo_t instInfo;
+  uint8_t *pStart = pX86Addr;
+  uint8_t count = 0;
+  uint8_t home = armHostReg[arm], reg;
+  uint16_t held;
+
+  armHostDirty |= (1 << arm);
+  if(home != X86_NOREG){
+    if(irOps[v].loc == home){
+      return 0;
+    }
+    held = irHolder[home];
+    if(held != IR_NONE && held != v && irLastUse[held] > irPos){
+      reg = irTake(&pX86Addr, irRegMask(v));
+      pX86Addr += irMove(pX86Addr, reg, held);
+      irHold(reg, held);
+    }
+    pX86Addr += irMove(pX86Addr, home, v);
+    irHolder[home] = IR_NONE;
+    return pX86Addr - pStart;
+  }
+
+  if(irOps[v].loc == IR_LOC_HOME && irOps[v].arm == arm){
+    return 0;
+  }
+  held = irHomeValue[arm];
+  if(held != IR_NONE && held != v && irLastUse[held] > irPos){
+    irInReg(&pX86Addr, held, irRegMask(v));
+  }
+  irHomeValue[arm] = IR_NONE;
+
+  if(irOps[v].loc == IR_LOC_CONST){
+    instInfo.pX86Addr = pX86Addr;
+    ADD_BYTE(X86_OP_MOV_IMM_TO_MEM32);
+    CPU_OPERAND(0,REGFILE_DISP(arm)); /* mov imm32 to rm32 0xC7 /0 */
+    ADD_WORD(irOps[v].imm);
+    return pX86Addr + count - pStart;
+  }
+  reg = irInReg(&pX86Addr, v, 0);
+  instInfo.pX86Addr = pX86Addr;
+  ADD_REX(0,reg,0);
+  ADD_BYTE(X86_OP_MOV_FROM_REG);
+  CPU_OPERAND(reg,REGFILE_DISP(arm));
+  return pX86Addr + count - pStart;
+}
+
+/*
+// Emit the ALU operation kind on host register reg and value v.
+*/
+static uint8_t irAluOp(uint8_t *pX86Addr, uint8_t kind, uint8_t reg,
+                       uint16_t v){
+  struct decodeInfo_t instInfo;
+  uint8_t count = 0;
+  int32_t imm = irOps[v].imm;
+
+  if(irOps[v].loc != IR_LOC_CONST){
+    return irOperand(pX86Addr, X86_OP_ALU_RM32_TO_REG + (kind << 3), reg, v);
+  }
+
+  instInfo.pX86Addr = pX86Addr;
+  ADD_REX(0,0,reg);
+  if(imm >= -128 && imm <= 127){
+    ADD_BYTE(X86_OP_ALU_IMM8_RM32);
+    ADD_BYTE(0xC0 | (kind << 3) | (reg & 7));
+    ADD_BYTE(imm);
+  }else{
+    ADD_BYTE(X86_OP_ALU_IMM32_RM32);
+    ADD_BYTE(0xC0 | (kind << 3) | (reg & 7));
+    ADD_WORD(imm);
+  }
+  return count;
+}
+
+#ifdef DEBUG
+static void irDump(void){
+  static const char *names[] = {
+    "nop", "get", "put", "const", "alu", "shift", "not", "load", "store",
+    "lea"
+  };
+  struct irOp_t *ir;
+  uint32_t i;
+
+  for(i = 0; i < irCount; i++){
+    ir = &irOps[i];
+    if(ir->op != IR_NOP){
+      printf("  v%u = %s/%u r%u v%d v%d #%d\n", i, names[ir->op], ir->kind,
+        ir->arm, (int16_t)ir->src[0], (int16_t)ir->src[1], ir->imm);
+    }
+  }
+}
+#endif /* DEBUG */
+
+/*
+// Run the passes over the region built so far, emit its x86 code at
+// pX86Addr, and start a new region. Returns the size of the code.
+*/
+uint32_t irLower(uint8_t *pX86Addr){
+  struct decodeInfo_t instInfo;
+  uint8_t *pStart = pX86Addr;
+  struct irOp_t *ir;
+  uint8_t count, reg, base, index;
+  uint16_t a, b;
+  uint32_t i, s;
+
+  if(irCount == 0){
+    return 0;
+  }
+
+  irPropagate();
+  irDeadStores();
+  irAddressing();
+  irDeadValues();
+#ifdef DEBUG
+  irDump();
+#endif /* DEBUG */
+
+  for(i = 0; i < irCount; i++){
+    irLastUse[i] = i;
+    ir = &irOps[i];
+    if(ir->op != IR_NOP){
+      for(s = 0; s < 2; s++){
+        if(ir->src[s] != IR_NONE){
+          irLastUse[ir->src[s]] = i;
+        }
+      }
+    }
+  }
+  memset(irHolder, 0xFF, sizeof(irHolder));
+  memset(irHomeValue, 0xFF, sizeof(irHomeValue));
+
+  for(irPos = 0; irPos < irCount; irPos++){
+    ir = &irOps[irPos];
+    a = ir->src[0];
+    b = ir->src[1];
+
+    switch(ir->op){
+      case IR_GET:
+        reg = armHostReg[ir->arm];
+        if(reg != X86_NOREG){
+          irHold(reg, irPos);
+        }else{
+          ir->loc = IR_LOC_HOME;
+          irHomeValue[ir->arm] = irPos;
+        }
+      break;
+      case IR_CONST:
+        ir->loc = IR_LOC_CONST;
+      break;
+      case IR_PUT:
+        pX86Addr += irStoreReg(pX86Addr, ir->arm, a);
+      break;
+      case IR_ALU:
+        reg = irTarget(&pX86Addr, irPos, (a != b)?irRegMask(b):0);
+        base = irOps[a].loc;
+        index = irOps[b].loc;
+        if(ir->kind == IR_ADD && base <= X86_R15 && base != reg &&
+           (index <= X86_R15 || index == IR_LOC_CONST)){
+          /* A sum into another register, without the mov */
+          pX86Addr += emitLea(pX86Addr, reg, base,
+            (index == IR_LOC_CONST)?X86_NOREG:index, 0,
+            (index == IR_LOC_CONST)?irOps[b].imm:0);
+        }else{
+          pX86Addr += irMove(pX86Addr, reg, a);
+          pX86Addr += irAluOp(pX86Addr, ir->kind, reg, b);
+        }
+        irHold(reg, irPos);
+      break;
+      case IR_LEA:
+        base = irInReg(&pX86Addr, a, irRegMask(b));
+        index = irInReg(&pX86Addr, b, 1 << base);
+        reg = irTarget(&pX86Addr, irPos, 0);
+        pX86Addr += emitLea(pX86Addr, reg, base, index, ir->imm, 0);
+        irHold(reg, irPos);
+      break;
+      case IR_SHIFT:
+      case IR_NOT:
+        reg = irTarget(&pX86Addr, irPos, 0);
+        pX86Addr += irMove(pX86Addr, reg, a);
+        count = 0;
+        instInfo.pX86Addr = pX86Addr;
+        ADD_REX(0,0,reg);
+        if(ir->op == IR_SHIFT){
+          ADD_BYTE(X86_OP_SHIFT_IMM8_RM32);
+          ADD_BYTE(0xC0 | (ir->kind << 3) | (reg & 7));
+          ADD_BYTE(ir->imm);
+        }else{
+          ADD_BYTE(X86_OP_NOT_RM32);
+          ADD_BYTE(0xD0 | (reg & 7)); /* MOD R/M - F7 /2 */
+        }
+        pX86Addr += count;
+        irHold(reg, irPos);
+      break;
+      case IR_LOAD:
+        base = irInReg(&pX86Addr, a, 0);
+        reg = irTarget(&pX86Addr, irPos, 0);
+        if(ir->kind == IR_WORD){
+          pX86Addr += irGuestOperand(pX86Addr, FALSE, X86_OP_MOV_TO_REG, reg,
+            base, ir->imm, FALSE);
+        }else{
+          pX86Addr += irGuestOperand(pX86Addr, TRUE, X86_OP_MOVZX_RM8, reg,
+            base, ir->imm, FALSE);
+        }
+        irHold(reg, irPos);
+      break;
+      case IR_STORE:
+        base = irInReg(&pX86Addr, a, irRegMask(b));
+        if(irOps[b].loc == IR_LOC_CONST){
+          pX86Addr += irGuestOperand(pX86Addr, FALSE,
+            (ir->kind == IR_WORD)?X86_OP_MOV_IMM_TO_MEM32:
+            X86_OP_MOV_IMM_TO_MEM8, 0, base, ir->imm, FALSE);
+          count = 0;
+          instInfo.pX86Addr = pX86Addr;
+          if(ir->kind == IR_WORD){
+            ADD_WORD(irOps[b].imm);
+          }else{
+            ADD_BYTE(irOps[b].imm);
+          }
+          pX86Addr += count;
+        }else{
+          reg = irInReg(&pX86Addr, b, 1 << base);
+          pX86Addr += irGuestOperand(pX86Addr, FALSE,
+            (ir->kind == IR_WORD)?X86_OP_MOV_FROM_REG:X86_OP_MOV_REG_TO_RM8,
+            reg, base, ir->imm, (ir->kind == IR_BYTE));
+        }
+      break;
+      default:
+      break;
+    }
+  }
+
+  LOG_INSTR(pStart,pX86Addr - pStart);
+#ifdef PROFILE
+  irRegions++;
+#endif /* PROFILE */
+  irCount = 0;
+  return pX86Addr - pStart;
+}
@@ -1,45 +1,102 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "decode.h"
 #include "debug.h"
 #include "types.h"
 #include "elfload.h"
 #include "codeenv.h"
+#include "aot.h"
 
 void printUsage(void);
+static uint32_t codeCacheSize(void);
+static int translateAhead(struct map_t *memMap, char *armFile,
+    const char *outFile);
 
 int
 main(int argc, char *argv[])
 {
-    struct map_t memMap;
+    struct map_t memMap = { 0 };
+    struct aotTrailer_t trailer;
+    char *armFile, *outFile = NULL;
+    long armOffset = 0;
 
     /*
-     * From the list of arguments, the first is taken to be the
-     * ARM executable and the remaining are taken to be command
-     * line arguments meant for the ARM executable. It follows
-     * that there must be at least one argument to any run of
-     * the binary translator.
+     * An executable made ahead of time carries the ARM executable and
+     * its translation, and all of its arguments are meant for the ARM
+     * executable. Otherwise, from the list of arguments, the first is
+     * taken to be the ARM executable and the remaining are taken to be
+     * command line arguments meant for the ARM executable. It follows
+     * that there must be at least one argument to any run of the binary
+     * translator. With -o, the ARM executable is translated ahead of
+     * time into the executable named after it instead.
      */
-    if (argc == 1) {
+    if (armX86AotFind(AOT_SELF, &trailer)) {
+        armFile = AOT_SELF;
+        armOffset = trailer.armOffset;
+    } else if (argc == 1) {
         printUsage();
         exit(0);
+    } else if (strcmp(argv[1], "-o") == 0 && argc == 4) {
+        outFile = argv[2];
+        armFile = argv[3];
+    } else {
+        armFile = argv[1];
     }
 
-    if ((memMap.pArmInstr = armX86ElfLoad(argv[1])) == NULL) {
+    if (initArmMemory(NULL) == NULL) {
+        DP_ASSERT(0,"Unable to reserve memory for the ARM program\n");
         exit(-1);
     }
 
-    if ((memMap.pX86Instr = (uint8_t *)initX86Code(NULL)) == NULL) {
+    if ((memMap.pArmInstr = armX86ElfLoad(armFile, armOffset)) == NULL) {
+        exit(-1);
+    }
+
+    if (initTranslationIndex(armX86ElfTextSize()) == -1) {
+        DP_ASSERT(0,"Unable to create the translation index\n");
+        exit(-1);
+    }
+
+    memMap.x86CodeSize = (armOffset != 0)?trailer.x86CodeSize:codeCacheSize();
+    if ((memMap.pX86Instr = (uint8_t *)initX86Code(memMap.x86CodeSize))
+        == NULL) {
         DP_ASSERT(0,"Unable to create space for x86 code\n");
         exit(-1);
     }
 
+    if ((memMap.pX86Records = (uint8_t *)initX86Records()) == NULL) {
+        DP_ASSERT(0,"Unable to reserve space for the code cache records\n");
+        exit(-1);
+    }
+
+    /*
+     * Translations may be kept from one run of the same program to the
+     * next in the file named by ARMX86_CODE_CACHE. An executable made
+     * ahead of time brings its own.
+     */
+    if (armOffset != 0) {
+        memMap.x86CachePath = AOT_SELF;
+        memMap.x86CacheOffset = trailer.cacheOffset;
+    } else if (outFile == NULL) {
+        memMap.x86CachePath = getenv("ARMX86_CODE_CACHE");
+    }
+    if (memMap.x86CachePath != NULL || outFile != NULL) {
+        memMap.armImageHash = armX86ElfHash();
+    }
+
     if ((memMap.pArmStackPtr = initArmStack(NULL)) == NULL) {
         DP_ASSERT(0,"Unable to create stack for ARM code\n");
         exit(-1);
     }
 
+    if (outFile != NULL) {
+        return translateAhead(&memMap, armFile, outFile);
+    }
+
     armX86Decode(&memMap);
 
     return 0;
@@ -49,4 +106,85 @@ void
 printUsage(void)
 {
     printf("Usage arm <arm-exe> <arm-exe-arg1> <arm-exe-arg2>...\n");
+    printf("      arm -o <x86-exe> <arm-exe>\n");
+    printf("The second form translates the ARM executable ahead of time "
+        "into an x86\nexecutable that runs it on its own.\n");
+    printf("The size of the x86 code cache may be given in bytes, or with "
+        "a K or M suffix,\nin ARMX86_CODE_SIZE. Translations are kept "
+        "across runs in the file named\nby ARMX86_CODE_CACHE, if it is "
+        "set.\n");
+}
+
+/*
+ * Work out the size of the x86 code cache, from ARMX86_CODE_SIZE in the
+ * environment if it is set. A size below the minimum is raised to it.
+ *
+ * Return: Size of the code cache in bytes.
+ */
+static uint32_t
+codeCacheSize(void)
+{
+    char *env, *suffix;
+    unsigned long size;
+
+    if ((env = getenv("ARMX86_CODE_SIZE")) == NULL) {
+        return X86_CODE_SIZE;
+    }
+
+    size = strtoul(env, &suffix, 0);
+    if (*suffix == 'k' || *suffix == 'K') {
+        size <<= 10;
+    } else if (*suffix == 'm' || *suffix == 'M') {
+        size <<= 20;
+    }
+
+    if (size < X86_CODE_MIN_SIZE) {
+        info(("Code cache size raised to the minimum of %u bytes\n",
+            X86_CODE_MIN_SIZE));
+        size = X86_CODE_MIN_SIZE;
+    } else if (size > X86_CODE_MAX_SIZE) {
+        info(("Code cache size lowered to the maximum of %u bytes\n",
+            X86_CODE_MAX_SIZE));
+        size = X86_CODE_MAX_SIZE;
+    }
+
+    return size;
+}
+
+/*
+ * Translate the ARM executable in armFile ahead of time, from its entry
+ * point and the functions in its symbol table, and make an x86 executable
+ * of it in outFile. Code that is only found at run time is translated
+ * then.
+ *
+ * Return: 0 on success, -1 otherwise.
+ */
+static int
+translateAhead(struct map_t *memMap, char *armFile, const char *outFile)
+{
+#ifdef NOINDEX
+    info(("Translation ahead of time needs the translation index\n"));
+    return -1;
+#else /* NOINDEX */
+    char cacheFile[PATH_MAX];
+    uint32_t *functions, numFunctions, numBlocks;
+    int ret;
+
+    snprintf(cacheFile, sizeof(cacheFile), "%s.cache", outFile);
+    unlink(cacheFile);
+    memMap->x86CachePath = cacheFile;
+
+    numFunctions = armX86ElfFunctions(&functions);
+    numBlocks = armX86Translate(memMap, functions, numFunctions);
+    free(functions);
+
+    ret = armX86AotWrite(outFile, armFile, cacheFile, memMap->x86CodeSize);
+    unlink(cacheFile);
+
+    if (ret == 0) {
+        info(("%s: %u blocks translated from %u functions\n", outFile,
+            numBlocks, numFunctions + 1));
+    }
+    return ret;
+#endif /* NOINDEX */
 }
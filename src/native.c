@@ -0,0 +1,967 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "elfload.h"
+#include "codeenv.h"
+#include "native.h"
+
+/*
+ * Native routines
+ *
+ * Programs spend much of their time in a few C library routines on
+ * memory and strings and, built for soft-float, in the run-time helpers
+ * that the compiler calls for every floating point operation and integer
+ * division. Where the ARM executable names them in its symbol table, the
+ * translator runs host versions in their place (see "Native routines" in
+ * decode.c): the host C library's, which make use of whatever vector
+ * instructions the host has, and scalar SSE arithmetic and div for the
+ * helpers. Each wrapper below takes the arguments of the routine as they
+ * are in r0-r3, and returns what goes in r0, in r0 and r1 as a 64-bit
+ * value, or in r0-r3 as a pair of them, as results says.
+ */
+enum {
+    NATIVE_MEMCPY,
+    NATIVE_MEMMOVE,
+    NATIVE_MEMSET,
+    NATIVE_MEMCMP,
+    NATIVE_STRLEN,
+    NATIVE_STRCMP,
+    NATIVE_MALLOC,
+    NATIVE_FREE,
+    NATIVE_CALLOC,
+    NATIVE_REALLOC,
+    NATIVE_MEMALIGN,
+    NATIVE_POSIX_MEMALIGN,
+    NATIVE_ALIGNED_ALLOC,
+    NATIVE_VALLOC,
+    NATIVE_PVALLOC,
+    NATIVE_MALLOC_USABLE_SIZE,
+    NATIVE_MALLOC_R,
+    NATIVE_FREE_R,
+    NATIVE_CALLOC_R,
+    NATIVE_REALLOC_R,
+    NATIVE_MEMALIGN_R,
+    NATIVE_MALLOC_USABLE_SIZE_R,
+    NATIVE_FADD,
+    NATIVE_FSUB,
+    NATIVE_FRSUB,
+    NATIVE_FMUL,
+    NATIVE_FDIV,
+    NATIVE_FCMPEQ,
+    NATIVE_FCMPLT,
+    NATIVE_FCMPLE,
+    NATIVE_FCMPGE,
+    NATIVE_FCMPGT,
+    NATIVE_FCMPUN,
+    NATIVE_DADD,
+    NATIVE_DSUB,
+    NATIVE_DRSUB,
+    NATIVE_DMUL,
+    NATIVE_DDIV,
+    NATIVE_DCMPEQ,
+    NATIVE_DCMPLT,
+    NATIVE_DCMPLE,
+    NATIVE_DCMPGE,
+    NATIVE_DCMPGT,
+    NATIVE_DCMPUN,
+    NATIVE_F2IZ,
+    NATIVE_F2UIZ,
+    NATIVE_F2LZ,
+    NATIVE_F2ULZ,
+    NATIVE_D2IZ,
+    NATIVE_D2UIZ,
+    NATIVE_D2LZ,
+    NATIVE_D2ULZ,
+    NATIVE_I2F,
+    NATIVE_UI2F,
+    NATIVE_L2F,
+    NATIVE_UL2F,
+    NATIVE_I2D,
+    NATIVE_UI2D,
+    NATIVE_L2D,
+    NATIVE_UL2D,
+    NATIVE_F2D,
+    NATIVE_D2F,
+    NATIVE_IDIV,
+    NATIVE_UIDIV,
+    NATIVE_IDIVMOD,
+    NATIVE_UIDIVMOD,
+    NATIVE_LDIVMOD,
+    NATIVE_ULDIVMOD,
+    NATIVE_DIVSI3,
+    NATIVE_UDIVSI3,
+    NATIVE_MODSI3,
+    NATIVE_UMODSI3,
+    NUM_NATIVE
+};
+
+struct nativeRoutine_t {
+    const char *name;
+    void *host;                     /* Wrapper called in its place */
+    uint32_t results;               /* Registers from r0 it returns */
+#ifdef PROFILE
+    uint64_t calls;
+    uint64_t bytes;                 /* Bytes read or written by them */
+#endif /* PROFILE */
+};
+
+/* What the wrapper of a routine that returns r0-r3 returns */
+struct nativePair_t {
+    uint64_t lo;                    /* r0 and r1, in RAX */
+    uint64_t hi;                    /* r2 and r3, in RDX */
+};
+
+static struct nativeRoutine_t nativeRoutines[NUM_NATIVE];
+static uint32_t nativeAddrs[NUM_NATIVE];    /* 0 if not in the program */
+
+/*
+ * The routines the program has, one per ARM address and sorted by it, for
+ * armX86NativeRoutine() to search.
+ */
+struct nativeEntry_t {
+    uint32_t armAddr;
+    struct nativeRoutine_t *routine;
+};
+
+static struct nativeEntry_t nativeEntries[NUM_NATIVE];
+static uint32_t numNativeEntries;
+
+#ifdef PROFILE
+#define NATIVE_CALL(routine, n)                 \
+    do {                                        \
+        nativeRoutines[routine].calls++;        \
+        nativeRoutines[routine].bytes += (n);   \
+    } while (0)
+#else /* PROFILE */
+#define NATIVE_CALL(routine, n)
+#endif /* PROFILE */
+
+static uint32_t
+nativeMemcpy(uint32_t dst, uint32_t src, uint32_t n)
+{
+    NATIVE_CALL(NATIVE_MEMCPY, n);
+    memcpy(ARM_HOST_ADDR(dst), ARM_HOST_ADDR(src), n);
+    return dst;
+}
+
+static uint32_t
+nativeMemmove(uint32_t dst, uint32_t src, uint32_t n)
+{
+    NATIVE_CALL(NATIVE_MEMMOVE, n);
+    memmove(ARM_HOST_ADDR(dst), ARM_HOST_ADDR(src), n);
+    return dst;
+}
+
+static uint32_t
+nativeMemset(uint32_t dst, uint32_t c, uint32_t n)
+{
+    NATIVE_CALL(NATIVE_MEMSET, n);
+    memset(ARM_HOST_ADDR(dst), (uint8_t)c, n);
+    return dst;
+}
+
+static uint32_t
+nativeMemcmp(uint32_t s1, uint32_t s2, uint32_t n)
+{
+    NATIVE_CALL(NATIVE_MEMCMP, n);
+    return memcmp(ARM_HOST_ADDR(s1), ARM_HOST_ADDR(s2), n);
+}
+
+static uint32_t
+nativeStrlen(uint32_t s)
+{
+    uint32_t n = strlen(ARM_HOST_ADDR(s));
+
+    NATIVE_CALL(NATIVE_STRLEN, n + 1);
+    return n;
+}
+
+static uint32_t
+nativeStrcmp(uint32_t s1, uint32_t s2)
+{
+    NATIVE_CALL(NATIVE_STRCMP, 0);
+    return strcmp(ARM_HOST_ADDR(s1), ARM_HOST_ADDR(s2));
+}
+
+/*
+ * Heap
+ *
+ * malloc() and the routines that go with it hand out blocks of the heap
+ * that the ELF loader reserves after the program. A request is rounded up
+ * to a size class, in steps of HEAP_STEP up to HEAP_SMALL_MAX and in powers
+ * of two above that. Each class keeps a list of its free blocks, linked
+ * through their first word, so allocating and freeing take a few steps and
+ * never search. A block that is not on a list is cut from the end of what
+ * has been handed out so far. Every block follows a header that holds its
+ * class, and is 8 byte aligned, as the EABI asks for. Blocks are never
+ * split or merged, which trades memory for speed.
+ *
+ * The header also holds a tag, made from the address of the block, for as
+ * long as the block is handed out. Pointers into the middle of a block,
+ * pointers that the heap did not hand out and blocks freed already do not
+ * have it, and are left alone by free() and refused by realloc().
+ *
+ * The routines of the program's own allocator never run then, so every
+ * way it has to hand out memory is taken over, memalign() and the newlib
+ * variants with a reentrancy argument included.
+ */
+struct heapHeader_t {
+    uint32_t class;
+    uint32_t tag;                   /* HEAP_TAG(block) while handed out */
+};
+
+#define HEAP_HEADER         8
+#define HEAP_MAGIC          0xA110CA7E
+#define HEAP_TAG(block)     (HEAP_MAGIC ^ (block))
+#define HEAP_HEADER_OF(block) \
+    ((struct heapHeader_t *)ARM_HOST_ADDR((block) - HEAP_HEADER))
+#define HEAP_STEP           16
+#define HEAP_SMALL_MAX      1024
+#define HEAP_SMALL_CLASSES  (HEAP_SMALL_MAX / HEAP_STEP)
+#define HEAP_CLASSES        (HEAP_SMALL_CLASSES + 21)   /* Up to 2GB */
+#define HEAP_PAGE           4096
+
+static uint32_t heapStart;
+static uint32_t heapEnd;
+static uint32_t heapTop;                    /* End of what was handed out */
+static uint32_t heapLists[HEAP_CLASSES];    /* Free blocks, 0 if none */
+
+static uint32_t
+heapClass(uint32_t size)
+{
+    if (size <= HEAP_SMALL_MAX) {
+        return (size == 0) ? 0 : (size - 1) / HEAP_STEP;
+    }
+    return HEAP_SMALL_CLASSES + (32 - __builtin_clz(size - 1)) - 11;
+}
+
+static uint32_t
+heapClassSize(uint32_t class)
+{
+    if (class < HEAP_SMALL_CLASSES) {
+        return (class + 1) * HEAP_STEP;
+    }
+    return (2 * HEAP_SMALL_MAX) << (class - HEAP_SMALL_CLASSES);
+}
+
+/*
+ * Hand out a block of at least size bytes whose address is a multiple of
+ * align, a power of two.
+ *
+ * Return: ARM address of the block, 0 if there is no room for it.
+ */
+static uint32_t
+heapAlloc(uint32_t align, uint32_t size)
+{
+    uint32_t class, block;
+    uint64_t start;
+
+    if (size > heapEnd - heapStart) {
+        return 0;
+    }
+    class = heapClass(size);
+
+    block = heapLists[class];
+    if (block != 0 && (block & (align - 1)) == 0) {
+        heapLists[class] = *(uint32_t *)ARM_HOST_ADDR(block);
+        HEAP_HEADER_OF(block)->tag = HEAP_TAG(block);
+        return block;
+    }
+
+    start = ((uint64_t)heapTop + HEAP_HEADER + align - 1) &
+            ~(uint64_t)(align - 1);
+    if (start + heapClassSize(class) > heapEnd) {
+        return 0;
+    }
+    block = start;
+    HEAP_HEADER_OF(block)->class = class;
+    HEAP_HEADER_OF(block)->tag = HEAP_TAG(block);
+    heapTop = block + heapClassSize(class);
+    return block;
+}
+
+/*
+ * Tell whether block is handed out by the heap: it lies in what has been
+ * handed out so far, is aligned as blocks are, and its header has the tag
+ * of a block at that address and a valid class.
+ *
+ * Return: Size of the block, 0 if it is not.
+ */
+static uint32_t
+heapBlockSize(uint32_t block)
+{
+    struct heapHeader_t *header;
+
+    if (block < heapStart + HEAP_HEADER || block >= heapTop ||
+        (block & (HEAP_HEADER - 1)) != 0) {
+        return 0;
+    }
+    header = HEAP_HEADER_OF(block);
+    if (header->tag != HEAP_TAG(block) || header->class >= HEAP_CLASSES) {
+        return 0;
+    }
+    return heapClassSize(header->class);
+}
+
+/*
+ * Put a block back on the list of its class.
+ *
+ * Return: Size of the block, 0 if it was not the heap's.
+ */
+static uint32_t
+heapRelease(uint32_t block)
+{
+    uint32_t size = heapBlockSize(block), class;
+
+    if (size != 0) {
+        class = HEAP_HEADER_OF(block)->class;
+        HEAP_HEADER_OF(block)->tag = 0;
+        *(uint32_t *)ARM_HOST_ADDR(block) = heapLists[class];
+        heapLists[class] = block;
+    }
+    return size;
+}
+
+static uint32_t
+heapCalloc(uint32_t num, uint32_t size)
+{
+    uint64_t total = (uint64_t)num * size;
+    uint32_t block;
+
+    if (total > UINT32_MAX) {
+        return 0;
+    }
+    block = heapAlloc(HEAP_HEADER, total);
+    if (block != 0) {
+        memset(ARM_HOST_ADDR(block), 0, total);
+    }
+    return block;
+}
+
+static uint32_t
+heapRealloc(uint32_t block, uint32_t size)
+{
+    uint32_t oldSize, newBlock;
+
+    if (block == 0) {
+        return heapAlloc(HEAP_HEADER, size);
+    }
+    if ((oldSize = heapBlockSize(block)) == 0) {
+        return 0;
+    }
+    if (size == 0) {
+        heapRelease(block);
+        return 0;
+    }
+    if (size <= oldSize) {
+        return block;
+    }
+
+    newBlock = heapAlloc(HEAP_HEADER, size);
+    if (newBlock != 0) {
+        memcpy(ARM_HOST_ADDR(newBlock), ARM_HOST_ADDR(block), oldSize);
+        heapRelease(block);
+    }
+    return newBlock;
+}
+
+static uint32_t
+heapMemalign(uint32_t align, uint32_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return 0;
+    }
+    return heapAlloc((align < HEAP_HEADER) ? HEAP_HEADER : align, size);
+}
+
+static uint32_t
+nativeMalloc(uint32_t size)
+{
+    NATIVE_CALL(NATIVE_MALLOC, size);
+    return heapAlloc(HEAP_HEADER, size);
+}
+
+static uint32_t
+nativeFree(uint32_t block)
+{
+    NATIVE_CALL(NATIVE_FREE, heapBlockSize(block));
+    heapRelease(block);
+    return 0;
+}
+
+static uint32_t
+nativeCalloc(uint32_t num, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_CALLOC, (uint64_t)num * size);
+    return heapCalloc(num, size);
+}
+
+static uint32_t
+nativeRealloc(uint32_t block, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_REALLOC, size);
+    return heapRealloc(block, size);
+}
+
+static uint32_t
+nativeMemalign(uint32_t align, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_MEMALIGN, size);
+    return heapMemalign(align, size);
+}
+
+static uint32_t
+nativePosixMemalign(uint32_t pBlock, uint32_t align, uint32_t size)
+{
+    uint32_t block;
+
+    NATIVE_CALL(NATIVE_POSIX_MEMALIGN, size);
+    if (align < sizeof(uint32_t) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    if ((block = heapMemalign(align, size)) == 0) {
+        return ENOMEM;
+    }
+    *(uint32_t *)ARM_HOST_ADDR(pBlock) = block;
+    return 0;
+}
+
+static uint32_t
+nativeAlignedAlloc(uint32_t align, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_ALIGNED_ALLOC, size);
+    return heapMemalign(align, size);
+}
+
+static uint32_t
+nativeValloc(uint32_t size)
+{
+    NATIVE_CALL(NATIVE_VALLOC, size);
+    return heapMemalign(HEAP_PAGE, size);
+}
+
+static uint32_t
+nativePvalloc(uint32_t size)
+{
+    NATIVE_CALL(NATIVE_PVALLOC, size);
+    if (size > UINT32_MAX - (HEAP_PAGE - 1)) {
+        return 0;
+    }
+    return heapMemalign(HEAP_PAGE, (size + HEAP_PAGE - 1) & ~(HEAP_PAGE - 1));
+}
+
+static uint32_t
+nativeUsableSize(uint32_t block)
+{
+    NATIVE_CALL(NATIVE_MALLOC_USABLE_SIZE, 0);
+    return heapBlockSize(block);
+}
+
+static uint32_t
+nativeMallocR(uint32_t reent, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_MALLOC_R, size);
+    return heapAlloc(HEAP_HEADER, size);
+}
+
+static uint32_t
+nativeFreeR(uint32_t reent, uint32_t block)
+{
+    NATIVE_CALL(NATIVE_FREE_R, heapBlockSize(block));
+    heapRelease(block);
+    return 0;
+}
+
+static uint32_t
+nativeCallocR(uint32_t reent, uint32_t num, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_CALLOC_R, (uint64_t)num * size);
+    return heapCalloc(num, size);
+}
+
+static uint32_t
+nativeReallocR(uint32_t reent, uint32_t block, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_REALLOC_R, size);
+    return heapRealloc(block, size);
+}
+
+static uint32_t
+nativeMemalignR(uint32_t reent, uint32_t align, uint32_t size)
+{
+    NATIVE_CALL(NATIVE_MEMALIGN_R, size);
+    return heapMemalign(align, size);
+}
+
+static uint32_t
+nativeUsableSizeR(uint32_t reent, uint32_t block)
+{
+    NATIVE_CALL(NATIVE_MALLOC_USABLE_SIZE_R, 0);
+    return heapBlockSize(block);
+}
+
+/*
+ * Soft-float helpers of the ARM EABI. A float is passed in a register and
+ * a double in a pair, low word first, both as their IEEE bits, which is
+ * what the host's SSE registers hold too. Conversions to an integer round
+ * toward zero and saturate, with NaN giving 0, as libgcc's do.
+ */
+#define LONG(lo, hi)                                    \
+    ((uint64_t)(uint32_t)(lo) | ((uint64_t)(uint32_t)(hi) << 32))
+
+static float
+toFloat(uint32_t bits)
+{
+    float f;
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint32_t
+fromFloat(float f)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static double
+toDouble(uint32_t lo, uint32_t hi)
+{
+    uint64_t bits = LONG(lo, hi);
+    double d;
+
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static uint64_t
+fromDouble(double d)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static uint32_t
+toInt32(double d)
+{
+    if (d != d) {
+        return 0;
+    } else if (d >= 2147483648.0) {
+        return INT32_MAX;
+    } else if (d <= -2147483649.0) {
+        return (uint32_t)INT32_MIN;
+    }
+    return (uint32_t)(int32_t)d;
+}
+
+static uint32_t
+toUint32(double d)
+{
+    if (d != d || d <= -1.0) {
+        return 0;
+    } else if (d >= 4294967296.0) {
+        return UINT32_MAX;
+    }
+    return (uint32_t)d;
+}
+
+static uint64_t
+toInt64(double d)
+{
+    if (d != d) {
+        return 0;
+    } else if (d >= 9223372036854775808.0) {
+        return INT64_MAX;
+    } else if (d < -9223372036854775808.0) {
+        return (uint64_t)INT64_MIN;
+    }
+    return (uint64_t)(int64_t)d;
+}
+
+static uint64_t
+toUint64(double d)
+{
+    if (d != d || d <= -1.0) {
+        return 0;
+    } else if (d >= 18446744073709551616.0) {
+        return UINT64_MAX;
+    }
+    return (uint64_t)d;
+}
+
+/*
+ * The helpers come in families that differ only in the operation, whose
+ * expression has the float or double operands as x and y, or the raw
+ * arguments as a and b.
+ */
+#define FLOAT_OP(fn, routine, expr)                     \
+static uint32_t                                         \
+fn(uint32_t a, uint32_t b)                              \
+{                                                       \
+    float x = toFloat(a), y = toFloat(b);               \
+                                                        \
+    NATIVE_CALL(routine, 0);                            \
+    return (expr);                                      \
+}
+
+#define DOUBLE_OP(fn, routine, type, expr)              \
+static type                                             \
+fn(uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)  \
+{                                                       \
+    double x = toDouble(a0, a1), y = toDouble(b0, b1);  \
+                                                        \
+    NATIVE_CALL(routine, 0);                            \
+    return (expr);                                      \
+}
+
+#define CONVERT(fn, routine, type, expr)                \
+static type                                             \
+fn(uint32_t a, uint32_t b)                              \
+{                                                       \
+    NATIVE_CALL(routine, 0);                            \
+    return (expr);                                      \
+}
+
+FLOAT_OP(nativeFadd,    NATIVE_FADD,    fromFloat(x + y))
+FLOAT_OP(nativeFsub,    NATIVE_FSUB,    fromFloat(x - y))
+FLOAT_OP(nativeFrsub,   NATIVE_FRSUB,   fromFloat(y - x))
+FLOAT_OP(nativeFmul,    NATIVE_FMUL,    fromFloat(x * y))
+FLOAT_OP(nativeFdiv,    NATIVE_FDIV,    fromFloat(x / y))
+FLOAT_OP(nativeFcmpeq,  NATIVE_FCMPEQ,  x == y)
+FLOAT_OP(nativeFcmplt,  NATIVE_FCMPLT,  x < y)
+FLOAT_OP(nativeFcmple,  NATIVE_FCMPLE,  x <= y)
+FLOAT_OP(nativeFcmpge,  NATIVE_FCMPGE,  x >= y)
+FLOAT_OP(nativeFcmpgt,  NATIVE_FCMPGT,  x > y)
+FLOAT_OP(nativeFcmpun,  NATIVE_FCMPUN,  x != x || y != y)
+
+DOUBLE_OP(nativeDadd,   NATIVE_DADD,    uint64_t, fromDouble(x + y))
+DOUBLE_OP(nativeDsub,   NATIVE_DSUB,    uint64_t, fromDouble(x - y))
+DOUBLE_OP(nativeDrsub,  NATIVE_DRSUB,   uint64_t, fromDouble(y - x))
+DOUBLE_OP(nativeDmul,   NATIVE_DMUL,    uint64_t, fromDouble(x * y))
+DOUBLE_OP(nativeDdiv,   NATIVE_DDIV,    uint64_t, fromDouble(x / y))
+DOUBLE_OP(nativeDcmpeq, NATIVE_DCMPEQ,  uint32_t, x == y)
+DOUBLE_OP(nativeDcmplt, NATIVE_DCMPLT,  uint32_t, x < y)
+DOUBLE_OP(nativeDcmple, NATIVE_DCMPLE,  uint32_t, x <= y)
+DOUBLE_OP(nativeDcmpge, NATIVE_DCMPGE,  uint32_t, x >= y)
+DOUBLE_OP(nativeDcmpgt, NATIVE_DCMPGT,  uint32_t, x > y)
+DOUBLE_OP(nativeDcmpun, NATIVE_DCMPUN,  uint32_t, x != x || y != y)
+
+CONVERT(nativeF2iz,     NATIVE_F2IZ,    uint32_t, toInt32(toFloat(a)))
+CONVERT(nativeF2uiz,    NATIVE_F2UIZ,   uint32_t, toUint32(toFloat(a)))
+CONVERT(nativeF2lz,     NATIVE_F2LZ,    uint64_t, toInt64(toFloat(a)))
+CONVERT(nativeF2ulz,    NATIVE_F2ULZ,   uint64_t, toUint64(toFloat(a)))
+CONVERT(nativeD2iz,     NATIVE_D2IZ,    uint32_t, toInt32(toDouble(a, b)))
+CONVERT(nativeD2uiz,    NATIVE_D2UIZ,   uint32_t, toUint32(toDouble(a, b)))
+CONVERT(nativeD2lz,     NATIVE_D2LZ,    uint64_t, toInt64(toDouble(a, b)))
+CONVERT(nativeD2ulz,    NATIVE_D2ULZ,   uint64_t, toUint64(toDouble(a, b)))
+CONVERT(nativeI2f,      NATIVE_I2F,     uint32_t, fromFloat((int32_t)a))
+CONVERT(nativeUi2f,     NATIVE_UI2F,    uint32_t, fromFloat(a))
+CONVERT(nativeL2f,      NATIVE_L2F,     uint32_t,
+    fromFloat((int64_t)LONG(a, b)))
+CONVERT(nativeUl2f,     NATIVE_UL2F,    uint32_t, fromFloat(LONG(a, b)))
+CONVERT(nativeI2d,      NATIVE_I2D,     uint64_t, fromDouble((int32_t)a))
+CONVERT(nativeUi2d,     NATIVE_UI2D,    uint64_t, fromDouble(a))
+CONVERT(nativeL2d,      NATIVE_L2D,     uint64_t,
+    fromDouble((int64_t)LONG(a, b)))
+CONVERT(nativeUl2d,     NATIVE_UL2D,    uint64_t, fromDouble(LONG(a, b)))
+CONVERT(nativeF2d,      NATIVE_F2D,     uint64_t, fromDouble(toFloat(a)))
+CONVERT(nativeD2f,      NATIVE_D2F,     uint32_t,
+    fromFloat((float)toDouble(a, b)))
+
+/*
+ * Integer division helpers, which return the quotient, or the quotient in
+ * the low half and the remainder in the high half of the result. The host
+ * div faults where the ARM helpers do not, so division by zero gives what
+ * libgcc's do, the largest quotient of the sign of the dividend and the
+ * dividend as the remainder, and the most negative number divided by -1
+ * gives itself.
+ */
+static uint64_t
+divmod32(int32_t n, int32_t d)
+{
+    int32_t q;
+
+    if (d == 0) {
+        q = (n > 0) ? INT32_MAX : ((n < 0) ? INT32_MIN : 0);
+    } else if (n == INT32_MIN && d == -1) {
+        q = INT32_MIN;
+    } else {
+        q = n / d;
+    }
+    return LONG(q, (uint32_t)n - (uint32_t)q * (uint32_t)d);
+}
+
+static uint64_t
+udivmod32(uint32_t n, uint32_t d)
+{
+    uint32_t q = (d == 0) ? ((n != 0) ? UINT32_MAX : 0) : n / d;
+
+    return LONG(q, n - q * d);
+}
+
+static struct nativePair_t
+divmod64(int64_t n, int64_t d)
+{
+    struct nativePair_t r;
+    int64_t q;
+
+    if (d == 0) {
+        q = (n > 0) ? INT64_MAX : ((n < 0) ? INT64_MIN : 0);
+    } else if (n == INT64_MIN && d == -1) {
+        q = INT64_MIN;
+    } else {
+        q = n / d;
+    }
+    r.lo = q;
+    r.hi = (uint64_t)n - (uint64_t)q * (uint64_t)d;
+    return r;
+}
+
+static struct nativePair_t
+udivmod64(uint64_t n, uint64_t d)
+{
+    struct nativePair_t r;
+
+    r.lo = (d == 0) ? ((n != 0) ? UINT64_MAX : 0) : n / d;
+    r.hi = n - r.lo * d;
+    return r;
+}
+
+CONVERT(nativeIdiv,     NATIVE_IDIV,    uint32_t, divmod32(a, b))
+CONVERT(nativeUidiv,    NATIVE_UIDIV,   uint32_t, udivmod32(a, b))
+CONVERT(nativeIdivmod,  NATIVE_IDIVMOD, uint64_t, divmod32(a, b))
+CONVERT(nativeUidivmod, NATIVE_UIDIVMOD, uint64_t, udivmod32(a, b))
+CONVERT(nativeDivsi3,   NATIVE_DIVSI3,  uint32_t, divmod32(a, b))
+CONVERT(nativeUdivsi3,  NATIVE_UDIVSI3, uint32_t, udivmod32(a, b))
+CONVERT(nativeModsi3,   NATIVE_MODSI3,  uint32_t, divmod32(a, b) >> 32)
+CONVERT(nativeUmodsi3,  NATIVE_UMODSI3, uint32_t, udivmod32(a, b) >> 32)
+
+static struct nativePair_t
+nativeLdivmod(uint32_t n0, uint32_t n1, uint32_t d0, uint32_t d1)
+{
+    NATIVE_CALL(NATIVE_LDIVMOD, 0);
+    return divmod64(LONG(n0, n1), LONG(d0, d1));
+}
+
+static struct nativePair_t
+nativeUldivmod(uint32_t n0, uint32_t n1, uint32_t d0, uint32_t d1)
+{
+    NATIVE_CALL(NATIVE_ULDIVMOD, 0);
+    return udivmod64(LONG(n0, n1), LONG(d0, d1));
+}
+
+static struct nativeRoutine_t nativeRoutines[NUM_NATIVE] = {
+    [NATIVE_MEMCPY]     = { "memcpy",   nativeMemcpy,   1 },
+    [NATIVE_MEMMOVE]    = { "memmove",  nativeMemmove,  1 },
+    [NATIVE_MEMSET]     = { "memset",   nativeMemset,   1 },
+    [NATIVE_MEMCMP]     = { "memcmp",   nativeMemcmp,   1 },
+    [NATIVE_STRLEN]     = { "strlen",   nativeStrlen,   1 },
+    [NATIVE_STRCMP]     = { "strcmp",   nativeStrcmp,   1 },
+    [NATIVE_MALLOC]     = { "malloc",           nativeMalloc,   1 },
+    [NATIVE_FREE]       = { "free",             nativeFree,     1 },
+    [NATIVE_CALLOC]     = { "calloc",           nativeCalloc,   1 },
+    [NATIVE_REALLOC]    = { "realloc",          nativeRealloc,  1 },
+    [NATIVE_MEMALIGN]   = { "memalign",         nativeMemalign, 1 },
+    [NATIVE_POSIX_MEMALIGN] =
+        { "posix_memalign",   nativePosixMemalign,    1 },
+    [NATIVE_ALIGNED_ALLOC] =
+        { "aligned_alloc",    nativeAlignedAlloc,     1 },
+    [NATIVE_VALLOC]     = { "valloc",           nativeValloc,   1 },
+    [NATIVE_PVALLOC]    = { "pvalloc",          nativePvalloc,  1 },
+    [NATIVE_MALLOC_USABLE_SIZE] =
+        { "malloc_usable_size", nativeUsableSize,     1 },
+    [NATIVE_MALLOC_R]   = { "_malloc_r",        nativeMallocR,  1 },
+    [NATIVE_FREE_R]     = { "_free_r",          nativeFreeR,    1 },
+    [NATIVE_CALLOC_R]   = { "_calloc_r",        nativeCallocR,  1 },
+    [NATIVE_REALLOC_R]  = { "_realloc_r",       nativeReallocR, 1 },
+    [NATIVE_MEMALIGN_R] = { "_memalign_r",      nativeMemalignR, 1 },
+    [NATIVE_MALLOC_USABLE_SIZE_R] =
+        { "_malloc_usable_size_r", nativeUsableSizeR, 1 },
+    [NATIVE_FADD]       = { "__aeabi_fadd",     nativeFadd,     1 },
+    [NATIVE_FSUB]       = { "__aeabi_fsub",     nativeFsub,     1 },
+    [NATIVE_FRSUB]      = { "__aeabi_frsub",    nativeFrsub,    1 },
+    [NATIVE_FMUL]       = { "__aeabi_fmul",     nativeFmul,     1 },
+    [NATIVE_FDIV]       = { "__aeabi_fdiv",     nativeFdiv,     1 },
+    [NATIVE_FCMPEQ]     = { "__aeabi_fcmpeq",   nativeFcmpeq,   1 },
+    [NATIVE_FCMPLT]     = { "__aeabi_fcmplt",   nativeFcmplt,   1 },
+    [NATIVE_FCMPLE]     = { "__aeabi_fcmple",   nativeFcmple,   1 },
+    [NATIVE_FCMPGE]     = { "__aeabi_fcmpge",   nativeFcmpge,   1 },
+    [NATIVE_FCMPGT]     = { "__aeabi_fcmpgt",   nativeFcmpgt,   1 },
+    [NATIVE_FCMPUN]     = { "__aeabi_fcmpun",   nativeFcmpun,   1 },
+    [NATIVE_DADD]       = { "__aeabi_dadd",     nativeDadd,     2 },
+    [NATIVE_DSUB]       = { "__aeabi_dsub",     nativeDsub,     2 },
+    [NATIVE_DRSUB]      = { "__aeabi_drsub",    nativeDrsub,    2 },
+    [NATIVE_DMUL]       = { "__aeabi_dmul",     nativeDmul,     2 },
+    [NATIVE_DDIV]       = { "__aeabi_ddiv",     nativeDdiv,     2 },
+    [NATIVE_DCMPEQ]     = { "__aeabi_dcmpeq",   nativeDcmpeq,   1 },
+    [NATIVE_DCMPLT]     = { "__aeabi_dcmplt",   nativeDcmplt,   1 },
+    [NATIVE_DCMPLE]     = { "__aeabi_dcmple",   nativeDcmple,   1 },
+    [NATIVE_DCMPGE]     = { "__aeabi_dcmpge",   nativeDcmpge,   1 },
+    [NATIVE_DCMPGT]     = { "__aeabi_dcmpgt",   nativeDcmpgt,   1 },
+    [NATIVE_DCMPUN]     = { "__aeabi_dcmpun",   nativeDcmpun,   1 },
+    [NATIVE_F2IZ]       = { "__aeabi_f2iz",     nativeF2iz,     1 },
+    [NATIVE_F2UIZ]      = { "__aeabi_f2uiz",    nativeF2uiz,    1 },
+    [NATIVE_F2LZ]       = { "__aeabi_f2lz",     nativeF2lz,     2 },
+    [NATIVE_F2ULZ]      = { "__aeabi_f2ulz",    nativeF2ulz,    2 },
+    [NATIVE_D2IZ]       = { "__aeabi_d2iz",     nativeD2iz,     1 },
+    [NATIVE_D2UIZ]      = { "__aeabi_d2uiz",    nativeD2uiz,    1 },
+    [NATIVE_D2LZ]       = { "__aeabi_d2lz",     nativeD2lz,     2 },
+    [NATIVE_D2ULZ]      = { "__aeabi_d2ulz",    nativeD2ulz,    2 },
+    [NATIVE_I2F]        = { "__aeabi_i2f",      nativeI2f,      1 },
+    [NATIVE_UI2F]       = { "__aeabi_ui2f",     nativeUi2f,     1 },
+    [NATIVE_L2F]        = { "__aeabi_l2f",      nativeL2f,      1 },
+    [NATIVE_UL2F]       = { "__aeabi_ul2f",     nativeUl2f,     1 },
+    [NATIVE_I2D]        = { "__aeabi_i2d",      nativeI2d,      2 },
+    [NATIVE_UI2D]       = { "__aeabi_ui2d",     nativeUi2d,     2 },
+    [NATIVE_L2D]        = { "__aeabi_l2d",      nativeL2d,      2 },
+    [NATIVE_UL2D]       = { "__aeabi_ul2d",     nativeUl2d,     2 },
+    [NATIVE_F2D]        = { "__aeabi_f2d",      nativeF2d,      2 },
+    [NATIVE_D2F]        = { "__aeabi_d2f",      nativeD2f,      1 },
+    [NATIVE_IDIV]       = { "__aeabi_idiv",     nativeIdiv,     1 },
+    [NATIVE_UIDIV]      = { "__aeabi_uidiv",    nativeUidiv,    1 },
+    [NATIVE_IDIVMOD]    = { "__aeabi_idivmod",  nativeIdivmod,  2 },
+    [NATIVE_UIDIVMOD]   = { "__aeabi_uidivmod", nativeUidivmod, 2 },
+    [NATIVE_LDIVMOD]    = { "__aeabi_ldivmod",  nativeLdivmod,  4 },
+    [NATIVE_ULDIVMOD]   = { "__aeabi_uldivmod", nativeUldivmod, 4 },
+    [NATIVE_DIVSI3]     = { "__divsi3",         nativeDivsi3,   1 },
+    [NATIVE_UDIVSI3]    = { "__udivsi3",        nativeUdivsi3,  1 },
+    [NATIVE_MODSI3]     = { "__modsi3",         nativeModsi3,   1 },
+    [NATIVE_UMODSI3]    = { "__umodsi3",        nativeUmodsi3,  1 },
+};
+
+/*
+ * Find the routines in the symbol table of the ARM executable that was
+ * loaded.
+ *
+ * Return: None
+ */
+void
+armX86NativeInit(void)
+{
+    const char *names[NUM_NATIVE];
+    uint32_t i, j, size;
+
+    for (i = 0; i < NUM_NATIVE; i++) {
+        names[i] = nativeRoutines[i].name;
+    }
+    armX86ElfLookup(names, NUM_NATIVE, nativeAddrs);
+
+    /*
+     * The heap is only reserved for a program that has an allocator to
+     * replace. Without a heap, the program keeps its own allocator.
+     */
+    size = 0;
+    for (i = NATIVE_MALLOC; i <= NATIVE_MALLOC_USABLE_SIZE_R; i++) {
+        if (nativeAddrs[i] != 0) {
+            heapStart = armX86ElfHeap(&size);
+            break;
+        }
+    }
+    heapEnd = heapStart + size;
+    heapTop = heapStart;
+    if (size == 0) {
+        for (i = NATIVE_MALLOC; i <= NATIVE_MALLOC_USABLE_SIZE_R; i++) {
+            nativeAddrs[i] = 0;
+        }
+    }
+
+    /*
+     * Helpers such as __aeabi_idiv and __aeabi_idivmod may be one routine
+     * under two names, in which case it returns all that the name with
+     * the most results does.
+     */
+    numNativeEntries = 0;
+    for (i = 0; i < NUM_NATIVE; i++) {
+        if (nativeAddrs[i] == 0) {
+            continue;
+        }
+        debug(("Native %s for 0x%x\n", names[i], nativeAddrs[i]));
+
+        j = numNativeEntries;
+        while (j > 0 && nativeEntries[j - 1].armAddr > nativeAddrs[i]) {
+            j--;
+        }
+        if (j > 0 && nativeEntries[j - 1].armAddr == nativeAddrs[i]) {
+            if (nativeRoutines[i].results >
+                nativeEntries[j - 1].routine->results) {
+                nativeEntries[j - 1].routine = &nativeRoutines[i];
+            }
+            continue;
+        }
+        memmove(&nativeEntries[j + 1], &nativeEntries[j],
+            (numNativeEntries - j) * sizeof(nativeEntries[0]));
+        nativeEntries[j].armAddr = nativeAddrs[i];
+        nativeEntries[j].routine = &nativeRoutines[i];
+        numNativeEntries++;
+    }
+}
+
+/*
+ * Tell whether an ARM address is the entry of a routine run natively. If
+ * so, and results is not NULL, it is set to the number of registers from
+ * r0 on that the host function returns, 1, 2 or 4.
+ *
+ * Return: Host function to call in its place, or NULL.
+ */
+void *
+armX86NativeRoutine(uint32_t armAddr, uint32_t *results)
+{
+    struct nativeRoutine_t *routine;
+    uint32_t low = 0, high = numNativeEntries, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (nativeEntries[mid].armAddr < armAddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == numNativeEntries || nativeEntries[low].armAddr != armAddr) {
+        return NULL;
+    }
+    routine = nativeEntries[low].routine;
+    if (results != NULL) {
+        *results = routine->results;
+    }
+    return routine->host;
+}
+
+#ifdef PROFILE
+/*
+ * Print how often each routine the program has was run natively, and for
+ * those on memory, how many bytes the calls went through or asked for.
+ * The bytes strcmp compares are not counted.
+ */
+void
+armX86NativeReport(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_NATIVE; i++) {
+        if (nativeAddrs[i] == 0) {
+            continue;
+        }
+        printf("Native %s: %llu calls", nativeRoutines[i].name,
+            (unsigned long long)nativeRoutines[i].calls);
+        if (i < NATIVE_FADD) {
+            printf(", %llu bytes",
+                (unsigned long long)nativeRoutines[i].bytes);
+        }
+        printf("\n");
+    }
+
+    if (heapTop != heapStart) {
+        printf("Native heap: %u of %u bytes handed out\n",
+            heapTop - heapStart, heapEnd - heapStart);
+    }
+}
+#endif /* PROFILE */
@@ -0,0 +1,10 @@
+#ifndef _ARMX86_NATIVE_H
+#define _ARMX86_NATIVE_H
+
+#include <stdint.h>
+
+void armX86NativeInit(void);
+void *armX86NativeRoutine(uint32_t armAddr, uint32_t *results);
+void armX86NativeReport(void);
+
+#endif /* _ARMX86_NATIVE_H */
@@ -6,7 +6,12 @@
 struct map_t{
     uint32_t *pArmInstr;
     uint8_t *pX86Instr;
+    uint32_t x86CodeSize;
+    uint8_t *pX86Records;
     uint32_t *pArmStackPtr;
+    const char *x86CachePath;
+    long x86CacheOffset;
+    uint64_t armImageHash;
 };
 
 typedef enum{